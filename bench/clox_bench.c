@@ -0,0 +1,1012 @@
+// End-to-end benchmark driver for clox.
+//
+// Runs each Lox workload through the scan, compile and execute phases
+// separately, repeating every phase for a number of iterations, and reports
+// the timings as JSON on stdout:
+//
+//   clox_bench [--iterations N] [--warmup N] [--reruns N] [--generate TERMS]
+//              [--jit THRESHOLD] [--batch ROWS] [--check-jit CASES]
+//              [--check-batch CASES] [--check-opt CASES]
+//              [--check-depth DEPTH] [--check-chain OPERANDS]
+//              [--check-server EVALS] [--check-dtoa NUMBERS] [--no-opt]
+//              [--fuel FUEL] [file.lox...]
+//
+// The compile phase runs the compiler's optimization passes, but every
+// workload is a constant expression, which folding reduces to a single
+// constant. So the execute phases run the same source compiled again,
+// untimed, without any passes, and still measure the interpreter. The
+// cached interpret phase compiles without them too, and the instruction
+// counts reported are of the unoptimized chunk.
+//
+// The execute phase is the first run of a freshly compiled chunk, the warm
+// execute phase the mean of re-running that same chunk `reruns` times, as a
+// host which compiles once and evaluates many times would. With --batch, the
+// chunk is also evaluated for ROWS rows at once by interpretBatch(). The
+// cached interpret phase is the mean of passing the same source to
+// interpret() `reruns` more times, after a first call has cached its chunk.
+// With no files, every workload in bench/ plus one generated source is run.
+// Program output produced while executing the workloads is discarded.
+//
+// --check-jit skips the benchmarks and instead runs CASES random expressions
+// through both the interpreter and the JIT, failing on the first whose
+// output or result differs. --check-batch does the same for interpretBatch(),
+// and --check-opt for the compiler's optimization passes against none at
+// all. Their expressions nest up to DEPTH levels, 8 unless --check-depth
+// says otherwise, and chains of additions have up to OPERANDS operands, 6
+// by default. --check-server sends serve() well-formed and malformed
+// requests, truncated frames among them, then EVALS distinct EVAL requests,
+// failing on the first response that isn't the one expected. --check-dtoa
+// formats NUMBERS doubles, the hard cases first, and fails on the first
+// that doesn't come out as the shortest digits reading back. --no-opt
+// leaves those passes out of the compile phase as well, and --fuel meters
+// every execution to FUEL, see VM.fuel.
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "batch.h"
+#include "chunk.h"
+#include "common.h"
+#include "compiler.h"
+#include "dtoa.h"
+#include "memory.h"
+#include "jit.h"
+#include "optimizer.h"
+#include "scanner.h"
+#include "server.h"
+#include "timing.h"
+#include "vm.h"
+
+#ifndef BENCH_DIR
+#define BENCH_DIR "bench"
+#endif
+
+static const char *defaultWorkloads[] = {
+    BENCH_DIR "/arith_tree.lox",
+    BENCH_DIR "/comparison_chain.lox",
+    BENCH_DIR "/string_concat.lox",
+    BENCH_DIR "/constant_pool.lox",
+};
+
+// JIT threshold the benchmarks run with, 0 to only interpret.
+static int jitThreshold = 0;
+// Rows evaluated per interpretBatch() call, 0 to skip the batch phase.
+static int batchRows = 0;
+// Optimization passes every chunk is compiled with, see optimizer.h.
+static int passes = PASS_ALL;
+// Fuel every execution gets, see VM.fuel.
+static int64_t fuel = FUEL_UNLIMITED;
+
+// Stream the report is written to. stdout itself is pointed at /dev/null
+// while workloads run so their printed results don't pollute the JSON.
+static FILE *report;
+
+// Reads a whole file into a freshly allocated, null terminated buffer.
+static char *readFile(const char *path) {
+  FILE *file = fopen(path, "rb");
+  if (file == NULL) {
+    fprintf(stderr, "Could not open file \"%s\".\n", path);
+    exit(74);
+  }
+
+  fseek(file, 0L, SEEK_END);
+  size_t fileSize = ftell(file);
+  rewind(file);
+
+  char *buffer = (char *)malloc(fileSize + 1);
+  if (buffer == NULL) {
+    fprintf(stderr, "Not enough memory to read \"%s\".\n", path);
+    exit(74);
+  }
+
+  size_t bytesRead = fread(buffer, sizeof(char), fileSize, file);
+  buffer[bytesRead] = '\0';
+  fclose(file);
+  return buffer;
+}
+
+// Builds a large expression with `terms` comparison terms chained by `==`.
+// Only the first terms use numeric literals so the source never overflows
+// the 256 entry constant pool, the rest are made of keyword literals.
+static char *generateSource(int terms) {
+  size_t capacity = (size_t)terms * 32 + 1;
+  char *source = (char *)malloc(capacity);
+  size_t length = 0;
+  int constants = 0;
+
+  for (int i = 0; i < terms; i++) {
+    if (i > 0) {
+      length += sprintf(source + length, i % 4 == 0 ? " ==\n" : " == ");
+    }
+    if (constants + 3 <= 240) {
+      length += sprintf(source + length, "(%d.%d * %d < %d)", i, i % 10,
+                        i % 7 + 2, i * 3);
+      constants += 3;
+    } else {
+      length += sprintf(source + length, "!(%s == !nil)",
+                        i % 2 == 0 ? "true" : "false");
+    }
+  }
+
+  source[length] = '\0';
+  return source;
+}
+
+// Counts the instructions in a compiled chunk. Lox has no control flow yet,
+// so each instruction executes exactly once per run.
+static int countInstructions(Chunk *chunk) {
+  int count = 0;
+  for (int offset = 0; offset < chunk->count;
+       offset += instructionLength(chunk->code[offset])) {
+    count++;
+  }
+  return count;
+}
+
+static int compareU64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a;
+  uint64_t y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+// Sorts the samples and prints them as a JSON object of summary statistics.
+static uint64_t reportPhase(const char *name, uint64_t *samples, int count) {
+  qsort(samples, count, sizeof(uint64_t), compareU64);
+  uint64_t total = 0;
+  for (int i = 0; i < count; i++) {
+    total += samples[i];
+  }
+  uint64_t median = samples[count / 2];
+  fprintf(report,
+          "      \"%s_ns\": {\"min\": %llu, \"median\": %llu, \"mean\": "
+          "%llu, \"max\": %llu},\n",
+          name, (unsigned long long)samples[0], (unsigned long long)median,
+          (unsigned long long)(total / count),
+          (unsigned long long)samples[count - 1]);
+  return median;
+}
+
+// Runs one workload through all phases and appends its JSON record.
+static bool benchmark(const char *name, const char *source, int warmup,
+                      int iterations, int reruns, bool first) {
+  uint64_t *scanNs = (uint64_t *)malloc(sizeof(uint64_t) * iterations);
+  uint64_t *compileNs = (uint64_t *)malloc(sizeof(uint64_t) * iterations);
+  uint64_t *executeNs = (uint64_t *)malloc(sizeof(uint64_t) * iterations);
+  uint64_t *warmNs = (uint64_t *)malloc(sizeof(uint64_t) * iterations);
+  uint64_t *batchNs = (uint64_t *)malloc(sizeof(uint64_t) * iterations);
+  uint64_t *cachedNs = (uint64_t *)malloc(sizeof(uint64_t) * iterations);
+  Value *results = (Value *)malloc(sizeof(Value) * (batchRows + 1));
+  InterpretResult *statuses =
+      (InterpretResult *)malloc(sizeof(InterpretResult) * (batchRows + 1));
+  int tokens = 0;
+  int instructions = 0;
+  int codeBytes = 0;
+  int constants = 0;
+  size_t allocations = 0;
+  size_t bytesAllocated = 0;
+  InterpretResult status = INTERPRET_OK;
+
+  for (int i = -warmup; i < iterations; i++) {
+    // Fresh VM per iteration so allocation counts and the object list only
+    // reflect this run.
+    initVM();
+    vm.jitEnabled = jitThreshold > 0;
+    vm.jitThreshold = jitThreshold;
+    vm.passes = passes;
+    vm.fuel = fuel;
+
+    uint64_t start = nowNs();
+    initScanner(source);
+    int scanned = 0;
+    for (;;) {
+      Token token = scanToken();
+      scanned++;
+      if (token.type == TOKEN_EOF) {
+        break;
+      }
+    }
+    uint64_t scannedAt = nowNs();
+
+    Chunk optimized;
+    initChunk(&optimized);
+    bool compiled = compile(source, &optimized);
+    uint64_t compiledAt = nowNs();
+
+    Chunk chunk;
+    initChunk(&chunk);
+    if (compiled) {
+      vm.passes = 0;
+      compiled = compile(source, &chunk);
+    }
+    if (!compiled) {
+      freeChunk(&optimized);
+      freeChunk(&chunk);
+      freeVM();
+      status = INTERPRET_COMPILE_ERROR;
+      break;
+    }
+
+    // Only what the run itself allocates counts, not the compiles.
+    size_t allocationsBefore = vm.allocations;
+    size_t bytesBefore = vm.bytesAllocated;
+    uint64_t executeStart = nowNs();
+    status = interpretChunk(&chunk);
+    uint64_t executedAt = nowNs();
+    size_t runAllocations = vm.allocations - allocationsBefore;
+    size_t runBytes = vm.bytesAllocated - bytesBefore;
+    freeChunk(&optimized);
+
+    for (int r = 0; r < reruns && status == INTERPRET_OK; r++) {
+      status = interpretChunk(&chunk);
+    }
+    uint64_t rerunAt = nowNs();
+
+    if (batchRows > 0 && status == INTERPRET_OK) {
+      interpretBatch(&chunk, NULL, batchRows, results, statuses);
+      status = statuses[batchRows - 1];
+    }
+    uint64_t batchedAt = nowNs();
+
+    if (reruns > 0 && status == INTERPRET_OK) {
+      status = interpret(source);
+    }
+    uint64_t cachedStart = nowNs();
+    for (int r = 0; r < reruns && status == INTERPRET_OK; r++) {
+      status = interpret(source);
+    }
+    uint64_t cachedAt = nowNs();
+
+    if (i >= 0) {
+      scanNs[i] = scannedAt - start;
+      compileNs[i] = compiledAt - scannedAt;
+      executeNs[i] = executedAt - executeStart;
+      warmNs[i] = (rerunAt - executedAt) / (reruns > 0 ? reruns : 1);
+      batchNs[i] = batchedAt - rerunAt;
+      cachedNs[i] = (cachedAt - cachedStart) / (reruns > 0 ? reruns : 1);
+      tokens = scanned;
+      instructions = countInstructions(&chunk);
+      codeBytes = chunk.count;
+      constants = chunk.constants.count;
+      allocations = runAllocations;
+      bytesAllocated = runBytes;
+    }
+
+    freeChunk(&chunk);
+    freeVM();
+    if (status != INTERPRET_OK) {
+      break;
+    }
+  }
+
+  fprintf(report, "%s    {\n", first ? "" : ",\n");
+  fprintf(report, "      \"name\": \"%s\",\n", name);
+  if (status != INTERPRET_OK) {
+    fprintf(report, "      \"error\": \"%s\"\n    }",
+            status == INTERPRET_COMPILE_ERROR   ? "compile"
+            : status == INTERPRET_RUNTIME_ERROR ? "runtime"
+                                                : "fuel");
+  } else {
+    fprintf(report, "      \"iterations\": %d,\n", iterations);
+    fprintf(report, "      \"source_bytes\": %zu,\n", strlen(source));
+    fprintf(report, "      \"tokens\": %d,\n", tokens);
+    fprintf(report, "      \"instructions\": %d,\n", instructions);
+    fprintf(report, "      \"code_bytes\": %d,\n", codeBytes);
+    fprintf(report, "      \"constants\": %d,\n", constants);
+    reportPhase("scan", scanNs, iterations);
+    reportPhase("compile", compileNs, iterations);
+    uint64_t execute = reportPhase("execute", executeNs, iterations);
+    if (batchRows > 0) {
+      uint64_t batch = reportPhase("execute_batch", batchNs, iterations);
+      fprintf(report, "      \"batch_rows\": %d,\n", batchRows);
+      fprintf(report, "      \"batch_ns_per_row\": %.2f,\n",
+              (double)batch / batchRows);
+    }
+    fprintf(report, "      \"ns_per_op\": %.2f,\n",
+            (double)execute / (instructions > 0 ? instructions : 1));
+    if (reruns > 0) {
+      uint64_t warm = reportPhase("execute_warm", warmNs, iterations);
+      fprintf(report, "      \"warm_ns_per_op\": %.2f,\n",
+              (double)warm / (instructions > 0 ? instructions : 1));
+      reportPhase("interpret_cached", cachedNs, iterations);
+    }
+    fprintf(report, "      \"allocations_per_run\": %zu,\n", allocations);
+    fprintf(report, "      \"bytes_allocated_per_run\": %zu\n    }",
+            bytesAllocated);
+  }
+
+  free(scanNs);
+  free(compileNs);
+  free(executeNs);
+  free(warmNs);
+  free(batchNs);
+  free(cachedNs);
+  free(results);
+  free(statuses);
+  return status == INTERPRET_OK;
+}
+
+// Inputs every random expression may refer to.
+static const char *randomInputNames[] = {"a", "b", "c"};
+#define RANDOM_INPUTS 3
+
+// Shapes of the random expressions the --check modes generate.
+typedef struct RandomShape {
+  // Case `i` nests at most 1 + i % maxDepth levels. Beyond depth 8 only
+  // one operand of each op keeps nesting, so deep expressions grow
+  // linearly rather than exponentially.
+  int maxDepth;
+  // Most operands a chain of additions gets.
+  int maxChain;
+} RandomShape;
+
+static RandomShape shape = {8, 6};
+
+// Numbers random expressions pick from: small ones the compiler emits as
+// immediates, others on either side of the 16-bit immediate range and some
+// beyond what a double holds exactly.
+static const char *randomNumbers[] = {
+    "0",          "1",
+    "2.5",        "7",
+    "0.1",        "32767",
+    "32768",      "4294967296",
+    "1000000000", "9007199254740993",
+    "100000000000000000000000", "123456789012345678901234567890.5"};
+#define RANDOM_NUMBERS (sizeof(randomNumbers) / sizeof(randomNumbers[0]))
+
+// Appends a random expression of at most `depth` levels to `out`, mixing
+// every kind of value and operator so both the JIT's fast paths and its
+// exits back to the interpreter, runtime errors included, are exercised.
+static size_t randomExpression(char *out, int depth, int *constants) {
+  // Past the depth a balanced tree stays small at, every level is an op
+  // but only one of its operands nests further.
+  int choice = depth > 8 ? 5 + rand() % 9 : rand() % (depth > 0 ? 14 : 5);
+  if (*constants >= 200 && choice < 2) {
+    choice = 2;
+  }
+  int shallow = depth > 8 ? rand() % 3 : depth - 1;
+  switch (choice) {
+  case 0:
+    (*constants)++;
+    return sprintf(out, "%s", randomNumbers[rand() % RANDOM_NUMBERS]);
+  case 1:
+    (*constants)++;
+    return sprintf(out, "\"%c\"", 'a' + rand() % 3);
+  case 2:
+    return sprintf(out, "%s", rand() % 2 ? "true" : "false");
+  case 3:
+    return sprintf(out, "nil");
+  case 4:
+    return sprintf(out, "%s", randomInputNames[rand() % RANDOM_INPUTS]);
+  case 5:
+  case 6: {
+    size_t length = sprintf(out, "%s(", rand() % 2 ? "-" : "!");
+    length += randomExpression(out + length, depth - 1, constants);
+    return length + sprintf(out + length, ")");
+  }
+  case 13: {
+    // A chain of additions, which lowers to OP_CONCAT when it has strings.
+    size_t length = sprintf(out, "(");
+    int operands = 3 + rand() % (shape.maxChain > 3 ? shape.maxChain - 2 : 1);
+    for (int i = 0; i < operands; i++) {
+      if (i > 0) {
+        length += sprintf(out + length, " + ");
+      }
+      length += randomExpression(
+          out + length, i == 0 && depth > 8 ? depth - 1 : 0, constants);
+    }
+    return length + sprintf(out + length, ")");
+  }
+  default: {
+    static const char *operators[] = {"+",  "-",  "*",  "/", "==",
+                                      "!=", "<",  "<=", ">", ">="};
+    size_t length = sprintf(out, "(");
+    char *left = out + length;
+    int before = *constants;
+    // Deep ones mostly nest on the right, where each level holds a slot.
+    bool leftDeep = rand() % (depth > 8 ? 4 : 2) == 0;
+    size_t leftLength = randomExpression(
+        left, leftDeep ? depth - 1 : shallow, constants);
+    length += leftLength;
+    length += sprintf(out + length, " %s ", operators[rand() % 10]);
+    // Repeat the left operand now and then, so common subexpression
+    // elimination has something to share.
+    if (rand() % 4 == 0 && depth <= 8 && *constants * 2 - before < 200) {
+      memcpy(out + length, left, leftLength);
+      length += leftLength;
+      *constants += *constants - before;
+    } else {
+      length += randomExpression(out + length,
+                                 leftDeep ? shallow : depth - 1, constants);
+    }
+    return length + sprintf(out + length, ")");
+  }
+  }
+}
+
+// Appends `(k op (k op (... k)))` nested `depth` levels of small integers,
+// which the compiler emits as immediates. So only the stack limits how deep
+// it can nest, while folding reduces it to a single constant.
+static size_t immediateSpine(char *out, int depth) {
+  static const char *operators[] = {"+", "-", "*"};
+  size_t length = 0;
+  for (int i = 0; i < depth; i++) {
+    length += sprintf(out + length, "(%d %s ", rand() % 10,
+                      operators[rand() % 3]);
+  }
+  length += sprintf(out + length, "%d", rand() % 10);
+  for (int i = 0; i < depth; i++) {
+    out[length++] = ')';
+  }
+  out[length] = '\0';
+  return length;
+}
+
+// Returns the value of input `slot` in row `row` of a random expression's
+// inputs. Rows differ so the batch engine sees lanes of mixed types.
+static Value randomInput(int row, int slot) {
+  switch ((row * RANDOM_INPUTS + slot) % 6) {
+  case 0:
+    return NUMBER_VAL(row + slot);
+  case 1:
+    return NUMBER_VAL(-0.5 * slot);
+  case 2:
+    return OBJ_VAL(copyString("in", 2));
+  case 3:
+    return BOOL_VAL(row % 2 == 0);
+  case 4:
+    return NIL_VAL;
+  default:
+    return NUMBER_VAL(3);
+  }
+}
+
+// How a --check mode runs an expression.
+typedef struct RunConfig {
+  const char *name;
+  // Optimization passes it is compiled with, see optimizer.h.
+  int passes;
+  // JIT threshold, 0 to only interpret.
+  int threshold;
+  // Evaluate the runs as the rows of a single interpretBatch() call.
+  bool batch;
+} RunConfig;
+
+// Runs `source` `runs` times as `config` says, capturing everything printed
+// to stdout in `output`, followed by a line with the status of each run that
+// failed. Error messages on stderr are only captured `withErrors`.
+// Batched runs print their results the way OP_RETURN prints them.
+// Run or row `i` reads its inputs from randomInput(i, slot).
+// Returns the result of the last run.
+static InterpretResult runCaptured(const char *source, const RunConfig *config,
+                                   int runs, bool withErrors, char *output,
+                                   size_t size) {
+  FILE *capture = tmpfile();
+  FILE *errors = withErrors ? capture : tmpfile();
+  fflush(stdout);
+  fflush(stderr);
+  int savedOut = dup(STDOUT_FILENO);
+  int savedErr = dup(STDERR_FILENO);
+  dup2(fileno(capture), STDOUT_FILENO);
+  dup2(fileno(errors), STDERR_FILENO);
+
+  initVM();
+  vm.jitEnabled = config->threshold > 0;
+  vm.jitThreshold = config->threshold;
+  vm.passes = config->passes;
+  Chunk chunk;
+  initChunk(&chunk);
+  InterpretResult result = INTERPRET_COMPILE_ERROR;
+  Value columns[RANDOM_INPUTS][BATCH_LANES];
+  const Value *columnPointers[RANDOM_INPUTS];
+  for (int slot = 0; slot < RANDOM_INPUTS; slot++) {
+    for (int i = 0; i < runs; i++) {
+      columns[slot][i] = randomInput(i, slot);
+    }
+    columnPointers[slot] = columns[slot];
+  }
+
+  if (!compileInputs(source, &chunk, randomInputNames, RANDOM_INPUTS)) {
+    // Leave the result a compile error.
+  } else if (config->batch) {
+    Value results[BATCH_LANES];
+    InterpretResult statuses[BATCH_LANES];
+    interpretBatch(&chunk, columnPointers, runs, results, statuses);
+    for (int i = 0; i < runs; i++) {
+      if (statuses[i] == INTERPRET_OK) {
+        printValue(results[i]);
+        writeOutput(&vm.output, "\n", 1);
+      } else {
+        printOutput(&vm.output, "! %d\n", statuses[i]);
+      }
+      result = statuses[i];
+    }
+  } else {
+    for (int i = 0; i < runs; i++) {
+      Value inputs[RANDOM_INPUTS];
+      for (int slot = 0; slot < RANDOM_INPUTS; slot++) {
+        inputs[slot] = columns[slot][i];
+      }
+      result = interpretInputs(&chunk, inputs);
+      if (result != INTERPRET_OK) {
+        printOutput(&vm.output, "! %d\n", result);
+      }
+    }
+  }
+  freeChunk(&chunk);
+  freeVM();
+
+  fflush(stdout);
+  fflush(stderr);
+  dup2(savedOut, STDOUT_FILENO);
+  dup2(savedErr, STDERR_FILENO);
+  close(savedOut);
+  close(savedErr);
+
+  rewind(capture);
+  size_t length = fread(output, 1, size - 1, capture);
+  output[length] = '\0';
+  fclose(capture);
+  if (errors != capture) {
+    fclose(errors);
+  }
+  return result;
+}
+
+// Differentially tests each of the `count` configurations in `actual`
+// against `expected` on `cases` random expressions generated from `seed`,
+// failing on the first whose output or result differs. Each case runs 3 to
+// 8 times, so the JIT compiles both fresh chunks and, at threshold 2,
+// chunks the interpreter already quickened. The batch engine doesn't print
+// runtime errors, so when a side is batched only their statuses count.
+static bool checkDifferential(const char *name, unsigned seed, int cases,
+                              const RunConfig *expected,
+                              const RunConfig *actual, int count) {
+  static char source[1 << 18];
+  static char want[1 << 16];
+  static char got[1 << 16];
+  bool withErrors = !expected->batch;
+  for (int c = 0; c < count; c++) {
+    withErrors &= !actual[c].batch;
+  }
+  srand(seed);
+
+  for (int i = 0; i < cases; i++) {
+    // Every 32nd case nests hundreds of levels, deep enough for many to
+    // overflow the stack, which must be a compile error everywhere. Every
+    // other one of those is all immediates, which folding would flatten.
+    int depth = i % 32 == 31 ? 256 + i % 512 : 1 + i % shape.maxDepth;
+    int constants = 0;
+    if (i % 64 == 63) {
+      immediateSpine(source, 240 + i / 64 % 32);
+    } else {
+      size_t length = randomExpression(source, depth, &constants);
+      source[length] = '\0';
+    }
+
+    int runs = 3 + i % 6;
+    InterpretResult wantResult =
+        runCaptured(source, expected, runs, withErrors, want, sizeof(want));
+    for (int c = 0; c < count; c++) {
+      InterpretResult gotResult =
+          runCaptured(source, &actual[c], runs, withErrors, got, sizeof(got));
+      if (gotResult != wantResult || strcmp(want, got) != 0) {
+        fprintf(stderr,
+                "%s mismatch for: %s\n"
+                "%s (%d):\n%s%s (%d):\n%s",
+                name, source, expected->name, wantResult, want,
+                actual[c].name, gotResult, got);
+        return false;
+      }
+    }
+  }
+  fprintf(report, "{\"%s_cases\": %d, \"mismatches\": 0}\n", name, cases);
+  return true;
+}
+
+// The JIT at thresholds 1 and 2 against the interpreter.
+static bool checkJit(int cases) {
+#ifndef JIT_SUPPORTED
+  fprintf(stderr, "The JIT is not supported on this platform.\n");
+  (void)cases;
+  return true;
+#else
+  RunConfig interpreter = {"interpreter", passes, 0, false};
+  RunConfig jit[] = {{"jit at threshold 1", passes, 1, false},
+                     {"jit at threshold 2", passes, 2, false}};
+  return checkDifferential("jit", 1, cases, &interpreter, jit, 2);
+#endif
+}
+
+// interpretBatch() against the interpreter.
+static bool checkBatch(int cases) {
+  RunConfig interpreter = {"interpreter", passes, 0, false};
+  RunConfig batch = {"batch", passes, 0, true};
+  return checkDifferential("batch", 2, cases, &interpreter, &batch, 1);
+}
+
+// The optimization passes against none at all. Runtime errors must be the
+// same ones, reported on the same lines.
+static bool checkOpt(int cases) {
+  RunConfig unoptimized = {"unoptimized", 0, 0, false};
+  RunConfig optimized = {"optimized", PASS_ALL, 0, false};
+  return checkDifferential("opt", 3, cases, &unoptimized, &optimized, 1);
+}
+
+// A request frame for checkServer(), without its length.
+typedef struct Request {
+  uint8_t bytes[256];
+  size_t length;
+} Request;
+
+static void appendBytes(Request *request, const void *bytes, size_t length) {
+  memcpy(request->bytes + request->length, bytes, length);
+  request->length += length;
+}
+
+static void appendU8(Request *request, uint8_t value) {
+  appendBytes(request, &value, 1);
+}
+
+static void appendU32(Request *request, uint32_t value) {
+  appendBytes(request, &value, sizeof(value));
+}
+
+static bool readAll(int fd, void *buffer, size_t length) {
+  uint8_t *at = (uint8_t *)buffer;
+  while (length > 0) {
+    ssize_t count = read(fd, at, length);
+    if (count <= 0) {
+      return false;
+    }
+    at += count;
+    length -= count;
+  }
+  return true;
+}
+
+// Sends a request and checks the response has `status` and, unless it is
+// NULL, `output` as its payload. The payload is left in `payload`.
+static bool expectResponse(int fd, const Request *request,
+                           ResponseStatus status, const char *output,
+                           char *payload, size_t size) {
+  uint32_t length = (uint32_t)request->length;
+  uint8_t got = UINT8_MAX;
+  payload[0] = '\0';
+  if (write(fd, &length, sizeof(length)) != sizeof(length) ||
+      write(fd, request->bytes, request->length) != (ssize_t)length ||
+      !readAll(fd, &length, sizeof(length)) || length == 0 ||
+      length > size || !readAll(fd, &got, 1) ||
+      !readAll(fd, payload, length - 1)) {
+    fprintf(stderr, "Server hung up on request %d of %zu bytes.\n",
+            request->bytes[0], request->length);
+    return false;
+  }
+  payload[length - 1] = '\0';
+  if (got != status || (output != NULL && strcmp(output, payload) != 0)) {
+    fprintf(stderr,
+            "Server mismatch for request %d of %zu bytes:\n"
+            "expected (%d): %sgot (%d): %s\n",
+            request->bytes[0], request->length, status,
+            output != NULL ? output : "", got, payload);
+    return false;
+  }
+  return true;
+}
+
+// Tests serve() over a socket: well-formed and malformed requests of every
+// type, truncated frames included, then `evals` distinct EVAL requests on
+// the same connection, which must all be answered by the same worker.
+static bool checkServer(int evals) {
+  char path[64];
+  snprintf(path, sizeof(path), "/tmp/clox_bench_%d.sock", (int)getpid());
+  fflush(report);
+  fflush(stderr);
+  pid_t server = fork();
+  if (server == 0) {
+    initVM();
+    _exit(serve(path, 1) ? 0 : 1);
+  }
+
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  strcpy(address.sun_path, path);
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  bool connected = false;
+  // Until the server is listening.
+  for (int attempt = 0; fd >= 0 && !connected && attempt < 1000; attempt++) {
+    connected =
+        connect(fd, (struct sockaddr *)&address, sizeof(address)) == 0;
+    if (!connected) {
+      usleep(1000);
+    }
+  }
+
+  static char payload[1 << 16];
+  Request request;
+  bool passed = connected;
+#define EXPECT(status, output)                                                 \
+  passed = passed && expectResponse(fd, &request, status, output, payload,    \
+                                    sizeof(payload))
+#define EVAL(source)                                                           \
+  (request.length = 0, appendU8(&request, REQUEST_EVAL),                       \
+   appendBytes(&request, source, strlen(source)))
+
+  EVAL("1 + 2");
+  EXPECT(RESPONSE_OK, "3\n");
+  EVAL("1 +");
+  EXPECT(RESPONSE_COMPILE_ERROR,
+         "[line 1] Error at end: Exprect expression.\n");
+  EVAL("-nil");
+  EXPECT(RESPONSE_RUNTIME_ERROR,
+         "Operand must be a number.\n[line 1] in script\n");
+
+  request.length = 0;
+  appendU8(&request, REQUEST_COMPILE);
+  appendU8(&request, 1);
+  appendU8(&request, 1);
+  appendBytes(&request, "x", 1);
+  appendBytes(&request, "x * 2", 5);
+  EXPECT(RESPONSE_OK, NULL);
+  uint32_t id = 0;
+  memcpy(&id, payload, sizeof(id));
+  // A source using an input it wasn't given.
+  request.bytes[4] = 'y';
+  EXPECT(RESPONSE_COMPILE_ERROR, "[line 1] Error: Undefined input.\n");
+
+  double number = 21;
+  request.length = 0;
+  appendU8(&request, REQUEST_RUN);
+  appendU32(&request, id);
+  appendU8(&request, VAL_NUMBER);
+  appendBytes(&request, &number, sizeof(number));
+  EXPECT(RESPONSE_OK, "42\n");
+  // The same with the number cut short.
+  request.length -= 3;
+  EXPECT(RESPONSE_BAD_REQUEST, "");
+  // No program has this id.
+  request.length = 0;
+  appendU8(&request, REQUEST_RUN);
+  appendU32(&request, id + 7);
+  EXPECT(RESPONSE_BAD_REQUEST, "");
+  // Nor does a truncated id.
+  request.length = 3;
+  EXPECT(RESPONSE_BAD_REQUEST, "");
+
+  // A name longer than the rest of the frame.
+  request.length = 0;
+  appendU8(&request, REQUEST_COMPILE);
+  appendU8(&request, 1);
+  appendU8(&request, 200);
+  EXPECT(RESPONSE_BAD_REQUEST, "");
+  // Fewer names than the count.
+  request.length = 0;
+  appendU8(&request, REQUEST_COMPILE);
+  appendU8(&request, 3);
+  appendU8(&request, 1);
+  appendBytes(&request, "a", 1);
+  EXPECT(RESPONSE_BAD_REQUEST, "");
+
+  request.length = 0;
+  appendU8(&request, 9);
+  EXPECT(RESPONSE_BAD_REQUEST, "");
+
+  for (int i = 0; i < evals && passed; i++) {
+    char source[64];
+    char output[64];
+    snprintf(source, sizeof(source), "\"k%d\" + \"!\"", i);
+    snprintf(output, sizeof(output), "k%d!\n", i);
+    EVAL(source);
+    EXPECT(RESPONSE_OK, output);
+  }
+  EVAL("1 + 2");
+  EXPECT(RESPONSE_OK, "3\n");
+#undef EVAL
+#undef EXPECT
+
+  if (fd >= 0) {
+    close(fd);
+  }
+  kill(server, SIGTERM);
+  waitpid(server, NULL, 0);
+  if (!connected) {
+    fprintf(stderr, "Could not connect to the server at \"%s\".\n", path);
+  }
+  if (passed) {
+    fprintf(report, "{\"server_evals\": %d, \"mismatches\": 0}\n", evals);
+  }
+  return passed;
+}
+
+// Doubles whose shortest digits are easy to get wrong, 1e23 being the
+// nearest double to 10^23 which only reads back from `1e23` by a hair.
+static const double hardNumbers[] = {
+    1e23, 5e-324, 2.2250738585072014e-308, 1.7976931348623157e308,
+    9007199254740993.0, 0.1, 0.3, 1e21, 1e-7, 123456789012345678.0,
+};
+#define HARD_NUMBERS (sizeof(hardNumbers) / sizeof(hardNumbers[0]))
+
+// Counts the significant digits of formatted number.
+static int significantDigits(const char *text) {
+  int digits = 0;
+  int zeros = 0;
+  for (; *text != '\0' && *text != 'e'; text++) {
+    if (*text >= '1' && *text <= '9') {
+      digits += zeros + 1;
+      zeros = 0;
+    } else if (*text == '0' && digits > 0) {
+      zeros++;
+    }
+  }
+  return digits;
+}
+
+// formatNumber() against the shortest correctly rounded digits printf()
+// finds by trying every precision.
+static bool checkDtoa(int numbers) {
+  uint64_t state = 88172645463325252ULL;
+  for (int i = 0; i < numbers; i++) {
+    double value;
+    if (i < (int)HARD_NUMBERS) {
+      value = hardNumbers[i];
+    } else {
+      // Whole numbers, short decimals, and any bits at all.
+      state ^= state << 13;
+      state ^= state >> 7;
+      state ^= state << 17;
+      if (i % 3 == 0) {
+        value = (double)(state >> state % 64);
+      } else if (i % 3 == 1) {
+        value = (double)(state % 1000000) / (1 + (state >> 40) % 10000);
+      } else {
+        memcpy(&value, &state, sizeof(value));
+      }
+      if (value != value || value - value != 0 || value == 0) {
+        continue;
+      }
+    }
+
+    char expected[32];
+    int precision = 1;
+    for (; precision < 17; precision++) {
+      snprintf(expected, sizeof(expected), "%.*e", precision - 1, value);
+      if (strtod(expected, NULL) == value) {
+        break;
+      }
+    }
+    char actual[DTOA_BUFFER_SIZE];
+    formatNumber(value, actual);
+    if (strtod(actual, NULL) != value ||
+        significantDigits(actual) != precision) {
+      fprintf(stderr, "Number %d, %.17g, formats as %s, expected %.*e.\n",
+              i, value, actual, precision - 1, value);
+      return false;
+    }
+  }
+  fprintf(report, "{\"dtoa_numbers\": %d, \"mismatches\": 0}\n", numbers);
+  return true;
+}
+
+int main(int argc, const char *argv[]) {
+  int iterations = 200;
+  int warmup = 20;
+  int reruns = 10;
+  int generated = 2000;
+  int checkCases = 0;
+  int checkBatchCases = 0;
+  int checkOptCases = 0;
+  int checkServerEvals = -1;
+  int checkDtoaNumbers = 0;
+  int defaultCount = sizeof(defaultWorkloads) / sizeof(defaultWorkloads[0]);
+  const char **files =
+      (const char **)malloc(sizeof(const char *) * (argc + defaultCount));
+  int fileCount = 0;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--iterations") == 0 && i + 1 < argc) {
+      iterations = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--warmup") == 0 && i + 1 < argc) {
+      warmup = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--reruns") == 0 && i + 1 < argc) {
+      reruns = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--generate") == 0 && i + 1 < argc) {
+      generated = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--jit") == 0 && i + 1 < argc) {
+      jitThreshold = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+      batchRows = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--check-jit") == 0 && i + 1 < argc) {
+      checkCases = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--check-batch") == 0 && i + 1 < argc) {
+      checkBatchCases = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--check-opt") == 0 && i + 1 < argc) {
+      checkOptCases = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--check-depth") == 0 && i + 1 < argc) {
+      shape.maxDepth = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--check-chain") == 0 && i + 1 < argc) {
+      shape.maxChain = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--check-server") == 0 && i + 1 < argc) {
+      checkServerEvals = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--check-dtoa") == 0 && i + 1 < argc) {
+      checkDtoaNumbers = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--no-opt") == 0) {
+      passes = 0;
+    } else if (strcmp(argv[i], "--fuel") == 0 && i + 1 < argc) {
+      fuel = strtoll(argv[++i], NULL, 10);
+    } else if (argv[i][0] == '-') {
+      fprintf(stderr, "Usage: clox_bench [--iterations N] [--warmup N] "
+                      "[--reruns N] [--generate TERMS] [--jit THRESHOLD] "
+                      "[--batch ROWS] [--check-jit CASES] "
+                      "[--check-batch CASES] [--check-opt CASES] "
+                      "[--check-depth DEPTH] [--check-chain OPERANDS] "
+                      "[--check-server EVALS] [--check-dtoa NUMBERS] "
+                      "[--no-opt] [--fuel FUEL] [file.lox...]\n");
+      exit(64);
+    } else {
+      files[fileCount++] = argv[i];
+    }
+  }
+  if (shape.maxDepth < 1) {
+    shape.maxDepth = 1;
+  }
+  if (iterations < 1) {
+    iterations = 1;
+  }
+
+  bool useDefaults = fileCount == 0;
+  if (useDefaults) {
+    fileCount = defaultCount;
+    for (int i = 0; i < fileCount; i++) {
+      files[i] = defaultWorkloads[i];
+    }
+  }
+
+  // Keep a handle on the real stdout for the report, then silence the
+  // interpreter's own output.
+  fflush(stdout);
+  report = fdopen(dup(STDOUT_FILENO), "w");
+  if (report == NULL || freopen("/dev/null", "w", stdout) == NULL) {
+    fprintf(stderr, "Could not redirect interpreter output.\n");
+    exit(74);
+  }
+
+  if (checkCases > 0 || checkBatchCases > 0 || checkOptCases > 0 ||
+      checkServerEvals >= 0 || checkDtoaNumbers > 0) {
+    bool passed = (checkCases == 0 || checkJit(checkCases)) &&
+                  (checkBatchCases == 0 || checkBatch(checkBatchCases)) &&
+                  (checkOptCases == 0 || checkOpt(checkOptCases)) &&
+                  (checkServerEvals < 0 || checkServer(checkServerEvals)) &&
+                  (checkDtoaNumbers == 0 || checkDtoa(checkDtoaNumbers));
+    fclose(report);
+    free(files);
+    return passed ? 0 : 70;
+  }
+
+  bool ok = true;
+  fprintf(report,
+          "{\n  \"iterations\": %d,\n  \"warmup\": %d,\n  \"jit\": %d,\n",
+          iterations, warmup, jitThreshold);
+  fprintf(report, "  \"results\": [\n");
+  for (int i = 0; i < fileCount; i++) {
+    char *source = readFile(files[i]);
+    ok &= benchmark(files[i], source, warmup, iterations, reruns, i == 0);
+    free(source);
+  }
+  if (useDefaults && generated > 0) {
+    char name[64];
+    snprintf(name, sizeof(name), "generated_%d_terms", generated);
+    char *source = generateSource(generated);
+    ok &= benchmark(name, source, warmup, iterations, reruns, false);
+    free(source);
+  }
+  fprintf(report, "\n  ]\n}\n");
+
+  fclose(report);
+  free(files);
+  return ok ? 0 : 70;
+}
@@ -0,0 +1,353 @@
+// In-process microbenchmarks for the interpreter's hot primitives.
+//
+// Each primitive is run over generated inputs of increasing size. For every
+// size the harness warms up, then takes a number of samples, each timing a
+// batch of calls long enough to dwarf the clock overhead, and reports the
+// per-call min, median and p99 in nanoseconds:
+//
+//   clox_microbench [--samples N] [--warmup N] [--cpu N] [--json] [filter]
+//
+// `filter` only runs primitives whose name contains the given substring.
+#ifdef __linux__
+#define _GNU_SOURCE
+#include <sched.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "chunk.h"
+#include "common.h"
+#include "compiler.h"
+#include "memory.h"
+#include "object.h"
+#include "scanner.h"
+#include "timing.h"
+#include "value.h"
+#include "vm.h"
+
+// A sample is grown until a batch takes at least this long.
+#define MIN_SAMPLE_NS 20000
+
+static const int sizes[] = {16, 256, 4096, 65536};
+
+// Inputs shared between a primitive's setup and its measured body.
+static char *source;
+static Value left;
+static Value right;
+static Heap inputs;
+
+typedef struct Primitive {
+  const char *name;
+  // Unit the per-call time is divided by, e.g. one token or one byte.
+  const char *unit;
+  // Builds inputs for the given size, returns units handled per call.
+  int (*setup)(int size);
+  // Performs one call of the primitive.
+  void (*run)(int size);
+  // Releases inputs and anything a batch of calls left behind.
+  void (*cleanup)();
+} Primitive;
+
+static volatile bool sink;
+
+// Forgets the objects created so far so the measured calls below can free
+// their own results without touching the inputs.
+static void detachInputs() {
+  inputs = vm.heap;
+  initHeap(&vm.heap);
+}
+
+// Frees the objects the measured calls allocated since the last cleanup.
+static void freeResults() { freeObjects(); }
+
+static void freeInputs() {
+  freeResults();
+  vm.heap = inputs;
+  initHeap(&inputs);
+  freeResults();
+  free(source);
+  source = NULL;
+}
+
+// Generates a Lox expression of roughly `terms` terms which stays within the
+// 256 entry constant pool.
+static char *generateExpression(int terms) {
+  char *text = (char *)malloc((size_t)terms * 24 + 1);
+  size_t length = 0;
+  for (int i = 0; i < terms; i++) {
+    if (i > 0) {
+      length += sprintf(text + length, i % 2 == 0 ? " + " : " * ");
+    }
+    if (i < 240) {
+      length += sprintf(text + length, "%d.%d", i, i % 10);
+    } else {
+      length += sprintf(text + length, "!(%s)", i % 2 ? "true" : "nil");
+    }
+  }
+  text[length] = '\0';
+  return text;
+}
+
+// Builds a string of `length` printable characters as a Lox string Value.
+static Value makeString(size_t length, char fill) {
+  char *chars = ALLOCATE(char, length + 1);
+  for (size_t i = 0; i < length; i++) {
+    chars[i] = (char)(fill + i % 26);
+  }
+  chars[length] = '\0';
+  return OBJ_VAL(takeString(chars, (int)length));
+}
+
+static int setupScan(int size) {
+  source = generateExpression(size);
+  initScanner(source);
+  int tokens = 0;
+  while (scanToken().type != TOKEN_EOF) {
+    tokens++;
+  }
+  return tokens;
+}
+
+static void runScan(int size) {
+  (void)size;
+  initScanner(source);
+  while (scanToken().type != TOKEN_EOF) {
+  }
+}
+
+static int setupCompile(int size) {
+  source = generateExpression(size);
+  return size;
+}
+
+static void runCompile(int size) {
+  (void)size;
+  Chunk chunk;
+  initChunk(&chunk);
+  sink = compile(source, &chunk);
+  freeChunk(&chunk);
+}
+
+static int setupEqualStrings(int size) {
+  left = makeString(size, 'a');
+  right = makeString(size, 'a');
+  detachInputs();
+  return size;
+}
+
+static int setupEqualNumbers(int size) {
+  left = NUMBER_VAL(size);
+  right = NUMBER_VAL(size);
+  return 1;
+}
+
+static void runEqual(int size) {
+  (void)size;
+  sink = valuesEqual(left, right);
+}
+
+static int setupConcatenate(int size) {
+  left = makeString(size / 2, 'a');
+  right = makeString(size - size / 2, 'A');
+  detachInputs();
+  return size;
+}
+
+static void runConcatenate(int size) {
+  (void)size;
+  push(left);
+  push(right);
+  concatenate();
+  pop();
+}
+
+static int setupCopyString(int size) {
+  source = (char *)malloc(size + 1);
+  memset(source, 'x', size);
+  source[size] = '\0';
+  return size;
+}
+
+static void runCopyString(int size) { copyString(source, size); }
+
+static int setupGrowth(int size) { return size; }
+
+static void runWriteChunk(int size) {
+  Chunk chunk;
+  initChunk(&chunk);
+  for (int i = 0; i < size; i++) {
+    writeChunk(&chunk, OP_NIL, i);
+  }
+  freeChunk(&chunk);
+}
+
+static void runWriteValueArray(int size) {
+  ValueArray array;
+  initValueArray(&array);
+  for (int i = 0; i < size; i++) {
+    writeValueArray(&array, NUMBER_VAL(i));
+  }
+  freeValueArray(&array);
+}
+
+static const Primitive primitives[] = {
+    {"scanToken", "token", setupScan, runScan, freeInputs},
+    {"compile", "term", setupCompile, runCompile, freeInputs},
+    {"valuesEqual/number", "call", setupEqualNumbers, runEqual, freeInputs},
+    {"valuesEqual/string", "byte", setupEqualStrings, runEqual, freeInputs},
+    {"concatenate", "byte", setupConcatenate, runConcatenate, freeInputs},
+    {"copyString", "byte", setupCopyString, runCopyString, freeInputs},
+    {"writeChunk", "byte", setupGrowth, runWriteChunk, freeInputs},
+    {"writeValueArray", "value", setupGrowth, runWriteValueArray, freeInputs},
+};
+
+static int compareDouble(const void *a, const void *b) {
+  double x = *(const double *)a;
+  double y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+// Returns how many calls make up one sample of at least MIN_SAMPLE_NS.
+static int calibrate(const Primitive *primitive, int size) {
+  int batch = 1;
+  for (;;) {
+    uint64_t start = nowNs();
+    for (int i = 0; i < batch; i++) {
+      primitive->run(size);
+    }
+    uint64_t elapsed = nowNs() - start;
+    freeResults();
+    if (elapsed >= MIN_SAMPLE_NS || batch >= (1 << 24)) {
+      return batch;
+    }
+    batch *= 2;
+  }
+}
+
+// Pins the process to one CPU so samples aren't skewed by migrations.
+// Returns false if pinning isn't supported or allowed.
+static bool pinToCpu(int cpu) {
+#ifdef __linux__
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  return sched_setaffinity(0, sizeof(set), &set) == 0;
+#else
+  (void)cpu;
+  return false;
+#endif
+}
+
+int main(int argc, const char *argv[]) {
+  int samples = 51;
+  int warmup = 5;
+  int cpu = 0;
+  bool json = false;
+  const char *filter = NULL;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--samples") == 0 && i + 1 < argc) {
+      samples = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--warmup") == 0 && i + 1 < argc) {
+      warmup = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--cpu") == 0 && i + 1 < argc) {
+      cpu = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--json") == 0) {
+      json = true;
+    } else if (argv[i][0] == '-') {
+      fprintf(stderr, "Usage: clox_microbench [--samples N] [--warmup N] "
+                      "[--cpu N] [--json] [filter]\n");
+      exit(64);
+    } else {
+      filter = argv[i];
+    }
+  }
+  if (samples < 1) {
+    samples = 1;
+  }
+
+  bool pinned = pinToCpu(cpu);
+  if (!pinned) {
+    fprintf(stderr, "warning: could not pin to cpu %d\n", cpu);
+  }
+
+  // Compiling with DEBUG_PRINT_CODE dumps the chunk through vm.output,
+  // which writes to the stdout descriptor. Pointing that at /dev/null keeps
+  // the dump out of the results.
+  FILE *out = stdout;
+  fflush(stdout);
+  FILE *report = fdopen(dup(STDOUT_FILENO), "w");
+  if (report != NULL && freopen("/dev/null", "w", stdout) != NULL) {
+    out = report;
+  }
+
+  double *times = (double *)malloc(sizeof(double) * samples);
+  int primitiveCount = sizeof(primitives) / sizeof(primitives[0]);
+  int sizeCount = sizeof(sizes) / sizeof(sizes[0]);
+  bool first = true;
+
+  initVM();
+  if (json) {
+    fprintf(out, "{\n  \"pinned\": %s,\n  \"results\": [",
+            pinned ? "true" : "false");
+  } else {
+    fprintf(out, "%-22s %7s %12s %12s %12s  %s\n", "primitive", "size",
+            "min", "median", "p99", "(ns per unit)");
+  }
+
+  for (int p = 0; p < primitiveCount; p++) {
+    const Primitive *primitive = &primitives[p];
+    if (filter != NULL && strstr(primitive->name, filter) == NULL) {
+      continue;
+    }
+
+    for (int s = 0; s < sizeCount; s++) {
+      int size = sizes[s];
+      int units = primitive->setup(size);
+      int batch = calibrate(primitive, size);
+
+      for (int i = -warmup; i < samples; i++) {
+        uint64_t start = nowNs();
+        for (int j = 0; j < batch; j++) {
+          primitive->run(size);
+        }
+        uint64_t elapsed = nowNs() - start;
+        freeResults();
+        if (i >= 0) {
+          times[i] = (double)elapsed / batch / (units > 0 ? units : 1);
+        }
+      }
+      primitive->cleanup();
+
+      // Median and p99 are robust against the odd sample hit by an
+      // interrupt or a page fault, unlike the mean.
+      qsort(times, samples, sizeof(double), compareDouble);
+      double median = times[samples / 2];
+      double p99 = times[(samples * 99) / 100 < samples ? (samples * 99) / 100
+                                                        : samples - 1];
+      if (json) {
+        fprintf(out,
+                "%s\n    {\"primitive\": \"%s\", \"size\": %d, \"unit\": "
+                "\"%s\", \"batch\": %d, \"min_ns\": %.3f, \"median_ns\": "
+                "%.3f, \"p99_ns\": %.3f}",
+                first ? "" : ",", primitive->name, size, primitive->unit,
+                batch, times[0], median, p99);
+      } else {
+        fprintf(out, "%-22s %7d %12.3f %12.3f %12.3f  /%s\n", primitive->name,
+                size, times[0], median, p99, primitive->unit);
+      }
+      first = false;
+    }
+  }
+
+  if (json) {
+    fprintf(out, "\n  ]\n}\n");
+  }
+  freeVM();
+  free(times);
+  fflush(out);
+  return 0;
+}
@@ -0,0 +1,14 @@
+#ifndef clox_bench_timing_h
+#define clox_bench_timing_h
+
+#include <stdint.h>
+#include <time.h>
+
+// Returns a monotonic timestamp in nanoseconds.
+static inline uint64_t nowNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+#endif
@@ -1,4 +1,6 @@
 #!/bin/bash
+# Usage: ./build.sh [Debug|Release|RelWithDebInfo], defaults to Release.
+# See pgo.sh for a profile-guided optimized build.
 
 # Create build directory if it doesn't exist
 mkdir -p build
@@ -7,7 +9,7 @@ mkdir -p build
 cd build
 
 # Run CMake to generate build files
-cmake ..
+cmake -DCMAKE_BUILD_TYPE="${1:-Release}" ..
 
 # Build the project
 cmake --build .
@@ -0,0 +1,16 @@
+#ifndef clox_batch_h
+#define clox_batch_h
+
+#include "chunk.h"
+#include "common.h"
+#include "value.h"
+#include "vm.h"
+
+// Rows evaluated together by each instruction. Large enough to amortize
+// dispatch, small enough for a vector of every stack slot to stay in cache.
+#define BATCH_LANES 1024
+
+bool interpretBatch(Chunk *chunk, const Value *const *columns, int rowCount,
+                    Value *results, InterpretResult *statuses);
+
+#endif
@@ -0,0 +1,54 @@
+#ifndef clox_cache_h
+#define clox_cache_h
+
+#include "chunk.h"
+#include "common.h"
+
+// Bytes of compiled chunks kept around unless the host picks a budget.
+#define CACHE_DEFAULT_BUDGET (4 * 1024 * 1024)
+
+// A compiled chunk together with the source and passes it was compiled
+// with.
+typedef struct CacheEntry {
+  uint32_t hash;
+  int length;
+  // The PassFlag set the optimizer ran, which changes the code.
+  int passes;
+  // Private copy of the source, the caller's string may not outlive the call.
+  char *source;
+  Chunk chunk;
+  // Bytes the entry accounts for against the budget.
+  size_t size;
+  // Next entry in the same bucket.
+  struct CacheEntry *next;
+  // Neighbours in recency order, `newer` is NULL for the most recent entry.
+  struct CacheEntry *newer;
+  struct CacheEntry *older;
+} CacheEntry;
+
+// Chunks compiled by interpret(), keyed by their source and the passes they
+// were optimized with, and evicted least
+// recently used first once they take up more than `budget` bytes.
+typedef struct ChunkCache {
+  // Hash table of entries chained through `next`, a power of two in size.
+  CacheEntry **buckets;
+  int bucketCount;
+  int count;
+  CacheEntry *newest;
+  CacheEntry *oldest;
+  size_t bytes;
+  size_t budget;
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
+} ChunkCache;
+
+void initCache(ChunkCache *cache, size_t budget);
+void freeCache(ChunkCache *cache);
+uint32_t hashSource(const char *source, int length);
+Chunk *findChunk(ChunkCache *cache, const char *source, int length,
+                 int passes, uint32_t hash);
+Chunk *addChunk(ChunkCache *cache, const char *source, int length,
+                int passes, uint32_t hash, Chunk *chunk);
+
+#endif
@@ -9,6 +9,13 @@ typedef enum {
   OP_NIL,
   OP_TRUE,
   OP_FALSE,
+  // Numbers that are small integers, see isSmallInteger(), carried in the
+  // instruction rather than the constants table. OP_SMALL_INT's operand is
+  // a signed byte, OP_SHORT_INT's a signed 16-bit integer, high byte first.
+  OP_ZERO,
+  OP_ONE,
+  OP_SMALL_INT,
+  OP_SHORT_INT,
   OP_EQUAL,
   OP_GREATER,
   OP_LESS,
@@ -19,7 +26,28 @@ typedef enum {
   OP_DIVIDE,
   OP_NOT,
   OP_NEGATE,
+  // Pushes the host supplied value of an input, see compileInputs().
+  OP_GET_INPUT,
+  // Copy a value already on the stack to the top, left there by common
+  // subexpression elimination. OP_PICK's operand counts down from the top,
+  // OP_DUP is OP_PICK 0.
+  OP_DUP,
+  OP_PICK,
+  // Adds the operand's number of values from the bottom one up, as that many
+  // minus one OP_ADDs would. Lowering emits it for `+` chains involving
+  // strings, a string result is then allocated and copied just once.
+  OP_CONCAT,
   OP_RETURN,
+  // Quickened forms. The compiler never emits these, the VM rewrites a
+  // generic instruction in place into one of them after seeing its operand
+  // types, and back again if a later execution sees different types.
+  OP_GREATER_NUM,
+  OP_LESS_NUM,
+  OP_ADD_NUM,
+  OP_ADD_STR,
+  OP_SUBTRACT_NUM,
+  OP_MULTIPLY_NUM,
+  OP_DIVIDE_NUM,
 } OpCode;
 
 typedef struct Chunk {
@@ -34,11 +62,40 @@ typedef struct Chunk {
   // Another array to keep track of line numbers
   // BONUS: Impl a more efficient way of tracking lines.
   int *lines;
+  // Number of inputs the chunk was compiled with, each run needs a value for
+  // every one of them.
+  int inputCount;
+  // Number of times the chunk was run, compared against the JIT threshold.
+  int hotness;
+  // Native code the JIT compiled from this chunk, NULL if there is none.
+  void *jitCode;
+  size_t jitSize;
+  // In read-only memory shared between processes, see freeze.h. The VM
+  // neither quickens nor counts runs of frozen chunks.
+  bool frozen;
+  // The single allocation holding code, constants and lines once the chunk
+  // is finalized, NULL while it is still growing. See finalizeChunk().
+  uint8_t *block;
+  size_t blockSize;
+  // Fuel a run of the chunk burns, see countFuel(). -1 until the chunk is
+  // finalized.
+  int fuelCost;
 } Chunk;
 
 void initChunk(Chunk *chunk);
 void freeChunk(Chunk *chunk);
 void writeChunk(Chunk *chunk, uint8_t byte, int line);
 int addConstant(Chunk *chunk, Value value);
+bool isSmallInteger(double number);
+void finalizeChunk(Chunk *chunk);
+int instructionLength(uint8_t instruction);
+int stackEffect(const uint8_t *instruction);
+int maxStackDepth(Chunk *chunk);
+int countFuel(Chunk *chunk);
+
+// Reads the operand of an OP_SHORT_INT.
+static inline int16_t readShortInt(const uint8_t *operand) {
+  return (int16_t)((operand[0] << 8) | operand[1]);
+}
 
 #endif
\ No newline at end of file
@@ -5,7 +5,11 @@
 #include <stddef.h>
 #include <stdint.h>
 
+// Debug builds dump every compiled chunk and trace each executed
+// instruction. The build defines CLOX_DEBUG for those, see CMakeLists.txt.
+#ifdef CLOX_DEBUG
 #define DEBUG_PRINT_CODE
 #define DEBUG_TRACE_EXECUTION
+#endif
 
 #endif
\ No newline at end of file
@@ -5,5 +5,7 @@
 #include "vm.h"
 
 bool compile(const char *source, Chunk *chunk);
+bool compileInputs(const char *source, Chunk *chunk, const char *const *names,
+                   int count);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,44 @@
+#ifndef clox_counters_h
+#define clox_counters_h
+
+#include <stdio.h>
+
+#include "common.h"
+
+// Hardware counters are read through perf_event_open(2), which only Linux
+// has. Elsewhere openCounters() always fails and nothing is counted.
+#if defined(__linux__)
+#define COUNTERS_SUPPORTED
+#endif
+
+// Events counted by --perf-counters, in user space only.
+typedef enum CounterEvent {
+  COUNTER_CYCLES,
+  COUNTER_INSTRUCTIONS,
+  COUNTER_BRANCH_MISSES,
+  COUNTER_L1D_MISSES,
+  COUNTER_LLC_MISSES,
+} CounterEvent;
+
+#define COUNTER_EVENTS 5
+
+// What the VM spends counted time on.
+typedef enum CounterPhase {
+  PHASE_SCAN,
+  PHASE_COMPILE,
+  PHASE_RUN,
+} CounterPhase;
+
+#define COUNTER_PHASES 3
+
+bool openCounters();
+void closeCounters();
+bool isCounting(CounterEvent event);
+const char *counterName(CounterEvent event);
+void readCounters(uint64_t *values);
+void startCounters(CounterPhase phase);
+void stopCounters(CounterPhase phase);
+void countScan(const char *source);
+void printCounters(FILE *out);
+
+#endif
@@ -0,0 +1,11 @@
+#ifndef clox_dtoa_h
+#define clox_dtoa_h
+
+#include "common.h"
+
+// Enough for anything formatNumber() writes, the terminator included.
+#define DTOA_BUFFER_SIZE 32
+
+int formatNumber(double value, char *buffer);
+
+#endif
@@ -0,0 +1,22 @@
+#ifndef clox_freeze_h
+#define clox_freeze_h
+
+#include "chunk.h"
+#include "common.h"
+
+// Chunks copied together with their string constants into one read-only
+// mapping. Processes forked afterwards share its pages for as long as they
+// live, as nothing ever writes to them: the VM leaves frozen chunks
+// unquickened and uncounted, and their strings are on no object list.
+typedef struct FrozenChunks {
+  Chunk *chunks;
+  int count;
+  void *memory;
+  size_t size;
+} FrozenChunks;
+
+void initFrozenChunks(FrozenChunks *frozen);
+bool freezeChunks(FrozenChunks *frozen, const Chunk *chunks, int count);
+void freeFrozenChunks(FrozenChunks *frozen);
+
+#endif
@@ -0,0 +1,41 @@
+#ifndef clox_heap_h
+#define clox_heap_h
+
+#include "common.h"
+#include "value.h"
+
+// Bytes of each heap page, its header included.
+#define HEAP_PAGE_SIZE 4096
+// Object sizes are rounded up to a multiple of this. Each multiple up to
+// HEAP_MAX_OBJECT is a size class with pages of its own.
+#define HEAP_GRANULE 16
+#define HEAP_SIZE_CLASSES 4
+#define HEAP_MAX_OBJECT (HEAP_GRANULE * HEAP_SIZE_CLASSES)
+
+// A page of equally sized object slots.
+typedef struct HeapPage {
+  struct HeapPage *next;
+  int slotSize;
+  int slotCount;
+  // Slots handed out. Objects are only ever freed all at once, so these
+  // are the first `count` slots and the rest are free. A sweeper freeing
+  // objects one by one would need to mark which slots are taken instead.
+  int count;
+  // The rest of the page.
+  _Alignas(HEAP_GRANULE) uint8_t slots[];
+} HeapPage;
+
+// The objects of a VM, in pages segregated by size. The first page of each
+// class is the one objects are allocated from.
+typedef struct Heap {
+  HeapPage *pages[HEAP_SIZE_CLASSES];
+} Heap;
+
+typedef void (*HeapVisitor)(Obj *object);
+
+void initHeap(Heap *heap);
+void *allocateFromHeap(Heap *heap, size_t size);
+void walkHeap(Heap *heap, HeapVisitor visit);
+void freeHeap(Heap *heap);
+
+#endif
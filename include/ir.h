@@ -0,0 +1,110 @@
+#ifndef clox_ir_h
+#define clox_ir_h
+
+#include "common.h"
+#include "value.h"
+
+// Operations of the expression IR. Each one lowers to a single instruction,
+// `!=`, `<=` and `>=` are built from a comparison and IR_NOT as in bytecode.
+typedef enum {
+  // Any literal, nil and booleans included.
+  IR_CONSTANT,
+  IR_INPUT,
+  IR_NOT,
+  IR_NEGATE,
+  IR_EQUAL,
+  IR_GREATER,
+  IR_LESS,
+  IR_ADD,
+  IR_SUBTRACT,
+  IR_MULTIPLY,
+  IR_DIVIDE,
+} IrOp;
+
+// What is known about a node's value at compile time.
+typedef enum {
+  IR_UNKNOWN,
+  IR_BOOL,
+  IR_NIL,
+  IR_NUMBER,
+  IR_STRING,
+} IrType;
+
+typedef struct IrNode {
+  IrOp op;
+  // Result type, assuming the node doesn't fail.
+  IrType type;
+  // Whether evaluating the node can raise a runtime error. Operators only
+  // fail on operands of the wrong type, so this follows from their types.
+  bool fallible;
+  // Line runtime errors of the node are reported on.
+  int line;
+  // Operands, NULL where the operation takes fewer.
+  struct IrNode *left;
+  struct IrNode *right;
+  // The literal of an IR_CONSTANT.
+  Value value;
+  // The input slot of an IR_INPUT.
+  int slot;
+
+  // Filled in by common subexpression elimination, see optimizer.c.
+  // Position in the order the nodes are first evaluated.
+  int id;
+  // Number of operand edges into the node once it is shared.
+  int uses;
+  // Instructions needed to compute the node from scratch.
+  int size;
+  // Index into Ir.hoisted if lowering computes the node up front, else -1.
+  int hoisted;
+  // The last candidate for hoisting whose operands were walked through the
+  // node, -1 before any.
+  int reached;
+
+  // Scratch state of lowering, see lower.c.
+  // Constant table index once emitted, -1 before.
+  int constant;
+  // Ir.lowerings when the node was last emitted.
+  int mark;
+  // Ir.lowerings when a `+` chain through the node was found not worth an
+  // OP_CONCAT.
+  int chained;
+} IrNode;
+
+// A chunk of arena memory, nodes are carved out of `data` front to back.
+typedef struct IrBlock {
+  struct IrBlock *next;
+  size_t size;
+  size_t used;
+  // Aligned for anything a node holds.
+  double data[];
+} IrBlock;
+
+// The IR of one expression. Nodes are never freed on their own, the whole
+// arena goes at once with freeIr().
+typedef struct Ir {
+  IrBlock *blocks;
+  IrNode *root;
+  // Shared nodes lowering computes before the root, in evaluation order.
+  IrNode **hoisted;
+  int hoistedCount;
+  // Nodes which can fail, counted when CSE numbers the nodes.
+  int fallibleCount;
+  // Times lowerIr() ran, to tell apart the marks of each run.
+  int lowerings;
+} Ir;
+
+// Rewrites a node whose operands were already rewritten, returning the node
+// to use in its place.
+typedef IrNode *(*IrRewriteFn)(Ir *ir, IrNode *node, void *context);
+
+void initIr(Ir *ir);
+void freeIr(Ir *ir);
+void *allocateIr(Ir *ir, size_t size);
+IrNode *newConstant(Ir *ir, Value value, int line);
+IrNode *newInput(Ir *ir, int slot, int line);
+IrNode *newUnary(Ir *ir, IrOp op, IrNode *operand, int line);
+IrNode *newBinary(Ir *ir, IrOp op, IrNode *left, IrNode *right, int line);
+void typeNode(IrNode *node);
+IrNode *rewriteIr(Ir *ir, IrNode *root, IrRewriteFn rewrite, void *context);
+
+#endif
@@ -0,0 +1,22 @@
+#ifndef clox_jit_h
+#define clox_jit_h
+
+#include "chunk.h"
+#include "common.h"
+
+// Native code is only generated for x86-64 Linux, elsewhere every chunk
+// simply stays interpreted.
+#if defined(__x86_64__) && defined(__linux__)
+#define JIT_SUPPORTED
+#endif
+
+// Runs a chunk gets before the JIT compiles it. The first run happens in the
+// interpreter, which also quickens the chunk so the JIT can see which
+// additions are string concatenations and leave those to the interpreter.
+#define JIT_DEFAULT_THRESHOLD 2
+
+bool compileJit(Chunk *chunk);
+int runJit(Chunk *chunk);
+void freeJit(Chunk *chunk);
+
+#endif
@@ -0,0 +1,19 @@
+#ifndef clox_lower_h
+#define clox_lower_h
+
+#include "chunk.h"
+#include "ir.h"
+
+// Why lowerIr() couldn't lower the IR, if it could.
+typedef enum {
+  LOWER_OK,
+  // An operand doesn't fit its byte, e.g. a 257th constant, or in a dry run
+  // the code would raise errors in another order.
+  LOWER_INVALID,
+  // Running the code would overflow the VM's stack.
+  LOWER_TOO_DEEP,
+} LowerResult;
+
+LowerResult lowerIr(Ir *ir, Chunk *chunk);
+
+#endif
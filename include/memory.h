@@ -2,6 +2,7 @@
 #define clox_memory_h
 
 #include "common.h"
+#include "value.h"
 
 // Allocates memory for a dyn array of type `type` and has `count` elements.
 #define ALLOCATE(type, count)                                                  \
@@ -29,6 +30,7 @@
   reallocate(pointer, sizeof(type) * (oldCount), 0)
 
 void *reallocate(void *pointer, size_t oldSize, size_t newSize);
+void freeObject(Obj *object);
 void freeObjects();
 
 #endif
\ No newline at end of file
@@ -23,12 +23,10 @@ typedef enum {
   OBJ_STRING,
 } ObjType;
 
-// Any lox value who's state lives on the heap
+// Any lox value who's state lives on the heap. Objects live in the slots of
+// the VM's heap pages, which keep track of them, so this is only the type.
 struct Obj {
   ObjType type;
-  // Instrusive linked list. Each obj points at next obj in chain.
-  // Ptr to head is in VM
-  struct Obj *next;
 };
 
 struct ObjString {
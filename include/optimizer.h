@@ -0,0 +1,21 @@
+#ifndef clox_optimizer_h
+#define clox_optimizer_h
+
+#include "ir.h"
+
+// Repeated subexpressions smaller than this many instructions are computed
+// again rather than copied, copying isn't cheaper for them.
+#define CSE_MIN_SIZE 3
+
+// Passes optimizeIr() can run, combined as a bit set.
+typedef enum {
+  PASS_FOLD = 1 << 0,
+  PASS_SIMPLIFY = 1 << 1,
+  PASS_CSE = 1 << 2,
+} PassFlag;
+
+#define PASS_ALL (PASS_FOLD | PASS_SIMPLIFY | PASS_CSE)
+
+void optimizeIr(Ir *ir, int flags);
+
+#endif
@@ -0,0 +1,48 @@
+#ifndef clox_output_h
+#define clox_output_h
+
+#include <stdarg.h>
+#include <stddef.h>
+
+#include "common.h"
+
+// Bytes buffered before they go to the sink.
+#define OUTPUT_BUFFER_SIZE (64 * 1024)
+
+// Receives output flushed to a host callback.
+typedef void (*OutputFn)(const char *data, size_t length, void *context);
+
+typedef enum {
+  OUTPUT_FD,
+  OUTPUT_CALLBACK,
+  OUTPUT_MEMORY,
+} OutputKind;
+
+// Where everything scripts print goes. Writes collect in `buffer` and only
+// reach the sink when it fills up or at an explicit flushOutput().
+typedef struct Output {
+  OutputKind kind;
+  int fd;
+  OutputFn callback;
+  void *context;
+  // Everything flushed to the memory sink so far.
+  char *memory;
+  size_t memoryCount;
+  size_t memoryCapacity;
+  size_t count;
+  char buffer[OUTPUT_BUFFER_SIZE];
+} Output;
+
+void initOutput(Output *output);
+void freeOutput(Output *output);
+void outputToFd(Output *output, int fd);
+void outputToCallback(Output *output, OutputFn callback, void *context);
+void outputToMemory(Output *output);
+const char *outputMemory(Output *output, size_t *length);
+void clearOutputMemory(Output *output);
+void writeOutput(Output *output, const char *data, size_t length);
+void printOutput(Output *output, const char *format, ...);
+void printOutputList(Output *output, const char *format, va_list args);
+void flushOutput(Output *output);
+
+#endif
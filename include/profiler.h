@@ -0,0 +1,50 @@
+#ifndef clox_profiler_h
+#define clox_profiler_h
+
+#include <stdio.h>
+
+#include "common.h"
+#include "counters.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#else
+#include <time.h>
+#endif
+
+// Opcodes are a single byte, so every possible one fits.
+#define PROFILE_OPCODES 256
+
+// Execution statistics gathered by the VM when `vm.profiling` is set.
+typedef struct Profile {
+  // Number of times each opcode was dispatched.
+  uint64_t counts[PROFILE_OPCODES];
+  // Cycles spent from the dispatch of an opcode until the next dispatch.
+  uint64_t cycles[PROFILE_OPCODES];
+  // pairs[a][b] counts how often opcode b directly followed opcode a.
+  // Frequent pairs are candidates for superinstructions.
+  uint64_t pairs[PROFILE_OPCODES][PROFILE_OPCODES];
+  // What the perf counters counted over the same spans as `cycles`, when
+  // they are open, see counters.h.
+  uint64_t events[PROFILE_OPCODES][COUNTER_EVENTS];
+} Profile;
+
+extern Profile profile;
+
+void resetProfile();
+void printProfile(FILE *out);
+void printProfileJson(FILE *out);
+
+// Returns a cheap, monotonically increasing cycle count. Uses the time stamp
+// counter on x86 and falls back to nanoseconds elsewhere.
+static inline uint64_t readCycleCounter() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+#endif
@@ -0,0 +1,17 @@
+#ifndef clox_sampler_h
+#define clox_sampler_h
+
+#include <stdio.h>
+
+#include "chunk.h"
+#include "common.h"
+
+// Default sampling frequency, low enough to leave on in production.
+#define SAMPLER_DEFAULT_HZ 1000
+
+bool startSampler(int hz);
+void stopSampler();
+void collectSamples(Chunk *chunk);
+void writeCollapsedStacks(FILE *out, const char *script);
+
+#endif
@@ -54,6 +54,8 @@ typedef struct Token {
   const char* start;
   int length;
   int line;
+  // Value of a TOKEN_NUMBER, converted while scanning it.
+  double number;
 } Token;
 
 void initScanner(const char *source);
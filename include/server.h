@@ -0,0 +1,48 @@
+#ifndef clox_server_h
+#define clox_server_h
+
+#include "common.h"
+
+// Worker processes serving requests unless the host picks a number.
+#define SERVER_DEFAULT_WORKERS 4
+// Largest request accepted, larger ones close the connection.
+#define SERVER_FRAME_MAX (16 * 1024 * 1024)
+
+// The protocol spoken on the socket. Every request and response is a frame:
+// a 32-bit length in host byte order followed by that many bytes. A
+// request's first byte is its RequestType, a response's first byte its
+// ResponseStatus.
+//
+//   REQUEST_EVAL     source...                      -> status, output...
+//   REQUEST_COMPILE  count:u8, (length:u8, name...)  -> status, id:u32
+//                    for each input, source...          or status, error...
+//   REQUEST_RUN      id:u32, value for each input    -> status, output...
+//
+// `output` is everything the expression printed, followed by the error
+// message after a compile or runtime error, and `error` is the compile
+// error message of a program that didn't compile. Input values are a
+// ValueType byte followed by a u8 for booleans, a double for numbers and a
+// u32 length plus the bytes for strings, with VAL_OBJ meaning a string.
+// Compiled programs belong to the connection, their ids mean nothing on
+// another one. Preloaded programs, see preloadPrograms(), come first and have
+// the same ids on every connection.
+typedef enum {
+  REQUEST_EVAL = 1,
+  REQUEST_COMPILE = 2,
+  REQUEST_RUN = 3,
+} RequestType;
+
+// An InterpretResult, or RESPONSE_BAD_REQUEST for a malformed request.
+// Results added later come after it, so earlier statuses keep their values.
+typedef enum {
+  RESPONSE_OK,
+  RESPONSE_COMPILE_ERROR,
+  RESPONSE_RUNTIME_ERROR,
+  RESPONSE_BAD_REQUEST,
+  RESPONSE_OUT_OF_FUEL,
+} ResponseStatus;
+
+bool preloadPrograms(const char *programs);
+bool serve(const char *path, int workers);
+
+#endif
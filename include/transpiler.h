@@ -0,0 +1,14 @@
+#ifndef clox_transpiler_h
+#define clox_transpiler_h
+
+#include <stdio.h>
+
+#include "chunk.h"
+#include "common.h"
+
+// Name of the generated function when the host doesn't pick one.
+#define TRANSPILER_DEFAULT_NAME "loxExpression"
+
+bool transpile(Chunk *chunk, FILE *out, const char *name);
+
+#endif
@@ -1,10 +1,15 @@
 #ifndef clox_vm_h
 #define clox_vm_h
 
+#include "cache.h"
 #include "chunk.h"
+#include "heap.h"
+#include "output.h"
 #include "value.h"
 
 #define STACK_MAX 256
+// Fuel of executions that aren't metered, see VM.fuel.
+#define FUEL_UNLIMITED -1
 
 typedef struct VM {
   Chunk *chunk;
@@ -13,18 +18,55 @@ typedef struct VM {
   // Counter (PC)
   uint8_t *ip;
   // LIFO, semantics implemented on top of a raw C-aray
+  // Values a run leaves behind may be string constants, which are borrowed
+  // from the chunk's block and freed with the chunk, see finalizeChunk().
   Value stack[STACK_MAX];
   // A pointer to the "top" of the stack. It is faster to dereference a pointer
   // than to calculate the offset when needed. It points to where next value is
   // to be pushed.
   Value *stackTop;
-  Obj *objects; // ptr to head of insrusive objects linked list
+  // Values of the running chunk's inputs, see compileInputs().
+  const Value *inputs;
+  // Every object allocated, freed all together by freeVM().
+  Heap heap;
+  // Chunks interpret() compiled, so repeated sources skip the compiler.
+  ChunkCache cache;
+  // Running totals kept by `reallocate()`, used for allocation statistics.
+  size_t bytesAllocated;
+  size_t allocations;
+  // Gather per-opcode statistics into `profile` while executing.
+  bool profiling;
+  // A SIGPROF sampler is recording `ip`, see sampler.h.
+  bool sampling;
+  // Perf counters are open and count the compiler and runs, see counters.h.
+  bool counting;
+  // Run chunks as native code once they have been interpreted `jitThreshold`
+  // times, see jit.h.
+  bool jitEnabled;
+  int jitThreshold;
+  // Set of PassFlag, the optimizations the compiler runs, see optimizer.h.
+  int passes;
+  // Fuel each execution of a chunk gets, or FUEL_UNLIMITED. Instructions
+  // burn it, see countFuel(), and a run that would need more ends with
+  // INTERPRET_OUT_OF_FUEL. It is checked where a basic block starts rather
+  // than per instruction. Lox has no jumps yet, so a chunk is one block and
+  // a run either gets all the fuel it needs or stops before its first
+  // instruction, leaving the host free to retry with more or give up.
+  int64_t fuel;
+  // Everything scripts print, and the debug tracer too, goes through here.
+  // Only flushed when full, by freeVM() and before runtime errors, so hosts
+  // running many scripts flush where it suits them.
+  Output output;
+  // Compile and runtime error messages, standard error unless the host
+  // points them elsewhere. Flushed after every message.
+  Output errors;
 } VM;
 
 typedef enum InterpretResult {
   INTERPRET_OK,
   INTERPRET_COMPILE_ERROR,
-  INTERPRET_RUNTIME_ERROR
+  INTERPRET_RUNTIME_ERROR,
+  INTERPRET_OUT_OF_FUEL
 } InterpretResult;
 
 extern VM vm; // Expose global VM
@@ -32,7 +74,12 @@ extern VM vm; // Expose global VM
 void initVM();
 void freeVM();
 InterpretResult interpret(const char *source);
+InterpretResult interpretChunk(Chunk *chunk);
+bool hasFuelFor(Chunk *chunk);
+InterpretResult interpretInputs(Chunk *chunk, const Value *inputs);
 void push(Value value);
 Value pop();
+void concatenate();
+bool concatenateMany(int count);
 
 #endif
@@ -0,0 +1,39 @@
+#!/bin/bash
+# Builds a profile-guided optimized release of clox.
+#
+# Stage 1 builds an instrumented binary, which is trained on the benchmark
+# corpus in bench/. Stage 2 rebuilds the same tree using the recorded
+# profiles. Pass a build type (Release or RelWithDebInfo) to override the
+# default of Release.
+set -e
+
+BUILD_TYPE="${1:-Release}"
+ROOT="$(cd "$(dirname "$0")" && pwd)"
+BUILD="$ROOT/build/pgo-$BUILD_TYPE"
+PROFILES="$BUILD/profiles"
+
+rm -rf "$PROFILES"
+mkdir -p "$PROFILES"
+
+# Stage 1: instrumented build.
+cmake -S "$ROOT" -B "$BUILD" -DCMAKE_BUILD_TYPE="$BUILD_TYPE" \
+	-DCLOX_PGO=GENERATE -DCLOX_PGO_DIR="$PROFILES"
+cmake --build "$BUILD" --clean-first
+
+# Train on the bundled corpus, both through the CLI and the benchmark driver
+# which also exercises the generated large sources.
+for workload in "$ROOT"/bench/*.lox; do
+	for i in $(seq 20); do
+		"$ROOT/bin/clox" "$workload" > /dev/null
+	done
+done
+"$ROOT/bin/clox_bench" --iterations 200 > /dev/null
+
+# Clang writes raw profiles that need merging first.
+if ls "$PROFILES"/*.profraw > /dev/null 2>&1; then
+	llvm-profdata merge -output="$PROFILES/clox.profdata" "$PROFILES"/*.profraw
+fi
+
+# Stage 2: optimized build using the profiles.
+cmake -S "$ROOT" -B "$BUILD" -DCLOX_PGO=USE
+cmake --build "$BUILD" --clean-first
@@ -0,0 +1,476 @@
+#include <string.h>
+
+#include "batch.h"
+#include "memory.h"
+#include "object.h"
+
+// Evaluates a chunk over many rows at once, the way a query engine
+// evaluates an expression over a column. Every instruction is dispatched
+// once per batch of up to BATCH_LANES rows and then runs a kernel over all
+// lanes of its operand vectors, so dispatch is paid per batch rather than
+// per row.
+//
+// Vectors are a struct of arrays: the lanes' type tags, and one payload
+// array per representation. The kernels over numbers and booleans are
+// plain loops over those arrays which the C compiler vectorizes into SIMD.
+// They compute every lane unconditionally, then a per-lane mask of the
+// lanes whose operands had the right types decides which results count.
+// Lanes with other types, string concatenation and string equality, take a
+// scalar path.
+//
+// A lane which hits a runtime error is marked failed and its value is
+// ignored from then on. Errors are reported through the per-row status
+// only, nothing is printed, and neither are the results of OP_RETURN.
+
+// One stack slot across all lanes of a batch.
+// Booleans are bytes holding 0 or 1 rather than bools, which the vectorizer
+// handles poorly.
+typedef struct Vector {
+  uint8_t types[BATCH_LANES];
+  uint8_t booleans[BATCH_LANES];
+  double numbers[BATCH_LANES];
+  Obj *objects[BATCH_LANES];
+} Vector;
+
+typedef struct Batch {
+  // One vector per stack slot the chunk uses.
+  Vector *stack;
+  // Lanes which hit a runtime error.
+  uint8_t failed[BATCH_LANES];
+  // Scratch mask of the lanes a kernel's result is valid for.
+  uint8_t mask[BATCH_LANES];
+  // Scratch results of equality, which reads both operands while writing.
+  uint8_t equal[BATCH_LANES];
+  // Lanes in use, the last batch of rows may not fill all of them.
+  int count;
+} Batch;
+
+// Marks a lane failed. Its type is reset to nil so later kernels never see
+// a half written value in it.
+static void failLane(Batch *batch, Vector *vector, int lane) {
+  batch->failed[lane] = 1;
+  vector->types[lane] = VAL_NIL;
+}
+
+// Loads the same value into every lane.
+static void broadcast(Vector *vector, Value value, int count) {
+  memset(vector->types, value.type, count);
+  switch (value.type) {
+  case VAL_BOOL:
+    memset(vector->booleans, AS_BOOL(value), count);
+    break;
+  case VAL_NIL:
+    break;
+  case VAL_NUMBER:
+    for (int i = 0; i < count; i++) {
+      vector->numbers[i] = AS_NUMBER(value);
+    }
+    break;
+  case VAL_OBJ:
+    for (int i = 0; i < count; i++) {
+      vector->objects[i] = AS_OBJ(value);
+    }
+    break;
+  }
+}
+
+// Loads the lanes from consecutive values of an input column, splitting
+// them into the tags and payload arrays.
+static void gather(Vector *vector, const Value *column, int count) {
+  for (int i = 0; i < count; i++) {
+    Value value = column[i];
+    vector->types[i] = value.type;
+    switch (value.type) {
+    case VAL_BOOL:
+      vector->booleans[i] = AS_BOOL(value);
+      break;
+    case VAL_NIL:
+      break;
+    case VAL_NUMBER:
+      vector->numbers[i] = AS_NUMBER(value);
+      break;
+    case VAL_OBJ:
+      vector->objects[i] = AS_OBJ(value);
+      break;
+    }
+  }
+}
+
+// Copies the lanes of one stack slot into another.
+static void copyVector(Vector *to, const Vector *from, int count) {
+  memcpy(to->types, from->types, count);
+  memcpy(to->booleans, from->booleans, count);
+  memcpy(to->numbers, from->numbers, sizeof(double) * count);
+  memcpy(to->objects, from->objects, sizeof(Obj *) * count);
+}
+
+// Returns the value in one lane as a regular Value.
+static Value laneValue(Vector *vector, int lane) {
+  switch (vector->types[lane]) {
+  case VAL_BOOL:
+    return BOOL_VAL(vector->booleans[lane]);
+  case VAL_NUMBER:
+    return NUMBER_VAL(vector->numbers[lane]);
+  case VAL_OBJ:
+    return OBJ_VAL(vector->objects[lane]);
+  default:
+    return NIL_VAL;
+  }
+}
+
+// Returns a row's result as the caller may keep it. String constants live
+// in the chunk's block and go with the chunk, so those are copied to the
+// VM's heap, once for all rows returning the same `borrowed` one.
+static Value resultValue(Chunk *chunk, Vector *vector, int lane,
+                         Obj **borrowed, Value *copy) {
+  Value value = laneValue(vector, lane);
+  if (!IS_OBJ(value) || chunk->block == NULL) {
+    return value;
+  }
+  uintptr_t at = (uintptr_t)AS_OBJ(value);
+  uintptr_t block = (uintptr_t)chunk->block;
+  if (at < block || at >= block + chunk->blockSize) {
+    return value;
+  }
+  if (AS_OBJ(value) != *borrowed) {
+    ObjString *string = AS_STRING(value);
+    *borrowed = AS_OBJ(value);
+    *copy = OBJ_VAL(copyString(string->chars, string->length));
+  }
+  return *copy;
+}
+
+// Marks the kernels. Besides the baseline build, x86-64 Linux gets an AVX2
+// clone of each, picked at load time. SSE2 alone can't narrow a vector of
+// double comparisons into bytes, so without AVX2 comparisons stay scalar.
+#if defined(__GNUC__) && defined(__x86_64__) && defined(__linux__)
+#define KERNEL __attribute__((target_clones("avx2", "default")))
+#else
+#define KERNEL
+#endif
+
+// Sets `mask` for the lanes where both operands are numbers.
+// Returns how many lanes that is.
+KERNEL static int bothNumbers(const Vector *restrict a,
+                              const Vector *restrict b, uint8_t *restrict mask,
+                              int count) {
+  int numeric = 0;
+  for (int i = 0; i < count; i++) {
+    mask[i] = (a->types[i] == VAL_NUMBER) & (b->types[i] == VAL_NUMBER);
+    numeric += mask[i];
+  }
+  return numeric;
+}
+
+// Kernels over all lanes of two number vectors. `restrict` tells the
+// compiler the arrays don't overlap, which it needs to vectorize.
+#define ARITHMETIC_KERNEL(name, op)                                            \
+  KERNEL static void name(double *restrict a, const double *restrict b,       \
+                          int count) {                                         \
+    for (int i = 0; i < count; i++) {                                          \
+      a[i] = a[i] op b[i];                                                     \
+    }                                                                          \
+  }
+#define COMPARISON_KERNEL(name, op)                                            \
+  KERNEL static void name(uint8_t *restrict out, const double *restrict a,       \
+                          const double *restrict b, int count) {               \
+    for (int i = 0; i < count; i++) {                                          \
+      out[i] = a[i] op b[i];                                                   \
+    }                                                                          \
+  }
+
+ARITHMETIC_KERNEL(addNumbers, +)
+ARITHMETIC_KERNEL(subtractNumbers, -)
+ARITHMETIC_KERNEL(multiplyNumbers, *)
+ARITHMETIC_KERNEL(divideNumbers, /)
+COMPARISON_KERNEL(greaterNumbers, >)
+COMPARISON_KERNEL(lessNumbers, <)
+
+#undef ARITHMETIC_KERNEL
+#undef COMPARISON_KERNEL
+
+// Concatenates the strings in one lane of `a` and `b` into `a`.
+static void concatenateLane(Vector *a, Vector *b, int lane) {
+  push(OBJ_VAL(a->objects[lane]));
+  push(OBJ_VAL(b->objects[lane]));
+  concatenate();
+  a->objects[lane] = AS_OBJ(pop());
+}
+
+// Runs a binary arithmetic or comparison instruction, leaving the result
+// in `a`. Only OP_ADD accepts anything but two numbers.
+static void binaryOp(Batch *batch, Vector *a, Vector *b, uint8_t opcode) {
+  int count = batch->count;
+  int numeric = bothNumbers(a, b, batch->mask, count);
+  bool comparison = opcode == OP_GREATER || opcode == OP_LESS;
+
+  switch (opcode) {
+  case OP_ADD:
+    addNumbers(a->numbers, b->numbers, count);
+    break;
+  case OP_SUBTRACT:
+    subtractNumbers(a->numbers, b->numbers, count);
+    break;
+  case OP_MULTIPLY:
+    multiplyNumbers(a->numbers, b->numbers, count);
+    break;
+  case OP_DIVIDE:
+    divideNumbers(a->numbers, b->numbers, count);
+    break;
+  case OP_GREATER:
+    greaterNumbers(a->booleans, a->numbers, b->numbers, count);
+    break;
+  case OP_LESS:
+    lessNumbers(a->booleans, a->numbers, b->numbers, count);
+    break;
+  }
+
+  if (numeric == count) {
+    // Arithmetic leaves the number tags as they are.
+    if (comparison) {
+      memset(a->types, VAL_BOOL, count);
+    }
+    return;
+  }
+
+  for (int i = 0; i < count; i++) {
+    if (batch->mask[i]) {
+      if (comparison) {
+        a->types[i] = VAL_BOOL;
+      }
+    } else if (batch->failed[i]) {
+      continue;
+    } else if (opcode == OP_ADD && a->types[i] == VAL_OBJ &&
+               b->types[i] == VAL_OBJ &&
+               a->objects[i]->type == OBJ_STRING &&
+               b->objects[i]->type == OBJ_STRING) {
+      concatenateLane(a, b, i);
+    } else {
+      failLane(batch, a, i);
+    }
+  }
+}
+
+// Equality of every lane whose values are numbers, booleans or nil, into
+// `out`. Returns whether some lanes hold two objects, which it leaves to
+// valuesEqual().
+KERNEL static bool equalValues(uint8_t *restrict out, const Vector *restrict a,
+                               const Vector *restrict b, int count) {
+  uint8_t objects = 0;
+  for (int i = 0; i < count; i++) {
+    uint8_t type = a->types[i];
+    uint8_t same = type == b->types[i];
+    uint8_t equal =
+        (type == VAL_NIL) |
+        ((type == VAL_BOOL) & (a->booleans[i] == b->booleans[i])) |
+        ((type == VAL_NUMBER) & (a->numbers[i] == b->numbers[i]));
+    out[i] = same & equal;
+    objects |= same & (type == VAL_OBJ);
+  }
+  return objects;
+}
+
+// Compares every lane of `a` and `b`, leaving the booleans in `a`.
+static void equalOp(Batch *batch, Vector *a, Vector *b) {
+  int count = batch->count;
+  if (equalValues(batch->equal, a, b, count)) {
+    for (int i = 0; i < count; i++) {
+      if (a->types[i] == VAL_OBJ && b->types[i] == VAL_OBJ) {
+        batch->equal[i] =
+            valuesEqual(OBJ_VAL(a->objects[i]), OBJ_VAL(b->objects[i]));
+      }
+    }
+  }
+  memcpy(a->booleans, batch->equal, count);
+  memset(a->types, VAL_BOOL, count);
+}
+
+// Logical not of every lane, only nil and false are falsey.
+KERNEL static void notValues(uint8_t *restrict types, uint8_t *restrict booleans,
+                             int count) {
+  for (int i = 0; i < count; i++) {
+    uint8_t type = types[i];
+    booleans[i] = (type == VAL_NIL) | ((type == VAL_BOOL) & (booleans[i] ^ 1));
+    types[i] = VAL_BOOL;
+  }
+}
+
+KERNEL static int negateNumbers(double *restrict numbers,
+                                const uint8_t *restrict types, int count) {
+  int numeric = 0;
+  for (int i = 0; i < count; i++) {
+    numbers[i] = -numbers[i];
+    numeric += types[i] == VAL_NUMBER;
+  }
+  return numeric;
+}
+
+static void negateOp(Batch *batch, Vector *a) {
+  int count = batch->count;
+  if (negateNumbers(a->numbers, a->types, count) == count) {
+    return;
+  }
+  for (int i = 0; i < count; i++) {
+    if (a->types[i] != VAL_NUMBER && !batch->failed[i]) {
+      failLane(batch, a, i);
+    }
+  }
+}
+
+// Runs the chunk over the lanes of one batch, starting at row `first`.
+static void runBatch(Batch *batch, Chunk *chunk, const Value *const *columns,
+                     int first, Value *results, InterpretResult *statuses) {
+  int count = batch->count;
+  memset(batch->failed, 0, count);
+  // Slot the top of the stack is in, -1 while it is empty.
+  int top = -1;
+
+  for (int offset = 0; offset < chunk->count;
+       offset += instructionLength(chunk->code[offset])) {
+    uint8_t instruction = chunk->code[offset];
+    Vector *a = top >= 1 ? &batch->stack[top - 1] : NULL;
+    Vector *b = top >= 0 ? &batch->stack[top] : NULL;
+
+    switch (instruction) {
+    case OP_CONSTANT:
+      broadcast(&batch->stack[++top],
+                chunk->constants.values[chunk->code[offset + 1]], count);
+      break;
+    case OP_NIL:
+      broadcast(&batch->stack[++top], NIL_VAL, count);
+      break;
+    case OP_TRUE:
+      broadcast(&batch->stack[++top], BOOL_VAL(true), count);
+      break;
+    case OP_FALSE:
+      broadcast(&batch->stack[++top], BOOL_VAL(false), count);
+      break;
+    case OP_ZERO:
+      broadcast(&batch->stack[++top], NUMBER_VAL(0), count);
+      break;
+    case OP_ONE:
+      broadcast(&batch->stack[++top], NUMBER_VAL(1), count);
+      break;
+    case OP_SMALL_INT:
+      broadcast(&batch->stack[++top],
+                NUMBER_VAL((int8_t)chunk->code[offset + 1]), count);
+      break;
+    case OP_SHORT_INT:
+      broadcast(&batch->stack[++top],
+                NUMBER_VAL(readShortInt(&chunk->code[offset + 1])), count);
+      break;
+    case OP_GET_INPUT:
+      gather(&batch->stack[++top], columns[chunk->code[offset + 1]] + first,
+             count);
+      break;
+    case OP_DUP:
+      copyVector(&batch->stack[top + 1], b, count);
+      top++;
+      break;
+    case OP_PICK:
+      copyVector(&batch->stack[top + 1],
+                 &batch->stack[top - chunk->code[offset + 1]], count);
+      top++;
+      break;
+    // Additions one at a time, every lane has its own operand types.
+    case OP_CONCAT: {
+      int count = chunk->code[offset + 1];
+      Vector *sum = &batch->stack[top - count + 1];
+      for (int i = 1; i < count; i++) {
+        binaryOp(batch, sum, sum + i, OP_ADD);
+      }
+      top -= count - 1;
+      break;
+    }
+    case OP_EQUAL:
+      equalOp(batch, a, b);
+      top--;
+      break;
+    // Quickened instructions behave like their generic forms.
+    case OP_GREATER:
+    case OP_GREATER_NUM:
+      binaryOp(batch, a, b, OP_GREATER);
+      top--;
+      break;
+    case OP_LESS:
+    case OP_LESS_NUM:
+      binaryOp(batch, a, b, OP_LESS);
+      top--;
+      break;
+    case OP_ADD:
+    case OP_ADD_NUM:
+    case OP_ADD_STR:
+      binaryOp(batch, a, b, OP_ADD);
+      top--;
+      break;
+    case OP_SUBTRACT:
+    case OP_SUBTRACT_NUM:
+      binaryOp(batch, a, b, OP_SUBTRACT);
+      top--;
+      break;
+    case OP_MULTIPLY:
+    case OP_MULTIPLY_NUM:
+      binaryOp(batch, a, b, OP_MULTIPLY);
+      top--;
+      break;
+    case OP_DIVIDE:
+    case OP_DIVIDE_NUM:
+      binaryOp(batch, a, b, OP_DIVIDE);
+      top--;
+      break;
+    case OP_NOT:
+      notValues(b->types, b->booleans, count);
+      break;
+    case OP_NEGATE:
+      negateOp(batch, b);
+      break;
+    case OP_RETURN: {
+      Obj *borrowed = NULL;
+      Value copy = NIL_VAL;
+      for (int i = 0; i < count; i++) {
+        bool failed = batch->failed[i];
+        results[first + i] =
+            failed ? NIL_VAL : resultValue(chunk, b, i, &borrowed, &copy);
+        statuses[first + i] = failed ? INTERPRET_RUNTIME_ERROR : INTERPRET_OK;
+      }
+      return;
+    }
+    }
+  }
+}
+
+// Evaluates the chunk once for each of `rowCount` rows, storing each row's
+// result and status. `columns` holds one array of `rowCount` values per
+// input the chunk was compiled with. Results are on the VM's heap or are
+// inputs, never borrowed from the chunk, so they outlive it.
+// Returns false without evaluating anything if the chunk can't be run.
+bool interpretBatch(Chunk *chunk, const Value *const *columns, int rowCount,
+                    Value *results, InterpretResult *statuses) {
+  int depth = maxStackDepth(chunk);
+  if (depth < 1 || (chunk->inputCount > 0 && columns == NULL)) {
+    return false;
+  }
+  // Each row is a run of its own, with the fuel of one.
+  if (!hasFuelFor(chunk)) {
+    for (int i = 0; i < rowCount; i++) {
+      results[i] = NIL_VAL;
+      statuses[i] = INTERPRET_OUT_OF_FUEL;
+    }
+    return true;
+  }
+
+  Batch batch;
+  batch.stack = ALLOCATE(Vector, depth);
+  // Kernels read every lane of their operands, zero them once so lanes
+  // which were never written hold defined values.
+  memset(batch.stack, 0, sizeof(Vector) * depth);
+
+  for (int first = 0; first < rowCount; first += BATCH_LANES) {
+    int remaining = rowCount - first;
+    batch.count = remaining < BATCH_LANES ? remaining : BATCH_LANES;
+    runBatch(&batch, chunk, columns, first, results, statuses);
+  }
+
+  FREE_ARRAY(Vector, batch.stack, depth);
+  return true;
+}
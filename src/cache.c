@@ -0,0 +1,187 @@
+#include <string.h>
+
+#include "cache.h"
+#include "memory.h"
+
+// Buckets allocated for the first entry, doubled whenever the table gets
+// more than 75% full.
+#define CACHE_MIN_BUCKETS 64
+
+// Initializes an empty cache which keeps at most `budget` bytes of chunks,
+// 0 disables caching.
+void initCache(ChunkCache *cache, size_t budget) {
+  cache->buckets = NULL;
+  cache->bucketCount = 0;
+  cache->count = 0;
+  cache->newest = NULL;
+  cache->oldest = NULL;
+  cache->bytes = 0;
+  cache->budget = budget;
+  cache->hits = 0;
+  cache->misses = 0;
+  cache->evictions = 0;
+}
+
+// Hashes source code with 32-bit FNV-1a.
+uint32_t hashSource(const char *source, int length) {
+  uint32_t hash = 2166136261u;
+  for (int i = 0; i < length; i++) {
+    hash ^= (uint8_t)source[i];
+    hash *= 16777619;
+  }
+  return hash;
+}
+
+// Unlinks an entry from the recency list.
+static void unlinkEntry(ChunkCache *cache, CacheEntry *entry) {
+  if (entry->newer != NULL) {
+    entry->newer->older = entry->older;
+  } else {
+    cache->newest = entry->older;
+  }
+  if (entry->older != NULL) {
+    entry->older->newer = entry->newer;
+  } else {
+    cache->oldest = entry->newer;
+  }
+}
+
+// Links an entry in as the most recently used one.
+static void linkNewest(ChunkCache *cache, CacheEntry *entry) {
+  entry->newer = NULL;
+  entry->older = cache->newest;
+  if (cache->newest != NULL) {
+    cache->newest->newer = entry;
+  } else {
+    cache->oldest = entry;
+  }
+  cache->newest = entry;
+}
+
+static void freeEntry(CacheEntry *entry) {
+  FREE_ARRAY(char, entry->source, entry->length + 1);
+  freeChunk(&entry->chunk);
+  FREE(CacheEntry, entry);
+}
+
+// Removes the least recently used entry, its string constants with it as
+// they live in the chunk's block.
+static void evictOldest(ChunkCache *cache) {
+  CacheEntry *entry = cache->oldest;
+  CacheEntry **link = &cache->buckets[entry->hash & (cache->bucketCount - 1)];
+  while (*link != entry) {
+    link = &(*link)->next;
+  }
+  *link = entry->next;
+  unlinkEntry(cache, entry);
+
+  cache->bytes -= entry->size;
+  cache->count--;
+  cache->evictions++;
+  freeEntry(entry);
+}
+
+// Doubles the bucket array and rehashes every entry into it.
+static void growBuckets(ChunkCache *cache) {
+  int oldCount = cache->bucketCount;
+  int newCount = oldCount < CACHE_MIN_BUCKETS ? CACHE_MIN_BUCKETS : oldCount * 2;
+  CacheEntry **buckets = ALLOCATE(CacheEntry *, newCount);
+  for (int i = 0; i < newCount; i++) {
+    buckets[i] = NULL;
+  }
+  for (int i = 0; i < oldCount; i++) {
+    CacheEntry *entry = cache->buckets[i];
+    while (entry != NULL) {
+      CacheEntry *next = entry->next;
+      CacheEntry **bucket = &buckets[entry->hash & (newCount - 1)];
+      entry->next = *bucket;
+      *bucket = entry;
+      entry = next;
+    }
+  }
+  FREE_ARRAY(CacheEntry *, cache->buckets, oldCount);
+  cache->buckets = buckets;
+  cache->bucketCount = newCount;
+}
+
+// Returns the chunk cached for the source compiled with `passes`, marking
+// it most recently used, or NULL if there is none. Counts the lookup as a
+// hit or a miss.
+Chunk *findChunk(ChunkCache *cache, const char *source, int length,
+                 int passes, uint32_t hash) {
+  if (cache->count > 0) {
+    CacheEntry *entry = cache->buckets[hash & (cache->bucketCount - 1)];
+    for (; entry != NULL; entry = entry->next) {
+      if (entry->hash == hash && entry->length == length &&
+          entry->passes == passes &&
+          memcmp(entry->source, source, length) == 0) {
+        unlinkEntry(cache, entry);
+        linkNewest(cache, entry);
+        cache->hits++;
+        return &entry->chunk;
+      }
+    }
+  }
+  cache->misses++;
+  return NULL;
+}
+
+// Takes ownership of a chunk compiled from `source` with `passes`, evicting
+// older chunks until the cache is back within its budget.
+// Returns the cached chunk, or NULL if it is too big to be cached at all in
+// which case `chunk` is left with the caller.
+Chunk *addChunk(ChunkCache *cache, const char *source, int length,
+                int passes, uint32_t hash, Chunk *chunk) {
+  size_t size = sizeof(CacheEntry) + length + 1;
+  if (chunk->block != NULL) {
+    size += chunk->blockSize;
+  } else {
+    size += chunk->capacity * (sizeof(uint8_t) + sizeof(int)) +
+            chunk->constants.capacity * sizeof(Value);
+  }
+  if (size > cache->budget) {
+    return NULL;
+  }
+  while (cache->bytes + size > cache->budget) {
+    evictOldest(cache);
+  }
+  if (cache->count + 1 > cache->bucketCount * 3 / 4) {
+    growBuckets(cache);
+  }
+
+  CacheEntry *entry = ALLOCATE(CacheEntry, 1);
+  entry->hash = hash;
+  entry->length = length;
+  entry->passes = passes;
+  entry->source = ALLOCATE(char, length + 1);
+  memcpy(entry->source, source, length);
+  entry->source[length] = '\0';
+  entry->chunk = *chunk;
+  entry->size = size;
+
+  CacheEntry **bucket = &cache->buckets[hash & (cache->bucketCount - 1)];
+  entry->next = *bucket;
+  *bucket = entry;
+  linkNewest(cache, entry);
+  cache->bytes += size;
+  cache->count++;
+  return &entry->chunk;
+}
+
+// Frees every cached chunk and the table itself. The counters survive so
+// they can still be reported.
+void freeCache(ChunkCache *cache) {
+  CacheEntry *entry = cache->newest;
+  while (entry != NULL) {
+    CacheEntry *older = entry->older;
+    freeEntry(entry);
+    entry = older;
+  }
+  FREE_ARRAY(CacheEntry *, cache->buckets, cache->bucketCount);
+  cache->buckets = NULL;
+  cache->bucketCount = 0;
+  cache->count = 0;
+  cache->newest = NULL;
+  cache->oldest = NULL;
+  cache->bytes = 0;
+}
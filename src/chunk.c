@@ -1,6 +1,14 @@
 #include "chunk.h"
+#include "jit.h"
 #include "memory.h"
+#include "object.h"
+#include <math.h>
 #include <stdlib.h>
+#include <string.h>
+
+// Finalized chunks start on a cache line, so a small chunk's code and
+// constants are read in as few lines as possible.
+#define CACHE_LINE_SIZE 64
 
 // Initializes a new chunk
 void initChunk(Chunk *chunk) {
@@ -8,6 +16,14 @@ void initChunk(Chunk *chunk) {
   chunk->capacity = 0;
   chunk->code = NULL;
   chunk->lines = NULL;
+  chunk->inputCount = 0;
+  chunk->hotness = 0;
+  chunk->jitCode = NULL;
+  chunk->jitSize = 0;
+  chunk->frozen = false;
+  chunk->block = NULL;
+  chunk->blockSize = 0;
+  chunk->fuelCost = -1;
   initValueArray(&chunk->constants);
 }
 
@@ -28,9 +44,14 @@ void writeChunk(Chunk *chunk, uint8_t byte, int line) {
 
 // Decallocates all chunk-related memory and zeros fields.
 void freeChunk(Chunk *chunk) {
-  FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-  FREE_ARRAY(int, chunk->lines, chunk->capacity);
-  freeValueArray(&chunk->constants);
+  if (chunk->block != NULL) {
+    FREE_ARRAY(uint8_t, chunk->block, chunk->blockSize);
+  } else {
+    FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+    FREE_ARRAY(int, chunk->lines, chunk->capacity);
+    freeValueArray(&chunk->constants);
+  }
+  freeJit(chunk);
   initChunk(chunk); // Leaves chunk in a well-defined, empty state
 }
 
@@ -39,4 +60,165 @@ void freeChunk(Chunk *chunk) {
 int addConstant(Chunk *chunk, Value value) {
   writeValueArray(&chunk->constants, value);
   return chunk->constants.count - 1;
-}
\ No newline at end of file
+}
+
+static size_t alignUp(size_t size, size_t alignment) {
+  return (size + alignment - 1) & ~(alignment - 1);
+}
+
+// Bytes a copy of a string constant takes in a finalized chunk's block,
+// starting `offset` bytes in. Returns the offset just past it.
+static size_t placeString(size_t offset, ObjString *string) {
+  return alignUp(offset, _Alignof(ObjString)) + sizeof(ObjString) +
+         string->length + 1;
+}
+
+// Moves the code, constants and lines of a chunk that is done growing into
+// one block sized to fit, hot code and constants first and the lines only
+// runtime errors read last. Nothing may be appended to a finalized chunk,
+// though the VM still quickens its code in place.
+// String constants are copied into the block too, so the chunk owns them
+// and freeing it frees them. The strings the compiler made are left for
+// their heap to free.
+void finalizeChunk(Chunk *chunk) {
+  if (chunk->block != NULL) {
+    return;
+  }
+  size_t constantsOffset = alignUp(chunk->count, _Alignof(Value));
+  size_t stringsOffset =
+      constantsOffset + sizeof(Value) * chunk->constants.count;
+  size_t stringsEnd = stringsOffset;
+  for (int i = 0; i < chunk->constants.count; i++) {
+    if (IS_STRING(chunk->constants.values[i])) {
+      stringsEnd =
+          placeString(stringsEnd, AS_STRING(chunk->constants.values[i]));
+    }
+  }
+  size_t linesOffset = alignUp(stringsEnd, _Alignof(int));
+  size_t size = linesOffset + sizeof(int) * chunk->count;
+  // malloc() only aligns to 16 bytes, the slack lets the block start on a
+  // cache line.
+  size_t blockSize = size + CACHE_LINE_SIZE - 16;
+  uint8_t *block = ALLOCATE(uint8_t, blockSize);
+  uint8_t *start = (uint8_t *)alignUp((uintptr_t)block, CACHE_LINE_SIZE);
+
+  Value *constants = (Value *)(start + constantsOffset);
+  int *lines = (int *)(start + linesOffset);
+  if (chunk->count > 0) {
+    memcpy(start, chunk->code, chunk->count);
+    memcpy(lines, chunk->lines, sizeof(int) * chunk->count);
+  }
+  size_t stringOffset = stringsOffset;
+  for (int i = 0; i < chunk->constants.count; i++) {
+    Value value = chunk->constants.values[i];
+    if (IS_STRING(value)) {
+      ObjString *string = AS_STRING(value);
+      ObjString *copy = (ObjString *)(start + alignUp(stringOffset,
+                                                      _Alignof(ObjString)));
+      *copy = *string;
+      copy->chars = (char *)(copy + 1);
+      memcpy(copy->chars, string->chars, string->length + 1);
+      stringOffset = placeString(stringOffset, string);
+      value = OBJ_VAL(copy);
+    }
+    constants[i] = value;
+  }
+  FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+  FREE_ARRAY(int, chunk->lines, chunk->capacity);
+  FREE_ARRAY(Value, chunk->constants.values, chunk->constants.capacity);
+
+  chunk->code = start;
+  chunk->lines = lines;
+  chunk->capacity = chunk->count;
+  chunk->constants.values = constants;
+  chunk->constants.capacity = chunk->constants.count;
+  chunk->block = block;
+  chunk->blockSize = blockSize;
+  chunk->fuelCost = countFuel(chunk);
+}
+
+// Whether a number can be an operand of OP_SHORT_INT, which is what the
+// compiler emits for it instead of a constant. -0 can't, it would come
+// back as 0.
+bool isSmallInteger(double number) {
+  return number >= INT16_MIN && number <= INT16_MAX &&
+         number == (int16_t)number && !signbit(number);
+}
+
+// Returns the number of bytes an instruction occupies in the bytecode,
+// the opcode itself plus its operands.
+int instructionLength(uint8_t instruction) {
+  switch (instruction) {
+  case OP_CONSTANT:
+  case OP_SMALL_INT:
+  case OP_GET_INPUT:
+  case OP_PICK:
+  case OP_CONCAT:
+    return 2;
+  case OP_SHORT_INT:
+    return 3;
+  default:
+    return 1;
+  }
+}
+
+// Returns how many values the instruction at `instruction` pushes minus how
+// many it pops.
+int stackEffect(const uint8_t *instruction) {
+  switch (instruction[0]) {
+  case OP_CONSTANT:
+  case OP_NIL:
+  case OP_TRUE:
+  case OP_FALSE:
+  case OP_ZERO:
+  case OP_ONE:
+  case OP_SMALL_INT:
+  case OP_SHORT_INT:
+  case OP_GET_INPUT:
+  case OP_DUP:
+  case OP_PICK:
+    return 1;
+  case OP_NOT:
+  case OP_NEGATE:
+    return 0;
+  case OP_CONCAT:
+    return 1 - instruction[1];
+  default:
+    // Binary operators and OP_RETURN.
+    return -1;
+  }
+}
+
+// Returns the deepest the stack gets while running the chunk, or -1 if some
+// instruction would pop from an empty stack. Lox has no control flow yet, so
+// this is a single pass in code order.
+int maxStackDepth(Chunk *chunk) {
+  int depth = 0;
+  int max = 0;
+  for (int offset = 0; offset < chunk->count;
+       offset += instructionLength(chunk->code[offset])) {
+    depth += stackEffect(&chunk->code[offset]);
+    if (depth < 0) {
+      return -1;
+    }
+    if (depth > max) {
+      max = depth;
+    }
+  }
+  return max;
+}
+
+// Returns the fuel a run of the chunk burns, see VM.fuel. Each instruction
+// costs one and OP_CONCAT one more per operand, as its work grows with
+// them. Lox has no control flow yet, so every run burns all of it.
+int countFuel(Chunk *chunk) {
+  int fuel = 0;
+  for (int offset = 0; offset < chunk->count;
+       offset += instructionLength(chunk->code[offset])) {
+    fuel++;
+    if (chunk->code[offset] == OP_CONCAT) {
+      fuel += chunk->code[offset + 1];
+    }
+  }
+  return fuel;
+}
@@ -1,9 +1,12 @@
 #include <stdio.h>
-#include <stdlib.h>
+#include <string.h>
 
 #include "chunk.h"
 #include "common.h"
 #include "compiler.h"
+#include "counters.h"
+#include "lower.h"
+#include "optimizer.h"
 #include "scanner.h"
 #include "value.h"
 
@@ -36,14 +39,17 @@ typedef enum Precedence {
 } Precedence;
 
 // C's syntax for function ptrs is bad. So we wrap with a typedef.
-typedef void (*ParseFn)();
+// Parse functions return the IR of the expression they parsed.
+typedef IrNode *(*PrefixFn)();
+// Infix ones also take the IR of their left operand.
+typedef IrNode *(*InfixFn)(IrNode *left);
 
 typedef struct ParseRule {
   // function to compile a prefix expression starting with a token of that type.
-  ParseFn prefix;
+  PrefixFn prefix;
   // function to compile an infix expression whose left operand is followed by a
   // token of that type.
-  ParseFn infix;
+  InfixFn infix;
   // precedence of an infix expression that uses that token as an operator.
   Precedence precedence;
 } ParseRule;
@@ -52,11 +58,20 @@ typedef struct ParseRule {
 // This is to save from passing state around from function to function.
 Parser parser;
 Chunk *compilingChunk;
+// The parser builds the expression here, the chunk is emitted from it once
+// the passes ran, see endCompiler().
+Ir ir;
+// Constants the expression holds so far.
+int constantCount;
+// Names of the inputs the host declared, an identifier compiles to the index
+// of its name in here.
+const char *const *inputNames;
+int inputCount;
 
 // Returns a pointer to the current chunk being compiled.
 static Chunk *currentChunk() { return compilingChunk; }
 
-// Prints an error to standard error and sets hadError flag in parser.
+// Prints an error to vm.errors and sets hadError flag in parser.
 static void errorAt(Token *token, const char *message) {
   // Simply surpress any other errors while in panic mode.
   // This is so we keep compiling as normal as if error never
@@ -68,18 +83,19 @@ static void errorAt(Token *token, const char *message) {
   }
   parser.panicMode = true;
   // Print line information from token.
-  fprintf(stderr, "[line %d] Error", token->line);
+  printOutput(&vm.errors, "[line %d] Error", token->line);
 
   if (token->type == TOKEN_EOF) {
-    fprintf(stderr, " at end");
+    printOutput(&vm.errors, " at end");
   } else if (TOKEN_ERROR) {
     // Do nothing
   } else {
     // Print lexeme
-    fprintf(stderr, " at '%.*s'", token->length, token->start);
+    printOutput(&vm.errors, " at '%.*s'", token->length, token->start);
   }
 
-  fprintf(stderr, ": %s\n", message);
+  printOutput(&vm.errors, ": %s\n", message);
+  flushOutput(&vm.errors);
   parser.hadError = true;
 }
 
@@ -126,35 +142,50 @@ static void emitByte(uint8_t byte) {
   writeChunk(currentChunk(), byte, parser.previous.line);
 }
 
-// Wrapper around emitByte().
-// Appends 2 bytes. Useful for opcde + 1-byte operand cases.
-static void emitBytes(uint8_t byte1, uint8_t byte2) {
-  emitByte(byte1);
-  emitByte(byte2);
-}
-
 // Emits a return instruction
 static void emitReturn() { emitByte(OP_RETURN); }
 
-static uint8_t makeConstant(Value value) {
-  int constant = addConstant(currentChunk(), value);
+// Creates the IR node of a literal which needs an entry in the constants
+// table. The limit is checked here where the error can point at the literal.
+// The passes only need fewer entries, except when folding small integers,
+// which need none, into a number which does. Lowering catches that.
+static IrNode *makeConstant(Value value) {
   // Overflow check
   // BONUS: Support OP_CONSTANT_16
-  if (constant > UINT8_MAX) {
+  if (++constantCount > UINT8_MAX + 1) {
     error("Too many constants in one chunk.");
-    return 0;
   }
 
-  return (uint8_t)constant;
+  return newConstant(&ir, value, parser.previous.line);
 }
 
-// Emits a constant opode instruction and inserts an entry in the constants
-// table.
-static void emitConstant(Value value) {
-  emitBytes(OP_CONSTANT, makeConstant(value));
-}
-
-static void endCompiler() {
+// Optimizes the parsed expression and lowers it to bytecode.
+static void endCompiler(IrNode *root) {
+  if (!parser.hadError) {
+    ir.root = root;
+    // Immediates need no constants, so only the stack limits how deep an
+    // expression nests. Whether it is too deep mustn't depend on the
+    // passes, folding could flatten it, so a dry run decides that first.
+    if (vm.passes != 0 && lowerIr(&ir, NULL) == LOWER_TOO_DEEP) {
+      error("Expression too deep.");
+    } else {
+      optimizeIr(&ir, vm.passes);
+      // CSE only hoists what a dry run lowered, so this only fails if
+      // folding made the constants overflow, or without passes if the
+      // expression is too deep.
+      switch (lowerIr(&ir, currentChunk())) {
+      case LOWER_OK:
+        break;
+      case LOWER_INVALID:
+        error("Too many constants in one chunk.");
+        break;
+      case LOWER_TOO_DEEP:
+        error("Expression too deep.");
+        break;
+      }
+    }
+  }
+  freeIr(&ir);
 // Dump the chunk if no parser errors.
 // We could print dissasembly even with errors, since no bytecode is executed.
 // BUT it would be pointless since the parser would be in a confused state.
@@ -167,173 +198,188 @@ static void endCompiler() {
 }
 
 // Forward declarations to keep compiler happy :)
-static void expression();
+static IrNode *expression();
 static ParseRule *getRule(TokenType type);
-static void parsePrecedence(Precedence precedence);
+static IrNode *parsePrecedence(Precedence precedence);
 
 // Assumes entire left hand operand expression has been compiled AND
 // subsequent infix operator has been consumed and stored in previous.
 // Fetches the appropriate rule for the operator's type and parses precedence.
-// Emits the appropriate bytecode instruction that performs the binary
-// operation.
-static void binary() {
+// Builds the IR node of the binary operation, which reports errors on the
+// line its right operand ends on.
+static IrNode *binary(IrNode *left) {
   TokenType operatorType = parser.previous.type;
   ParseRule *rule = getRule(operatorType);
-  parsePrecedence((Precedence)(rule->precedence + 1));
+  IrNode *right = parsePrecedence((Precedence)(rule->precedence + 1));
+  int line = parser.previous.line;
 
   switch (operatorType) {
   case TOKEN_BANG_EQUAL: {
-    emitBytes(OP_EQUAL, OP_NOT);
-    break;
+    return newUnary(&ir, IR_NOT, newBinary(&ir, IR_EQUAL, left, right, line),
+                    line);
   }
   case TOKEN_EQUAL_EQUAL: {
-    emitByte(OP_EQUAL);
-    break;
+    return newBinary(&ir, IR_EQUAL, left, right, line);
   }
   case TOKEN_GREATER: {
-    emitByte(OP_GREATER);
-    break;
+    return newBinary(&ir, IR_GREATER, left, right, line);
   }
   // NOTE: IEEE 754 is NOT IMPLEMENTED.
   //  NaN <= 1 is false and NaN > 1 is also false. But our desugaring assumes
   //  the latter is always the negation of the former.
   case TOKEN_GREATER_EQUAL: {
-    emitBytes(OP_LESS, OP_NOT);
-    break;
+    return newUnary(&ir, IR_NOT, newBinary(&ir, IR_LESS, left, right, line),
+                    line);
   }
   case TOKEN_LESS: {
-    emitByte(OP_LESS);
-    break;
+    return newBinary(&ir, IR_LESS, left, right, line);
   }
   case TOKEN_LESS_EQUAL: {
-    emitBytes(OP_GREATER, OP_NOT);
-    break;
+    return newUnary(&ir, IR_NOT, newBinary(&ir, IR_GREATER, left, right, line),
+                    line);
   }
   case TOKEN_PLUS: {
-    emitByte(OP_ADD);
-    break;
+    return newBinary(&ir, IR_ADD, left, right, line);
   }
   case TOKEN_MINUS: {
-    emitByte(OP_SUBTRACT);
-    break;
+    return newBinary(&ir, IR_SUBTRACT, left, right, line);
   }
   case TOKEN_STAR: {
-    emitByte(OP_MULTIPLY);
-    break;
+    return newBinary(&ir, IR_MULTIPLY, left, right, line);
   }
   case TOKEN_SLASH: {
-    emitByte(OP_DIVIDE);
-    break;
+    return newBinary(&ir, IR_DIVIDE, left, right, line);
   }
 
   default:
-    break; // Unreachable
+    return NULL; // Unreachable
   }
 }
 
 // Assumes keyword token already consumed by parsePrecedence()
-// Returns instruction opcode based on TokenType
-static void literal() {
+// Returns the constant node of the keyword's value
+static IrNode *literal() {
+  Value value;
   switch (parser.previous.type) {
   case TOKEN_FALSE: {
-    emitByte(OP_FALSE);
+    value = BOOL_VAL(false);
     break;
   }
   case TOKEN_NIL: {
-    emitByte(OP_NIL);
+    value = NIL_VAL;
     break;
   }
   case TOKEN_TRUE: {
-    emitByte(OP_TRUE);
+    value = BOOL_VAL(true);
     break;
   }
   default:
-    return; // Unreachable
+    return NULL; // Unreachable
   }
+  return newConstant(&ir, value, parser.previous.line);
 }
 
 // Reads next token and looks up corresponding prefix parse rule.
 // Compiles prefix expression and consumes needed tokens.
 // Then look for and compiles infix expression similarly.
-static void parsePrecedence(Precedence precedence) {
+// Returns the expression's IR, NULL after an error.
+static IrNode *parsePrecedence(Precedence precedence) {
   advance();
   // First token will /always/ belong to some prefix expression.
-  ParseFn prefixRule = getRule(parser.previous.type)->prefix;
+  PrefixFn prefixRule = getRule(parser.previous.type)->prefix;
   if (prefixRule == NULL) {
     error("Exprect expression.");
-    return;
+    return NULL;
   }
 
   // Compiles prefix expression and consumes needed tokens.
-  prefixRule();
+  IrNode *node = prefixRule();
 
   // Look for infix expression, prefix might be operand for it.
   // But only if precedence is of high enough precedence.
   while (precedence <= getRule(parser.current.type)->precedence) {
     advance();
-    ParseFn infixRule = getRule(parser.previous.type)->infix;
-    infixRule();
+    InfixFn infixRule = getRule(parser.previous.type)->infix;
+    node = infixRule(node);
   }
+  return node;
 }
 
-static void expression() {
+static IrNode *expression() {
   // Parse the lowest precedence level, which subsumes (includes) all of the
   // higher-precedence expressions too
-  parsePrecedence(PREC_ASSIGNMENT);
+  return parsePrecedence(PREC_ASSIGNMENT);
 }
 
 // Assumes initial left paren token has been consumed.
 // Recursively calls back into expression() to compile inner expr.
 // Finally, consumes the closing right paren token.
-static void grouping() {
-  expression();
+static IrNode *grouping() {
+  IrNode *node = expression();
   consume(TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
+  return node;
 }
 
 // Assumes number token has been consumed and stored in previous.
-// Converts number string lexeme to a value of type double.
-// Finally, emits the constant.
-static void number() {
-  double value = strtod(parser.previous.start, NULL);
-  emitConstant(NUMBER_VAL(value));
+// The scanner already converted the lexeme to a double.
+// Finally, makes the constant. Small integers are emitted as immediate
+// operands and take no entry in the constants table.
+static IrNode *number() {
+  double number = parser.previous.number;
+  if (isSmallInteger(number)) {
+    return newConstant(&ir, NUMBER_VAL(number), parser.previous.line);
+  }
+  return makeConstant(NUMBER_VAL(number));
 }
 
 // Takes the string's characters directly from the lexeme.
 // +1 and -2 trim the leading and trailing quotation marks.
-// Then creates a string object, wraps it in a Value and emits
-// it into the constants table.
+// Then creates a string object, wraps it in a Value and makes
+// a constant of it.
 // BONUS: Support escape sequences and translate them here e.g., ('\n')
-static void string() {
-  emitConstant(OBJ_VAL(
+static IrNode *string() {
+  return makeConstant(OBJ_VAL(
       copyString(parser.previous.start + 1, parser.previous.length - 2)));
 }
 
+// Assumes identifier token has been consumed and stored in previous.
+// Resolves it against the declared inputs and reads that slot.
+static IrNode *variable() {
+  Token *name = &parser.previous;
+  for (int i = 0; i < inputCount; i++) {
+    if ((int)strlen(inputNames[i]) == name->length &&
+        memcmp(inputNames[i], name->start, name->length) == 0) {
+      return newInput(&ir, i, name->line);
+    }
+  }
+  error("Undefined input.");
+  return NULL;
+}
+
 // Assumes leading minus/bang token has been consumed and stored in previous.
 // Recursively calls back into expression to compile operand.
-// Emits bytecode to perform unary operation.
-static void unary() {
+// Builds the IR node to perform unary operation.
+static IrNode *unary() {
   TokenType operatorType = parser.previous.type;
 
-  // BONUS: Store line before compiling operand and pass into emitByte()
+  // BONUS: Store line before compiling operand and pass into newUnary()
   // This would help with multi-line negation such as print - `\n` true;
 
   // Compile the operand
-  parsePrecedence(PREC_UNARY);
+  IrNode *operand = parsePrecedence(PREC_UNARY);
 
-  // Emit operator instruction
+  // Build operator node
   switch (operatorType) {
   case TOKEN_BANG: {
-    emitByte(OP_NOT);
-    break;
+    return newUnary(&ir, IR_NOT, operand, parser.previous.line);
   }
   case TOKEN_MINUS: {
-    // emitted after operand bytecode because vm is stack based.
-    emitByte(OP_NEGATE);
-    break;
+    // lowered after operand bytecode because vm is stack based.
+    return newUnary(&ir, IR_NEGATE, operand, parser.previous.line);
   }
 
   default:
-    return; // Unreachable
+    return NULL; // Unreachable
   }
 }
 
@@ -358,7 +404,7 @@ ParseRule rules[] = {
     [TOKEN_GREATER_EQUAL] = {NULL, binary, PREC_COMPARISON},
     [TOKEN_LESS] = {NULL, binary, PREC_COMPARISON},
     [TOKEN_LESS_EQUAL] = {NULL, binary, PREC_COMPARISON},
-    [TOKEN_IDENTIFIER] = {NULL, NULL, PREC_NONE},
+    [TOKEN_IDENTIFIER] = {variable, NULL, PREC_NONE},
     [TOKEN_STRING] = {string, NULL, PREC_NONE},
     [TOKEN_NUMBER] = {number, NULL, PREC_NONE},
     [TOKEN_AND] = {NULL, NULL, PREC_NONE},
@@ -387,19 +433,64 @@ static ParseRule *getRule(TokenType type) { return &rules[type]; }
 // Compiles the input source code to bytecode chunk
 // Returns a boolean of success status
 bool compile(const char *source, Chunk *chunk) {
+  return compileInputs(source, chunk, NULL, 0);
+}
+
+static bool compileSource(const char *source, Chunk *chunk,
+                          const char *const *names, int count) {
   initScanner(source);
   compilingChunk = chunk; // Initialize compilingChunk ptr to input chunk.
+  inputNames = names;
+  inputCount = count;
+  chunk->inputCount = count;
+  initIr(&ir);
+  constantCount = 0;
 
   // Initialize parser flags
   parser.hadError = false;
   parser.panicMode = false;
 
+  // The slot is a one byte operand.
+  if (count > UINT8_MAX + 1) {
+    printOutput(&vm.errors, "Too many inputs.\n");
+    flushOutput(&vm.errors);
+    return false;
+  }
+
   advance();
   // Currently, only support expression parsing.
   // TODO: Add statements
-  expression();
+  IrNode *root = expression();
   // End of source code should always be denoted with an EOF token
   consume(TOKEN_EOF, "Expect end of expression.");
-  endCompiler();
-  return !parser.hadError;
+  endCompiler(root);
+  if (parser.hadError) {
+    return false;
+  }
+  finalizeChunk(chunk);
+  return true;
+}
+
+// Compiles source code which may refer to the `count` inputs named in
+// `names`. Each run of the chunk then needs an array with a value for every
+// input, in the same order, see interpretInputs().
+// Returns a boolean of success status
+bool compileInputs(const char *source, Chunk *chunk, const char *const *names,
+                   int count) {
+  // What the compiler allocates is garbage once finalizeChunk() has copied
+  // the string constants into the chunk, so it goes into a heap of its own.
+  Heap kept = vm.heap;
+  initHeap(&vm.heap);
+  bool compiled;
+  if (!vm.counting) {
+    compiled = compileSource(source, chunk, names, count);
+  } else {
+    countScan(source);
+    startCounters(PHASE_COMPILE);
+    compiled = compileSource(source, chunk, names, count);
+    stopCounters(PHASE_COMPILE);
+  }
+  freeHeap(&vm.heap);
+  vm.heap = kept;
+  return compiled;
 }
@@ -0,0 +1,263 @@
+#include <errno.h>
+#include <string.h>
+
+#include "counters.h"
+#include "scanner.h"
+
+#ifdef COUNTERS_SUPPORTED
+#include <linux/perf_event.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Counters the PMU lets user space read with rdpmc skip the system call.
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define RDPMC_SUPPORTED
+#endif
+#endif
+
+typedef struct Counters {
+  // One perf event per counter, -1 if it could not be opened. The cycles
+  // event leads the group so the others count over exactly the same time.
+  int fds[COUNTER_EVENTS];
+  // Where each event's value is in a read of the whole group.
+  int slots[COUNTER_EVENTS];
+  // The event's mapped page, NULL if it isn't mapped. It tells whether and
+  // how the counter can be read with rdpmc.
+  void *pages[COUNTER_EVENTS];
+  // Counts when each phase last started, and what all spans of it added up
+  // to since.
+  uint64_t started[COUNTER_PHASES][COUNTER_EVENTS];
+  uint64_t totals[COUNTER_PHASES][COUNTER_EVENTS];
+  // Times each phase was counted.
+  uint64_t spans[COUNTER_PHASES];
+} Counters;
+
+static Counters counters = {
+    .fds = {-1, -1, -1, -1, -1},
+};
+
+static const char *const eventNames[COUNTER_EVENTS] = {
+    [COUNTER_CYCLES] = "cycles",
+    [COUNTER_INSTRUCTIONS] = "instructions",
+    [COUNTER_BRANCH_MISSES] = "branch_misses",
+    [COUNTER_L1D_MISSES] = "l1d_misses",
+    [COUNTER_LLC_MISSES] = "llc_misses",
+};
+
+static const char *const phaseNames[COUNTER_PHASES] = {
+    [PHASE_SCAN] = "scan",
+    [PHASE_COMPILE] = "compile",
+    [PHASE_RUN] = "run",
+};
+
+#ifdef COUNTERS_SUPPORTED
+
+typedef struct EventConfig {
+  uint32_t type;
+  uint64_t config;
+} EventConfig;
+
+static const EventConfig eventConfigs[COUNTER_EVENTS] = {
+    [COUNTER_CYCLES] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    [COUNTER_INSTRUCTIONS] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    [COUNTER_BRANCH_MISSES] = {PERF_TYPE_HARDWARE,
+                               PERF_COUNT_HW_BRANCH_MISSES},
+    [COUNTER_L1D_MISSES] = {PERF_TYPE_HW_CACHE,
+                            PERF_COUNT_HW_CACHE_L1D |
+                                (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+    // Generic cache misses are last level cache misses on most CPUs.
+    [COUNTER_LLC_MISSES] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+};
+
+// Opens an event counting this process in user space, into `group` or as
+// the leader of a new group if that is -1. Returns -1 on failure.
+static int openEvent(CounterEvent event, int group) {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = eventConfigs[event].type;
+  attr.config = eventConfigs[event].config;
+  attr.read_format = PERF_FORMAT_GROUP;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  // A pinned group is never multiplexed with others, so its counts need no
+  // scaling. Events the PMU can't fit alongside the rest fail to open.
+  attr.pinned = group == -1;
+  return (int)syscall(SYS_perf_event_open, &attr, 0, -1, group, 0);
+}
+
+#ifdef RDPMC_SUPPORTED
+// Reads an event without a system call, following the protocol documented
+// for perf_event_mmap_page. Returns false if it can't be read that way, e.g.
+// the kernel doesn't allow rdpmc or the event isn't on the PMU right now.
+static bool readUserCounter(void *mapped, uint64_t *value) {
+  volatile struct perf_event_mmap_page *page = mapped;
+  uint32_t sequence;
+  uint64_t count;
+  do {
+    sequence = page->lock;
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    uint32_t index = page->index;
+    if (!page->cap_user_rdpmc || index == 0) {
+      return false;
+    }
+    // The hardware counter is only pmc_width bits wide, sign extend it.
+    int shift = 64 - page->pmc_width;
+    int64_t pmc = (int64_t)((uint64_t)__rdpmc((int)index - 1) << shift);
+    count = page->offset + (pmc >> shift);
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+  } while (page->lock != sequence);
+  *value = count;
+  return true;
+}
+#endif
+
+// Opens every event the kernel and PMU support. Returns false, with errno
+// set, if not even the cycles counter could be opened, e.g. in containers
+// and VMs without access to the PMU.
+bool openCounters() {
+  int leader = openEvent(COUNTER_CYCLES, -1);
+  if (leader < 0) {
+    return false;
+  }
+  long pageSize = sysconf(_SC_PAGESIZE);
+  int count = 0;
+  for (int i = 0; i < COUNTER_EVENTS; i++) {
+    int fd = i == COUNTER_CYCLES ? leader : openEvent((CounterEvent)i, leader);
+    if (fd < 0) {
+      continue;
+    }
+    counters.fds[i] = fd;
+    counters.slots[i] = count++;
+    void *page = mmap(NULL, pageSize, PROT_READ, MAP_SHARED, fd, 0);
+    counters.pages[i] = page == MAP_FAILED ? NULL : page;
+  }
+  return true;
+}
+
+// Closes the events, the group's leader last.
+void closeCounters() {
+  long pageSize = sysconf(_SC_PAGESIZE);
+  for (int i = COUNTER_EVENTS - 1; i >= 0; i--) {
+    if (counters.pages[i] != NULL) {
+      munmap(counters.pages[i], pageSize);
+      counters.pages[i] = NULL;
+    }
+    if (counters.fds[i] >= 0) {
+      close(counters.fds[i]);
+      counters.fds[i] = -1;
+    }
+  }
+}
+
+// Stores the current count of every event in `values`, 0 for those that
+// aren't counted. Reads the counters with rdpmc where possible, otherwise
+// the whole group with one system call.
+void readCounters(uint64_t *values) {
+  uint64_t group[1 + COUNTER_EVENTS];
+  bool grouped = false;
+  for (int i = 0; i < COUNTER_EVENTS; i++) {
+    values[i] = 0;
+    if (counters.fds[i] < 0) {
+      continue;
+    }
+#ifdef RDPMC_SUPPORTED
+    if (counters.pages[i] != NULL &&
+        readUserCounter(counters.pages[i], &values[i])) {
+      continue;
+    }
+#endif
+    if (!grouped) {
+      grouped = true;
+      // The number of events, then their values in the order they opened.
+      if (read(counters.fds[COUNTER_CYCLES], group, sizeof(group)) <
+          (ssize_t)sizeof(uint64_t)) {
+        memset(group, 0, sizeof(group));
+      }
+    }
+    values[i] = group[1 + counters.slots[i]];
+  }
+}
+
+#else
+
+bool openCounters() {
+  errno = ENOSYS;
+  return false;
+}
+
+void closeCounters() {}
+
+void readCounters(uint64_t *values) {
+  memset(values, 0, sizeof(uint64_t) * COUNTER_EVENTS);
+}
+
+#endif
+
+// Whether an event is being counted.
+bool isCounting(CounterEvent event) { return counters.fds[event] >= 0; }
+
+// Returns the name reports use for an event.
+const char *counterName(CounterEvent event) { return eventNames[event]; }
+
+void startCounters(CounterPhase phase) {
+  readCounters(counters.started[phase]);
+}
+
+// Adds what the events counted since startCounters() to the phase.
+void stopCounters(CounterPhase phase) {
+  uint64_t now[COUNTER_EVENTS];
+  readCounters(now);
+  for (int i = 0; i < COUNTER_EVENTS; i++) {
+    counters.totals[phase][i] += now[i] - counters.started[phase][i];
+  }
+  counters.spans[phase]++;
+}
+
+// Counts a scan of the whole source as the scan phase. The compiler scans
+// as it parses, too finely interleaved to be counted apart, so this is an
+// extra pass and the compile phase includes the compiler's own scan.
+void countScan(const char *source) {
+  startCounters(PHASE_SCAN);
+  initScanner(source);
+  while (scanToken().type != TOKEN_EOF) {
+  }
+  stopCounters(PHASE_SCAN);
+}
+
+// Prints `count` per `per`, times `scale`, or n/a if either isn't counted.
+static void printRatio(FILE *out, CounterEvent count, CounterEvent per,
+                       const uint64_t *totals, double scale) {
+  if (isCounting(count) && isCounting(per) && totals[per] > 0) {
+    fprintf(out, " %10.2f", scale * totals[count] / totals[per]);
+  } else {
+    fprintf(out, " %10s", "n/a");
+  }
+}
+
+// Prints the totals of each phase with its IPC and miss rates. Misses are
+// per thousand instructions so phases of any length compare.
+void printCounters(FILE *out) {
+  fprintf(out, "== perf counters ==\n");
+  fprintf(out, "%-8s %6s %14s %14s %10s %10s %10s %10s\n", "phase", "spans",
+          "cycles", "instructions", "IPC", "br-MPKI", "L1d-MPKI", "LLC-MPKI");
+  for (int phase = 0; phase < COUNTER_PHASES; phase++) {
+    if (counters.spans[phase] == 0) {
+      continue;
+    }
+    const uint64_t *totals = counters.totals[phase];
+    fprintf(out, "%-8s %6llu %14llu %14llu", phaseNames[phase],
+            (unsigned long long)counters.spans[phase],
+            (unsigned long long)totals[COUNTER_CYCLES],
+            (unsigned long long)totals[COUNTER_INSTRUCTIONS]);
+    printRatio(out, COUNTER_INSTRUCTIONS, COUNTER_CYCLES, totals, 1.0);
+    printRatio(out, COUNTER_BRANCH_MISSES, COUNTER_INSTRUCTIONS, totals,
+               1000.0);
+    printRatio(out, COUNTER_L1D_MISSES, COUNTER_INSTRUCTIONS, totals, 1000.0);
+    printRatio(out, COUNTER_LLC_MISSES, COUNTER_INSTRUCTIONS, totals, 1000.0);
+    fprintf(out, "\n");
+  }
+}
@@ -1,11 +1,78 @@
 #include "debug.h"
 #include "chunk.h"
+#include "vm.h"
 #include <stdio.h>
 
+// Returns the printable name of an opcode, or NULL if the byte isn't one.
+const char *opcodeName(uint8_t instruction) {
+  switch (instruction) {
+  case OP_CONSTANT:
+    return "OP_CONSTANT";
+  case OP_NIL:
+    return "OP_NIL";
+  case OP_TRUE:
+    return "OP_TRUE";
+  case OP_FALSE:
+    return "OP_FALSE";
+  case OP_ZERO:
+    return "OP_ZERO";
+  case OP_ONE:
+    return "OP_ONE";
+  case OP_SMALL_INT:
+    return "OP_SMALL_INT";
+  case OP_SHORT_INT:
+    return "OP_SHORT_INT";
+  case OP_EQUAL:
+    return "OP_EQUAL";
+  case OP_GREATER:
+    return "OP_GREATER";
+  case OP_LESS:
+    return "OP_LESS";
+  case OP_ADD:
+    return "OP_ADD";
+  case OP_SUBTRACT:
+    return "OP_SUBTRACT";
+  case OP_MULTIPLY:
+    return "OP_MULTIPLY";
+  case OP_DIVIDE:
+    return "OP_DIVIDE";
+  case OP_NOT:
+    return "OP_NOT";
+  case OP_NEGATE:
+    return "OP_NEGATE";
+  case OP_GET_INPUT:
+    return "OP_GET_INPUT";
+  case OP_DUP:
+    return "OP_DUP";
+  case OP_PICK:
+    return "OP_PICK";
+  case OP_CONCAT:
+    return "OP_CONCAT";
+  case OP_RETURN:
+    return "OP_RETURN";
+  case OP_GREATER_NUM:
+    return "OP_GREATER_NUM";
+  case OP_LESS_NUM:
+    return "OP_LESS_NUM";
+  case OP_ADD_NUM:
+    return "OP_ADD_NUM";
+  case OP_ADD_STR:
+    return "OP_ADD_STR";
+  case OP_SUBTRACT_NUM:
+    return "OP_SUBTRACT_NUM";
+  case OP_MULTIPLY_NUM:
+    return "OP_MULTIPLY_NUM";
+  case OP_DIVIDE_NUM:
+    return "OP_DIVIDE_NUM";
+  default:
+    return NULL;
+  }
+}
+
 // Disassembles all instructions in a chunk
 void disassembleChunk(Chunk *chunk, const char *name) {
   // Print a header with the chunk name
-  printf("== %s ==\n", name);
+  printOutput(&vm.output, "== %s ==\n", name);
 
   // Disassemble each instruction in bytecode array
   int offset = 0;
@@ -20,11 +87,32 @@ static int constantInstruction(const char *name, Chunk *chunk, int offset) {
   uint8_t constantIdx = chunk->code[offset + 1];
   // Print name of instruction and constant index (from subsequent byte in
   // chunk)
-  printf("%-16s %4d '", name, constantIdx);
+  printOutput(&vm.output, "%-16s %4d '", name, constantIdx);
   // Print constant value. Constants are known at compile-time
   printValue(chunk->constants.values[constantIdx]);
-  printf("'\n");
+  printOutput(&vm.output, "'\n");
+
+  return offset + 2;
+}
+
+// Prints name of instruction and its one byte operand
+// Returns offset+2
+static int byteInstruction(const char *name, Chunk *chunk, int offset) {
+  uint8_t slot = chunk->code[offset + 1];
+  printOutput(&vm.output, "%-16s %4d\n", name, slot);
+  return offset + 2;
+}
 
+// Prints name of instruction and the integer it pushes
+// Returns offset+2 or offset+3
+static int integerInstruction(const char *name, Chunk *chunk, int offset) {
+  if (chunk->code[offset] == OP_SHORT_INT) {
+    printOutput(&vm.output, "%-16s %4d\n", name,
+                readShortInt(&chunk->code[offset + 1]));
+    return offset + 3;
+  }
+  printOutput(&vm.output, "%-16s %4d\n", name,
+              (int8_t)chunk->code[offset + 1]);
   return offset + 2;
 }
 
@@ -32,7 +120,7 @@ static int constantInstruction(const char *name, Chunk *chunk, int offset) {
 // Returns offset+1
 static int simpleInstruction(const char *name, int offset) {
   // Prints name of the instruction
-  printf("%s\n", name);
+  printOutput(&vm.output, "%s\n", name);
   return offset + 1;
 }
 
@@ -40,15 +128,15 @@ static int simpleInstruction(const char *name, int offset) {
 // Returns new offset
 int disassembleInstruction(Chunk *chunk, int offset) {
   // Prints byte offset of given instruction
-  printf("%04d ", offset);
+  printOutput(&vm.output, "%04d ", offset);
 
   // Prints line number
   if (offset > 0 && chunk->lines[offset] == chunk->lines[offset - 1]) {
     // If instruction has same line number as previous, print `|`
-    printf("   | ");
+    printOutput(&vm.output, "   | ");
   } else {
     // Print the line number
-    printf("%4d ", chunk->lines[offset]);
+    printOutput(&vm.output, "%4d ", chunk->lines[offset]);
   }
 
   // Read single byte from bytecode array at given offset
@@ -57,34 +145,23 @@ int disassembleInstruction(Chunk *chunk, int offset) {
   switch (instruction) {
   case OP_CONSTANT:
     return constantInstruction("OP_CONSTANT", chunk, offset);
-  case OP_NIL:
-    return simpleInstruction("OP_NIL", offset);
-  case OP_TRUE:
-    return simpleInstruction("OP_TRUE", offset);
-  case OP_FALSE:
-    return simpleInstruction("OP_FALSE", offset);
-  case OP_EQUAL:
-    return simpleInstruction("OP_EQUAL", offset);
-  case OP_GREATER:
-    return simpleInstruction("OP_GREATER", offset);
-  case OP_LESS:
-    return simpleInstruction("OP_LESS", offset);
-  case OP_ADD:
-    return simpleInstruction("OP_ADD", offset);
-  case OP_SUBTRACT:
-    return simpleInstruction("OP_SUBTRACT", offset);
-  case OP_MULTIPLY:
-    return simpleInstruction("OP_MULTIPLY", offset);
-  case OP_DIVIDE:
-    return simpleInstruction("OP_DIVIDE", offset);
-  case OP_NOT:
-    return simpleInstruction("OP_NOT", offset);
-  case OP_NEGATE:
-    return simpleInstruction("OP_NEGATE", offset);
-  case OP_RETURN:
-    return simpleInstruction("OP_RETURN", offset);
-  default:
-    printf("Unknown opcode %d\n", instruction);
+  case OP_SMALL_INT:
+    return integerInstruction("OP_SMALL_INT", chunk, offset);
+  case OP_SHORT_INT:
+    return integerInstruction("OP_SHORT_INT", chunk, offset);
+  case OP_GET_INPUT:
+    return byteInstruction("OP_GET_INPUT", chunk, offset);
+  case OP_PICK:
+    return byteInstruction("OP_PICK", chunk, offset);
+  case OP_CONCAT:
+    return byteInstruction("OP_CONCAT", chunk, offset);
+  default: {
+    const char *name = opcodeName(instruction);
+    if (name != NULL) {
+      return simpleInstruction(name, offset);
+    }
+    printOutput(&vm.output, "Unknown opcode %d\n", instruction);
     return offset + 1;
   }
+  }
 }
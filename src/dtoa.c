@@ -0,0 +1,372 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dtoa.h"
+
+// Formats doubles with Grisu3 (Loitsch, "Printing Floating-Point Numbers
+// Quickly and Accurately with Integers", 2010). Digits are generated with
+// 64-bit integer arithmetic only, and are the shortest which read back as
+// the same double. For about 0.5% of doubles Grisu3 can't prove that, and
+// those go through snprintf() and strtod() instead.
+
+// A floating point number f * 2^e with a 64-bit significand.
+typedef struct DiyFp {
+  uint64_t f;
+  int e;
+} DiyFp;
+
+#define SIGNIFICAND_BITS 52
+#define HIDDEN_BIT (1ULL << SIGNIFICAND_BITS)
+#define SIGNIFICAND_MASK (HIDDEN_BIT - 1)
+#define EXPONENT_BIAS (1023 + SIGNIFICAND_BITS)
+
+// Normalized approximations of 10^k for k = -348, -340, ..., 340, which is
+// every eighth power. Each significand is 10^k * 2^-e rounded to nearest,
+// computed with Python's exact integers:
+//   f = round(10**k / 2**e) with e such that 2**63 <= f < 2**64
+static const DiyFp cachedPowers[] = {
+    {0xfa8fd5a0081c0288ULL, -1220}, {0xbaaee17fa23ebf76ULL, -1193},
+    {0x8b16fb203055ac76ULL, -1166}, {0xcf42894a5dce35eaULL, -1140},
+    {0x9a6bb0aa55653b2dULL, -1113}, {0xe61acf033d1a45dfULL, -1087},
+    {0xab70fe17c79ac6caULL, -1060}, {0xff77b1fcbebcdc4fULL, -1034},
+    {0xbe5691ef416bd60cULL, -1007}, {0x8dd01fad907ffc3cULL, -980},
+    {0xd3515c2831559a83ULL, -954}, {0x9d71ac8fada6c9b5ULL, -927},
+    {0xea9c227723ee8bcbULL, -901}, {0xaecc49914078536dULL, -874},
+    {0x823c12795db6ce57ULL, -847}, {0xc21094364dfb5637ULL, -821},
+    {0x9096ea6f3848984fULL, -794}, {0xd77485cb25823ac7ULL, -768},
+    {0xa086cfcd97bf97f4ULL, -741}, {0xef340a98172aace5ULL, -715},
+    {0xb23867fb2a35b28eULL, -688}, {0x84c8d4dfd2c63f3bULL, -661},
+    {0xc5dd44271ad3cdbaULL, -635}, {0x936b9fcebb25c996ULL, -608},
+    {0xdbac6c247d62a584ULL, -582}, {0xa3ab66580d5fdaf6ULL, -555},
+    {0xf3e2f893dec3f126ULL, -529}, {0xb5b5ada8aaff80b8ULL, -502},
+    {0x87625f056c7c4a8bULL, -475}, {0xc9bcff6034c13053ULL, -449},
+    {0x964e858c91ba2655ULL, -422}, {0xdff9772470297ebdULL, -396},
+    {0xa6dfbd9fb8e5b88fULL, -369}, {0xf8a95fcf88747d94ULL, -343},
+    {0xb94470938fa89bcfULL, -316}, {0x8a08f0f8bf0f156bULL, -289},
+    {0xcdb02555653131b6ULL, -263}, {0x993fe2c6d07b7facULL, -236},
+    {0xe45c10c42a2b3b06ULL, -210}, {0xaa242499697392d3ULL, -183},
+    {0xfd87b5f28300ca0eULL, -157}, {0xbce5086492111aebULL, -130},
+    {0x8cbccc096f5088ccULL, -103}, {0xd1b71758e219652cULL, -77},
+    {0x9c40000000000000ULL, -50}, {0xe8d4a51000000000ULL, -24},
+    {0xad78ebc5ac620000ULL, 3}, {0x813f3978f8940984ULL, 30},
+    {0xc097ce7bc90715b3ULL, 56}, {0x8f7e32ce7bea5c70ULL, 83},
+    {0xd5d238a4abe98068ULL, 109}, {0x9f4f2726179a2245ULL, 136},
+    {0xed63a231d4c4fb27ULL, 162}, {0xb0de65388cc8ada8ULL, 189},
+    {0x83c7088e1aab65dbULL, 216}, {0xc45d1df942711d9aULL, 242},
+    {0x924d692ca61be758ULL, 269}, {0xda01ee641a708deaULL, 295},
+    {0xa26da3999aef774aULL, 322}, {0xf209787bb47d6b85ULL, 348},
+    {0xb454e4a179dd1877ULL, 375}, {0x865b86925b9bc5c2ULL, 402},
+    {0xc83553c5c8965d3dULL, 428}, {0x952ab45cfa97a0b3ULL, 455},
+    {0xde469fbd99a05fe3ULL, 481}, {0xa59bc234db398c25ULL, 508},
+    {0xf6c69a72a3989f5cULL, 534}, {0xb7dcbf5354e9beceULL, 561},
+    {0x88fcf317f22241e2ULL, 588}, {0xcc20ce9bd35c78a5ULL, 614},
+    {0x98165af37b2153dfULL, 641}, {0xe2a0b5dc971f303aULL, 667},
+    {0xa8d9d1535ce3b396ULL, 694}, {0xfb9b7cd9a4a7443cULL, 720},
+    {0xbb764c4ca7a44410ULL, 747}, {0x8bab8eefb6409c1aULL, 774},
+    {0xd01fef10a657842cULL, 800}, {0x9b10a4e5e9913129ULL, 827},
+    {0xe7109bfba19c0c9dULL, 853}, {0xac2820d9623bf429ULL, 880},
+    {0x80444b5e7aa7cf85ULL, 907}, {0xbf21e44003acdd2dULL, 933},
+    {0x8e679c2f5e44ff8fULL, 960}, {0xd433179d9c8cb841ULL, 986},
+    {0x9e19db92b4e31ba9ULL, 1013}, {0xeb96bf6ebadf77d9ULL, 1039},
+    {0xaf87023b9bf0ee6bULL, 1066},
+};
+
+#define CACHED_POWER_MIN -348
+#define CACHED_POWER_STEP 8
+
+static const uint64_t powersOfTen[] = {
+    1ULL,
+    10ULL,
+    100ULL,
+    1000ULL,
+    10000ULL,
+    100000ULL,
+    1000000ULL,
+    10000000ULL,
+    100000000ULL,
+    1000000000ULL,
+    10000000000ULL,
+    100000000000ULL,
+    1000000000000ULL,
+    10000000000000ULL,
+    100000000000000ULL,
+    1000000000000000ULL,
+    10000000000000000ULL,
+    100000000000000000ULL,
+    1000000000000000000ULL,
+    10000000000000000000ULL,
+};
+
+static DiyFp fromDouble(double value) {
+  uint64_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  int biased = (int)(bits >> SIGNIFICAND_BITS) & 0x7FF;
+  uint64_t significand = bits & SIGNIFICAND_MASK;
+  // Subnormals have no hidden bit and the smallest exponent.
+  if (biased == 0) {
+    return (DiyFp){significand, 1 - EXPONENT_BIAS};
+  }
+  return (DiyFp){significand + HIDDEN_BIT, biased - EXPONENT_BIAS};
+}
+
+static DiyFp normalize(DiyFp x) {
+  while (!(x.f & (1ULL << 63))) {
+    x.f <<= 1;
+    x.e--;
+  }
+  return x;
+}
+
+// The product's upper 64 bits, rounded.
+static DiyFp multiply(DiyFp x, DiyFp y) {
+  uint64_t a = x.f >> 32;
+  uint64_t b = x.f & 0xFFFFFFFF;
+  uint64_t c = y.f >> 32;
+  uint64_t d = y.f & 0xFFFFFFFF;
+  uint64_t ac = a * c;
+  uint64_t bc = b * c;
+  uint64_t ad = a * d;
+  uint64_t bd = b * d;
+  uint64_t middle = (bd >> 32) + (ad & 0xFFFFFFFF) + (bc & 0xFFFFFFFF);
+  middle += 1ULL << 31;
+  return (DiyFp){ac + (ad >> 32) + (bc >> 32) + (middle >> 32),
+                 x.e + y.e + 64};
+}
+
+// Sets `minus` and `plus` to the midpoints between `v` and its neighbouring
+// doubles, with the same exponent. Any number strictly between them reads
+// back as `v`.
+static void boundaries(DiyFp v, DiyFp *minus, DiyFp *plus) {
+  *plus = normalize((DiyFp){(v.f << 1) + 1, v.e - 1});
+  // The gap below a power of two is half the one above.
+  if (v.f == HIDDEN_BIT) {
+    *minus = (DiyFp){(v.f << 2) - 1, v.e - 2};
+  } else {
+    *minus = (DiyFp){(v.f << 1) - 1, v.e - 1};
+  }
+  minus->f <<= minus->e - plus->e;
+  minus->e = plus->e;
+}
+
+// Returns the cached power c = 10^-k which brings a number with binary
+// exponent `e` into a range where its integer part fits in 32 bits.
+static DiyFp cachedPower(int e, int *k) {
+  // ceil((-61 - e) * log10(2)) + 347, offset so the cast truncates a
+  // positive number.
+  double dk = (-61 - e) * 0.30102999566398114 + 347;
+  int index = (int)dk;
+  if (dk - index > 0.0) {
+    index++;
+  }
+  index = index / CACHED_POWER_STEP + 1;
+  *k = -(CACHED_POWER_MIN + index * CACHED_POWER_STEP);
+  return cachedPowers[index];
+}
+
+// Moves the last digit towards `w`, the scaled value itself, while the
+// digits stay within the unsafe interval. The products Grisu works with are
+// off by up to `unit`, so `w` lies within `unit` of `tooHigh - distance`.
+// Returns false if that error leaves it open which digits are closest, or
+// whether they are inside the boundaries at all.
+static bool roundWeed(char *digits, int length, uint64_t distance,
+                      uint64_t unsafe, uint64_t rest, uint64_t tenKappa,
+                      uint64_t unit) {
+  uint64_t smallDistance = distance - unit;
+  uint64_t bigDistance = distance + unit;
+  while (rest < smallDistance && unsafe - rest >= tenKappa &&
+         (rest + tenKappa < smallDistance ||
+          smallDistance - rest >= rest + tenKappa - smallDistance)) {
+    digits[length - 1]--;
+    rest += tenKappa;
+  }
+  if (rest < bigDistance && unsafe - rest >= tenKappa &&
+      (rest + tenKappa < bigDistance ||
+       bigDistance - rest > rest + tenKappa - bigDistance)) {
+    return false;
+  }
+  return 2 * unit <= rest && rest <= unsafe - 4 * unit;
+}
+
+// Writes the digits of a number between the scaled boundaries, as few as
+// tell it apart from its neighbours, and adds their decimal exponent to `k`.
+// The boundaries are widened by the products' error, so the digits may
+// fall outside the real ones, which roundWeed() catches.
+// Returns the number of digits, or 0 if they can't be trusted.
+static int generateDigits(DiyFp lower, DiyFp w, DiyFp upper, char *digits,
+                          int *k) {
+  uint64_t unit = 1;
+  DiyFp tooLow = {lower.f - unit, lower.e};
+  DiyFp tooHigh = {upper.f + unit, upper.e};
+  uint64_t unsafe = tooHigh.f - tooLow.f;
+  DiyFp one = {1ULL << -w.e, w.e};
+  uint32_t integral = (uint32_t)(tooHigh.f >> -one.e);
+  uint64_t fractional = tooHigh.f & (one.f - 1);
+  int length = 0;
+
+  int kappa = 1;
+  while (kappa < 10 && integral >= powersOfTen[kappa]) {
+    kappa++;
+  }
+  while (kappa > 0) {
+    uint32_t digit = (uint32_t)(integral / powersOfTen[kappa - 1]);
+    integral %= (uint32_t)powersOfTen[kappa - 1];
+    digits[length++] = (char)('0' + digit);
+    kappa--;
+    uint64_t rest = ((uint64_t)integral << -one.e) + fractional;
+    if (rest < unsafe) {
+      *k += kappa;
+      return roundWeed(digits, length, tooHigh.f - w.f, unsafe, rest,
+                       powersOfTen[kappa] << -one.e, unit)
+                 ? length
+                 : 0;
+    }
+  }
+
+  for (;;) {
+    fractional *= 10;
+    unit *= 10;
+    unsafe *= 10;
+    digits[length++] = (char)('0' + (fractional >> -one.e));
+    fractional &= one.f - 1;
+    kappa--;
+    if (fractional < unsafe) {
+      *k += kappa;
+      return roundWeed(digits, length, (tooHigh.f - w.f) * unit, unsafe,
+                       fractional, one.f, unit)
+                 ? length
+                 : 0;
+    }
+  }
+}
+
+// Writes the digits of a positive, finite double, the value being
+// digits * 10^k. Returns the number of digits, 0 where Grisu3 can't tell
+// which digits are the shortest.
+static int grisu3(double value, char *digits, int *k) {
+  DiyFp v = fromDouble(value);
+  DiyFp minus;
+  DiyFp plus;
+  boundaries(v, &minus, &plus);
+
+  DiyFp power = cachedPower(plus.e, k);
+  DiyFp w = multiply(normalize(v), power);
+  DiyFp upper = multiply(plus, power);
+  DiyFp lower = multiply(minus, power);
+  return generateDigits(lower, w, upper, digits, k);
+}
+
+// Finds the digits the slow way, for the few doubles Grisu3 gives up on:
+// the correctly rounded digits of increasing precision, until they read
+// back as the same double. Starting at 15 is enough: 15 digit decimals are
+// further apart than doubles, so if shorter digits read back they are the
+// 15 rounded ones with trailing zeros.
+static int searchDigits(double value, char *digits, int *k) {
+  char text[DTOA_BUFFER_SIZE];
+  for (int precision = 15;; precision++) {
+    snprintf(text, sizeof(text), "%.*e", precision - 1, value);
+    if (precision == 17 || strtod(text, NULL) == value) {
+      break;
+    }
+  }
+
+  // The text is d.ddde[+-]x, possibly without the point.
+  int length = 0;
+  const char *c = text;
+  for (; *c != 'e'; c++) {
+    if (*c != '.') {
+      digits[length++] = *c;
+    }
+  }
+  int exponent = atoi(c + 1);
+  while (length > 1 && digits[length - 1] == '0') {
+    length--;
+  }
+  *k = exponent - (length - 1);
+  return length;
+}
+
+// Lays out digits * 10^k the way JavaScript does: plain notation for
+// decimal exponents from -7 to 20, scientific notation like 1e+21 beyond.
+static int layOut(char *out, const char *digits, int length, int k) {
+  // Position of the decimal point relative to the first digit.
+  int point = length + k;
+  int written = 0;
+
+  if (length <= point && point <= 21) {
+    // An integer, padded with zeros.
+    memcpy(out, digits, length);
+    memset(out + length, '0', point - length);
+    written = point;
+  } else if (0 < point && point <= 21) {
+    memcpy(out, digits, point);
+    out[point] = '.';
+    memcpy(out + point + 1, digits + point, length - point);
+    written = length + 1;
+  } else if (-6 < point && point <= 0) {
+    out[0] = '0';
+    out[1] = '.';
+    memset(out + 2, '0', -point);
+    memcpy(out + 2 - point, digits, length);
+    written = 2 - point + length;
+  } else {
+    out[written++] = digits[0];
+    if (length > 1) {
+      out[written++] = '.';
+      memcpy(out + written, digits + 1, length - 1);
+      written += length - 1;
+    }
+    int exponent = point - 1;
+    out[written++] = 'e';
+    out[written++] = exponent < 0 ? '-' : '+';
+    if (exponent < 0) {
+      exponent = -exponent;
+    }
+    if (exponent >= 100) {
+      out[written++] = (char)('0' + exponent / 100);
+    }
+    if (exponent >= 10) {
+      out[written++] = (char)('0' + exponent / 10 % 10);
+    }
+    out[written++] = (char)('0' + exponent % 10);
+  }
+  return written;
+}
+
+// Writes the shortest digits which read back as `value` to `buffer`, which
+// has room for DTOA_BUFFER_SIZE chars, and null terminates them.
+// Infinities and NaN come out as printf() writes them.
+// Returns the length written, the terminator excluded.
+int formatNumber(double value, char *buffer) {
+  uint64_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  char *out = buffer;
+  if (bits >> 63) {
+    *out++ = '-';
+  }
+
+  if (value != value) {
+    memcpy(out, "nan", 4);
+    return (int)(out - buffer) + 3;
+  }
+  if ((bits & ~(1ULL << 63)) == 0x7FF0000000000000ULL) {
+    memcpy(out, "inf", 4);
+    return (int)(out - buffer) + 3;
+  }
+  if ((bits & ~(1ULL << 63)) == 0) {
+    memcpy(out, "0", 2);
+    return (int)(out - buffer) + 1;
+  }
+
+  // A double needs 17 significant digits at most.
+  char digits[18];
+  int k = 0;
+  double magnitude = value < 0 ? -value : value;
+  int length = grisu3(magnitude, digits, &k);
+  if (length == 0) {
+    length = searchDigits(magnitude, digits, &k);
+  }
+  out += layOut(out, digits, length, k);
+  *out = '\0';
+  return (int)(out - buffer);
+}
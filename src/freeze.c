@@ -0,0 +1,120 @@
+#include <string.h>
+#include <sys/mman.h>
+
+#include "freeze.h"
+#include "object.h"
+
+// Every piece is aligned like malloc() would align it.
+#define FREEZE_ALIGNMENT 16
+
+// Lays chunks out in a block of memory. With `base` NULL nothing is copied,
+// it only adds up how big the block has to be.
+typedef struct Freezer {
+  uint8_t *base;
+  size_t used;
+} Freezer;
+
+// Reserves room for `size` bytes and copies `data` there.
+static void *place(Freezer *freezer, const void *data, size_t size) {
+  freezer->used = (freezer->used + FREEZE_ALIGNMENT - 1) &
+                  ~(size_t)(FREEZE_ALIGNMENT - 1);
+  void *at = NULL;
+  if (freezer->base != NULL) {
+    at = freezer->base + freezer->used;
+    if (size > 0) {
+      memcpy(at, data, size);
+    }
+  }
+  freezer->used += size;
+  return at;
+}
+
+// Copies a chunk's code, lines and constants. Strings are copied too, each
+// constant gets its own copy as strings aren't interned.
+static void freezeChunk(Freezer *freezer, Chunk *to, const Chunk *from) {
+  Chunk chunk;
+  initChunk(&chunk);
+  chunk.count = from->count;
+  chunk.capacity = from->count;
+  chunk.code = (uint8_t *)place(freezer, from->code, from->count);
+  chunk.lines =
+      (int *)place(freezer, from->lines, sizeof(int) * from->count);
+  chunk.constants.count = from->constants.count;
+  chunk.constants.capacity = from->constants.count;
+  chunk.constants.values =
+      (Value *)place(freezer, from->constants.values,
+                     sizeof(Value) * from->constants.count);
+  chunk.inputCount = from->inputCount;
+  chunk.fuelCost = from->fuelCost;
+  chunk.frozen = true;
+
+  for (int i = 0; i < from->constants.count; i++) {
+    Value value = from->constants.values[i];
+    if (!IS_STRING(value)) {
+      continue;
+    }
+    ObjString *string = AS_STRING(value);
+    ObjString *copy =
+        (ObjString *)place(freezer, string, sizeof(ObjString));
+    char *chars = (char *)place(freezer, string->chars, string->length + 1);
+    if (copy != NULL) {
+      copy->chars = chars;
+      chunk.constants.values[i] = OBJ_VAL(copy);
+    }
+  }
+
+  if (to != NULL) {
+    *to = chunk;
+  }
+}
+
+static void layOut(Freezer *freezer, const Chunk *chunks, int count) {
+  Chunk *frozen = (Chunk *)place(freezer, chunks, sizeof(Chunk) * count);
+  for (int i = 0; i < count; i++) {
+    freezeChunk(freezer, frozen != NULL ? &frozen[i] : NULL, &chunks[i]);
+  }
+}
+
+void initFrozenChunks(FrozenChunks *frozen) {
+  frozen->chunks = NULL;
+  frozen->count = 0;
+  frozen->memory = NULL;
+  frozen->size = 0;
+}
+
+// Copies `chunks` into a new read-only mapping. The originals, and the
+// strings they refer to, are left as they were for the caller to free.
+// Frozen chunks must only be freed with freeFrozenChunks(), never
+// freeChunk().
+bool freezeChunks(FrozenChunks *frozen, const Chunk *chunks, int count) {
+  initFrozenChunks(frozen);
+  Freezer freezer = {NULL, 0};
+  layOut(&freezer, chunks, count);
+  if (freezer.used == 0) {
+    return true;
+  }
+
+  void *memory = mmap(NULL, freezer.used, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (memory == MAP_FAILED) {
+    return false;
+  }
+  freezer.base = (uint8_t *)memory;
+  freezer.used = 0;
+  layOut(&freezer, chunks, count);
+  // A stray write now faults rather than quietly copying the page.
+  mprotect(memory, freezer.used, PROT_READ);
+
+  frozen->chunks = (Chunk *)memory;
+  frozen->count = count;
+  frozen->memory = memory;
+  frozen->size = freezer.used;
+  return true;
+}
+
+void freeFrozenChunks(FrozenChunks *frozen) {
+  if (frozen->memory != NULL) {
+    munmap(frozen->memory, frozen->size);
+  }
+  initFrozenChunks(frozen);
+}
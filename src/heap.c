@@ -0,0 +1,59 @@
+#include "heap.h"
+#include "memory.h"
+
+// Starts a new current page for a size class.
+static HeapPage *addPage(Heap *heap, int sizeClass) {
+  int slotSize = (sizeClass + 1) * HEAP_GRANULE;
+  HeapPage *page = (HeapPage *)reallocate(NULL, 0, HEAP_PAGE_SIZE);
+  page->next = heap->pages[sizeClass];
+  heap->pages[sizeClass] = page;
+  page->slotSize = slotSize;
+  page->slotCount = (int)((HEAP_PAGE_SIZE - sizeof(HeapPage)) / slotSize);
+  page->count = 0;
+  return page;
+}
+
+void initHeap(Heap *heap) {
+  for (int i = 0; i < HEAP_SIZE_CLASSES; i++) {
+    heap->pages[i] = NULL;
+  }
+}
+
+// Returns an uninitialized slot of at least `size` bytes, which must be at
+// most HEAP_MAX_OBJECT. Bumps through the size class's current page,
+// starting a new page once that is full.
+void *allocateFromHeap(Heap *heap, size_t size) {
+  int sizeClass = (int)((size + HEAP_GRANULE - 1) / HEAP_GRANULE) - 1;
+  HeapPage *page = heap->pages[sizeClass];
+  if (page == NULL || page->count == page->slotCount) {
+    page = addPage(heap, sizeClass);
+  }
+
+  int slot = page->count++;
+  return page->slots + (size_t)slot * page->slotSize;
+}
+
+// Calls `visit` with every object in the heap, page by page.
+void walkHeap(Heap *heap, HeapVisitor visit) {
+  for (int i = 0; i < HEAP_SIZE_CLASSES; i++) {
+    for (HeapPage *page = heap->pages[i]; page != NULL; page = page->next) {
+      for (int slot = 0; slot < page->count; slot++) {
+        visit((Obj *)(page->slots + (size_t)slot * page->slotSize));
+      }
+    }
+  }
+}
+
+// Frees every object in the heap and its pages, leaving the heap empty.
+void freeHeap(Heap *heap) {
+  walkHeap(heap, freeObject);
+  for (int i = 0; i < HEAP_SIZE_CLASSES; i++) {
+    HeapPage *page = heap->pages[i];
+    while (page != NULL) {
+      HeapPage *next = page->next;
+      reallocate(page, HEAP_PAGE_SIZE, 0);
+      page = next;
+    }
+  }
+  initHeap(heap);
+}
@@ -0,0 +1,205 @@
+#include "ir.h"
+#include "memory.h"
+#include "object.h"
+
+// Bytes of nodes allocated at a time.
+#define IR_BLOCK_SIZE (16 * 1024)
+
+// A pending node of rewriteIr() and how far along its operands are.
+typedef struct IrFrame {
+  IrNode *node;
+  // 0 before the left operand, 1 while it is rewritten, 2 while the right
+  // one is.
+  int state;
+} IrFrame;
+
+void initIr(Ir *ir) {
+  ir->blocks = NULL;
+  ir->root = NULL;
+  ir->hoisted = NULL;
+  ir->hoistedCount = 0;
+  ir->fallibleCount = 0;
+  ir->lowerings = 0;
+}
+
+// Frees the arena and with it every node.
+void freeIr(Ir *ir) {
+  IrBlock *block = ir->blocks;
+  while (block != NULL) {
+    IrBlock *next = block->next;
+    reallocate(block, sizeof(IrBlock) + block->size, 0);
+    block = next;
+  }
+  initIr(ir);
+}
+
+// Carves `size` bytes out of the arena.
+void *allocateIr(Ir *ir, size_t size) {
+  size = (size + sizeof(double) - 1) & ~(sizeof(double) - 1);
+  IrBlock *block = ir->blocks;
+  if (block == NULL || block->used + size > block->size) {
+    size_t blockSize = size > IR_BLOCK_SIZE ? size : IR_BLOCK_SIZE;
+    block = (IrBlock *)reallocate(NULL, 0, sizeof(IrBlock) + blockSize);
+    block->next = ir->blocks;
+    block->size = blockSize;
+    block->used = 0;
+    ir->blocks = block;
+  }
+  void *memory = (char *)block->data + block->used;
+  block->used += size;
+  return memory;
+}
+
+static IrNode *newNode(Ir *ir, IrOp op, IrNode *left, IrNode *right,
+                       int line) {
+  IrNode *node = (IrNode *)allocateIr(ir, sizeof(IrNode));
+  node->op = op;
+  node->line = line;
+  node->left = left;
+  node->right = right;
+  node->value = NIL_VAL;
+  node->slot = 0;
+  node->id = -1;
+  node->uses = 0;
+  node->size = 1;
+  node->hoisted = -1;
+  node->reached = -1;
+  node->constant = -1;
+  node->mark = 0;
+  node->chained = 0;
+  return node;
+}
+
+IrNode *newConstant(Ir *ir, Value value, int line) {
+  IrNode *node = newNode(ir, IR_CONSTANT, NULL, NULL, line);
+  node->value = value;
+  typeNode(node);
+  return node;
+}
+
+IrNode *newInput(Ir *ir, int slot, int line) {
+  IrNode *node = newNode(ir, IR_INPUT, NULL, NULL, line);
+  node->slot = slot;
+  typeNode(node);
+  return node;
+}
+
+IrNode *newUnary(Ir *ir, IrOp op, IrNode *operand, int line) {
+  IrNode *node = newNode(ir, op, operand, NULL, line);
+  typeNode(node);
+  return node;
+}
+
+IrNode *newBinary(Ir *ir, IrOp op, IrNode *left, IrNode *right, int line) {
+  IrNode *node = newNode(ir, op, left, right, line);
+  typeNode(node);
+  return node;
+}
+
+// Works out a node's result type and whether it can fail from its operands'
+// types. Passes which change a node's operands call it again.
+void typeNode(IrNode *node) {
+  IrType left = node->left != NULL ? node->left->type : IR_UNKNOWN;
+  IrType right = node->right != NULL ? node->right->type : IR_UNKNOWN;
+  bool numbers = left == IR_NUMBER && right == IR_NUMBER;
+  node->fallible = false;
+
+  switch (node->op) {
+  case IR_CONSTANT:
+    switch (node->value.type) {
+    case VAL_BOOL:
+      node->type = IR_BOOL;
+      break;
+    case VAL_NIL:
+      node->type = IR_NIL;
+      break;
+    case VAL_NUMBER:
+      node->type = IR_NUMBER;
+      break;
+    default:
+      node->type = IS_STRING(node->value) ? IR_STRING : IR_UNKNOWN;
+      break;
+    }
+    break;
+  case IR_INPUT:
+    node->type = IR_UNKNOWN;
+    break;
+  case IR_NOT:
+  case IR_EQUAL:
+    node->type = IR_BOOL;
+    break;
+  case IR_GREATER:
+  case IR_LESS:
+    node->type = IR_BOOL;
+    node->fallible = !numbers;
+    break;
+  case IR_ADD:
+    if (numbers) {
+      node->type = IR_NUMBER;
+    } else if (left == IR_STRING && right == IR_STRING) {
+      node->type = IR_STRING;
+    } else {
+      node->type = IR_UNKNOWN;
+      node->fallible = true;
+    }
+    break;
+  case IR_SUBTRACT:
+  case IR_MULTIPLY:
+  case IR_DIVIDE:
+    node->type = IR_NUMBER;
+    node->fallible = !numbers;
+    break;
+  case IR_NEGATE:
+    node->type = IR_NUMBER;
+    node->fallible = left != IR_NUMBER;
+    break;
+  }
+}
+
+// Rewrites the tree below `root` bottom up, operands before the node using
+// them, and returns the rewritten root. Walks with an explicit stack, as a
+// chain of N binary operators nests N deep.
+// Nodes shared by several parents are rewritten once per parent.
+IrNode *rewriteIr(Ir *ir, IrNode *root, IrRewriteFn rewrite, void *context) {
+  int capacity = 64;
+  int count = 0;
+  IrFrame *frames = ALLOCATE(IrFrame, capacity);
+  frames[count++] = (IrFrame){root, 0};
+  IrNode *result = NULL;
+
+  while (count > 0) {
+    IrFrame *frame = &frames[count - 1];
+    IrNode *next = NULL;
+    if (frame->state == 0) {
+      frame->state = 1;
+      next = frame->node->left;
+    } else if (frame->state == 1) {
+      frame->state = 2;
+      next = frame->node->right;
+    } else {
+      result = rewrite(ir, frame->node, context);
+      count--;
+      if (count > 0) {
+        IrFrame *parent = &frames[count - 1];
+        if (parent->state == 1) {
+          parent->node->left = result;
+        } else {
+          parent->node->right = result;
+        }
+      }
+      continue;
+    }
+
+    if (next != NULL) {
+      if (count == capacity) {
+        int oldCapacity = capacity;
+        capacity = GROW_CAPACITY(oldCapacity);
+        frames = GROW_ARRAY(IrFrame, frames, oldCapacity, capacity);
+      }
+      frames[count++] = (IrFrame){next, 0};
+    }
+  }
+
+  FREE_ARRAY(IrFrame, frames, capacity);
+  return result;
+}
@@ -0,0 +1,458 @@
+#include "jit.h"
+
+#ifdef JIT_SUPPORTED
+
+#include <string.h>
+#include <sys/mman.h>
+
+#include "memory.h"
+#include "vm.h"
+
+// A copy-and-patch compiler. Every supported opcode has a fixed x86-64
+// machine code template which is copied into the output, with constants and
+// bytecode offsets patched into its immediates. The generated function has
+// the signature of NativeFn and keeps the VM's stack pointer in rdi:
+//
+//   rdi  pointer one past the top Value on vm.stack
+//   rsi  where rdi is stored on exit
+//   eax  bytecode offset the interpreter resumes from on exit
+//
+// Values are 16 bytes, the type tag at +0 and the payload at +8, so the top
+// value's tag is at [rdi-16] and its payload at [rdi-8].
+//
+// Instructions whose operands don't have the types a template handles, and
+// any opcode without a template, exit the native code with the stack exactly
+// as the interpreter would have it at that instruction. The interpreter then
+// carries on from there, so native code never has to handle errors, strings
+// or printing.
+typedef int (*NativeFn)(Value *stackTop, Value **stackTopOut);
+
+// Byte buffer the templates are copied into.
+typedef struct Assembler {
+  int count;
+  int capacity;
+  uint8_t *code;
+} Assembler;
+
+// x86 opcodes of the short jumps used inside templates.
+#define JMP8 0xEB
+#define JE8 0x74
+#define JNE8 0x75
+
+// Size of the shared exit sequence at the start of the code.
+#define EPILOGUE_SIZE 4
+
+// Most forward jumps a template needs to its exit stub.
+#define MAX_EXITS 4
+
+static void emit(Assembler *as, const uint8_t *bytes, int length) {
+  while (as->capacity < as->count + length) {
+    int oldCapacity = as->capacity;
+    as->capacity = GROW_CAPACITY(oldCapacity);
+    as->code = GROW_ARRAY(uint8_t, as->code, oldCapacity, as->capacity);
+  }
+  memcpy(as->code + as->count, bytes, length);
+  as->count += length;
+}
+
+static void emit8(Assembler *as, uint8_t byte) { emit(as, &byte, 1); }
+
+static void emit32(Assembler *as, uint32_t value) {
+  emit(as, (const uint8_t *)&value, 4);
+}
+
+static void emit64(Assembler *as, uint64_t value) {
+  emit(as, (const uint8_t *)&value, 8);
+}
+
+// Emits a short jump with a placeholder displacement.
+// Returns the position of the displacement for patchJump().
+static int emitJump(Assembler *as, uint8_t opcode) {
+  emit8(as, opcode);
+  emit8(as, 0);
+  return as->count - 1;
+}
+
+// Points a short jump emitted by emitJump() at the current position.
+static void patchJump(Assembler *as, int at) {
+  as->code[at] = (uint8_t)(as->count - (at + 1));
+}
+
+// Leaves native code, telling the interpreter to resume at `offset`.
+static void emitExit(Assembler *as, int offset) {
+  emit8(as, 0xB8); // mov eax, imm32
+  emit32(as, (uint32_t)offset);
+  emit8(as, 0xE9); // jmp rel32 to the epilogue at the start of the code
+  emit32(as, (uint32_t)(0 - (as->count + 4)));
+}
+
+// Finishes a template: jumps over its exit stub on success, and lands every
+// failed guard in `exits` in a stub which resumes at `offset`.
+static void endTemplate(Assembler *as, int *exits, int exitCount, int offset) {
+  int done = emitJump(as, JMP8);
+  for (int i = 0; i < exitCount; i++) {
+    patchJump(as, exits[i]);
+  }
+  emitExit(as, offset);
+  patchJump(as, done);
+}
+
+// cmp dword [rdi+displacement], type ; jne exit
+static int emitTypeGuard(Assembler *as, int8_t displacement, ValueType type) {
+  const uint8_t cmp[] = {0x83, 0x7F, (uint8_t)displacement, (uint8_t)type};
+  emit(as, cmp, sizeof(cmp));
+  return emitJump(as, JNE8);
+}
+
+// Pushes a constant value with the given tag and raw payload bits.
+static void emitPush(Assembler *as, ValueType type, uint64_t bits) {
+  const uint8_t movRax[] = {0x48, 0xB8};       // mov rax, imm64
+  const uint8_t movTag[] = {0xC7, 0x07};       // mov dword [rdi], imm32
+  const uint8_t store[] = {0x48, 0x89, 0x47, 0x08, // mov [rdi+8], rax
+                           0x48, 0x83, 0xC7, 0x10}; // add rdi, 16
+  emit(as, movRax, sizeof(movRax));
+  emit64(as, bits);
+  emit(as, movTag, sizeof(movTag));
+  emit32(as, (uint32_t)type);
+  emit(as, store, sizeof(store));
+}
+
+// Pushes a constant from the chunk's constant table.
+static void emitConstant(Assembler *as, Value value) {
+  uint64_t bits = 0;
+  switch (value.type) {
+  case VAL_BOOL:
+    bits = AS_BOOL(value) ? 1 : 0;
+    break;
+  case VAL_NIL:
+    break;
+  case VAL_NUMBER:
+    memcpy(&bits, &value.as.number, sizeof(bits));
+    break;
+  case VAL_OBJ:
+    bits = (uint64_t)(uintptr_t)AS_OBJ(value);
+    break;
+  }
+  emitPush(as, value.type, bits);
+}
+
+// Pushes the value of an input. The inputs pointer is read from the VM on
+// every use, so the same code serves every set of inputs.
+static void emitGetInput(Assembler *as, uint8_t slot) {
+  const uint8_t loadInputs[] = {0x48, 0xA1}; // mov rax, [imm64]
+  const uint8_t loadValue[] = {0x0F, 0x10, 0x80}; // movups xmm0, [rax+imm32]
+  const uint8_t store[] = {0x0F, 0x11, 0x07,       // movups [rdi], xmm0
+                           0x48, 0x83, 0xC7, 0x10}; // add rdi, 16
+  emit(as, loadInputs, sizeof(loadInputs));
+  emit64(as, (uint64_t)(uintptr_t)&vm.inputs);
+  emit(as, loadValue, sizeof(loadValue));
+  emit32(as, (uint32_t)slot * sizeof(Value));
+  emit(as, store, sizeof(store));
+}
+
+// Pushes a copy of the value `distance` slots below the top.
+static void emitPick(Assembler *as, uint8_t distance) {
+  const uint8_t loadValue[] = {0x0F, 0x10, 0x87}; // movups xmm0, [rdi+imm32]
+  const uint8_t store[] = {0x0F, 0x11, 0x07,       // movups [rdi], xmm0
+                           0x48, 0x83, 0xC7, 0x10}; // add rdi, 16
+  emit(as, loadValue, sizeof(loadValue));
+  emit32(as, (uint32_t)(-(int32_t)sizeof(Value) * (distance + 1)));
+  emit(as, store, sizeof(store));
+}
+
+// Stores the boolean in eax as the result replacing the two operands.
+static void emitStoreBinaryBool(Assembler *as) {
+  const uint8_t store[] = {
+      0x0F, 0xB6, 0xC0,                         // movzx eax, al
+      0xC7, 0x47, 0xE0, VAL_BOOL, 0, 0, 0,      // mov dword [rdi-32], VAL_BOOL
+      0x48, 0x89, 0x47, 0xE8,                   // mov [rdi-24], rax
+      0x48, 0x83, 0xEF, 0x10,                   // sub rdi, 16
+  };
+  emit(as, store, sizeof(store));
+}
+
+// Arithmetic on two numbers. `sseOp` is the second opcode byte of the
+// scalar double instruction: addsd, subsd, mulsd or divsd.
+static void emitArithmetic(Assembler *as, uint8_t sseOp, int offset) {
+  int exits[MAX_EXITS];
+  exits[0] = emitTypeGuard(as, -16, VAL_NUMBER);
+  exits[1] = emitTypeGuard(as, -32, VAL_NUMBER);
+  const uint8_t body[] = {
+      0xF2, 0x0F, 0x10, 0x47, 0xE8, // movsd xmm0, [rdi-24]
+      0xF2, 0x0F, sseOp, 0x47, 0xF8, // op xmm0, [rdi-8]
+      0xF2, 0x0F, 0x11, 0x47, 0xE8, // movsd [rdi-24], xmm0
+      0x48, 0x83, 0xEF, 0x10,       // sub rdi, 16
+  };
+  emit(as, body, sizeof(body));
+  endTemplate(as, exits, 2, offset);
+}
+
+// a < b or a > b on two numbers. NaN operands compare false, as in C.
+static void emitComparison(Assembler *as, bool less, int offset) {
+  int exits[MAX_EXITS];
+  exits[0] = emitTypeGuard(as, -16, VAL_NUMBER);
+  exits[1] = emitTypeGuard(as, -32, VAL_NUMBER);
+  // a > b is computed as seta after comparing a with b, a < b as b > a.
+  uint8_t first = less ? 0xF8 : 0xE8;
+  uint8_t second = less ? 0xE8 : 0xF8;
+  const uint8_t body[] = {
+      0xF2, 0x0F, 0x10, 0x47, first,  // movsd xmm0, [first]
+      0x66, 0x0F, 0x2E, 0x47, second, // ucomisd xmm0, [second]
+      0x0F, 0x97, 0xC0,               // seta al
+  };
+  emit(as, body, sizeof(body));
+  emitStoreBinaryBool(as);
+  endTemplate(as, exits, 2, offset);
+}
+
+// Equality of two numbers, booleans or nils. Values of different types are
+// never equal. Strings are left to the interpreter's valuesEqual().
+static void emitEqual(Assembler *as, int offset) {
+  int exits[MAX_EXITS];
+  const uint8_t loadTypes[] = {
+      0x8B, 0x47, 0xE0, // mov eax, [rdi-32]
+      0x3B, 0x47, 0xF0, // cmp eax, [rdi-16]
+  };
+  emit(as, loadTypes, sizeof(loadTypes));
+  int differentTypes = emitJump(as, JNE8);
+  const uint8_t isNumber[] = {0x83, 0xF8, VAL_NUMBER}; // cmp eax, VAL_NUMBER
+  emit(as, isNumber, sizeof(isNumber));
+  int numbers = emitJump(as, JE8);
+  const uint8_t isObj[] = {0x83, 0xF8, VAL_OBJ}; // cmp eax, VAL_OBJ
+  emit(as, isObj, sizeof(isObj));
+  exits[0] = emitJump(as, JE8);
+
+  // Booleans and nil, nil's payload is always zero.
+  const uint8_t payloads[] = {
+      0x0F, 0xB6, 0x47, 0xE8, // movzx eax, byte [rdi-24]
+      0x3A, 0x47, 0xF8,       // cmp al, [rdi-8]
+      0x0F, 0x94, 0xC0,       // sete al
+  };
+  emit(as, payloads, sizeof(payloads));
+  int storeAfterPayloads = emitJump(as, JMP8);
+
+  patchJump(as, numbers);
+  const uint8_t compareNumbers[] = {
+      0xF2, 0x0F, 0x10, 0x47, 0xE8, // movsd xmm0, [rdi-24]
+      0x66, 0x0F, 0x2E, 0x47, 0xF8, // ucomisd xmm0, [rdi-8]
+      0x0F, 0x94, 0xC0,             // sete al
+      0x0F, 0x9B, 0xC1,             // setnp cl, unordered is never equal
+      0x20, 0xC8,                   // and al, cl
+  };
+  emit(as, compareNumbers, sizeof(compareNumbers));
+  int storeAfterNumbers = emitJump(as, JMP8);
+
+  patchJump(as, differentTypes);
+  const uint8_t notEqual[] = {0x31, 0xC0}; // xor eax, eax
+  emit(as, notEqual, sizeof(notEqual));
+
+  patchJump(as, storeAfterPayloads);
+  patchJump(as, storeAfterNumbers);
+  emitStoreBinaryBool(as);
+  endTemplate(as, exits, 1, offset);
+}
+
+// Logical not, true for nil and false and false for everything else.
+static void emitNot(Assembler *as) {
+  const uint8_t loadType[] = {
+      0x8B, 0x47, 0xF0,   // mov eax, [rdi-16]
+      0x83, 0xF8, VAL_NIL, // cmp eax, VAL_NIL
+  };
+  emit(as, loadType, sizeof(loadType));
+  int nil = emitJump(as, JE8);
+  const uint8_t isBool[] = {0x83, 0xF8, VAL_BOOL}; // cmp eax, VAL_BOOL
+  emit(as, isBool, sizeof(isBool));
+  int truthy = emitJump(as, JNE8);
+  const uint8_t isFalse[] = {0x80, 0x7F, 0xF8, 0x00}; // cmp byte [rdi-8], 0
+  emit(as, isFalse, sizeof(isFalse));
+  int falsey = emitJump(as, JE8);
+
+  patchJump(as, truthy);
+  const uint8_t resultFalse[] = {0x31, 0xC0}; // xor eax, eax
+  emit(as, resultFalse, sizeof(resultFalse));
+  int store = emitJump(as, JMP8);
+
+  patchJump(as, nil);
+  patchJump(as, falsey);
+  const uint8_t resultTrue[] = {0xB8, 1, 0, 0, 0}; // mov eax, 1
+  emit(as, resultTrue, sizeof(resultTrue));
+
+  patchJump(as, store);
+  const uint8_t storeBool[] = {
+      0xC7, 0x47, 0xF0, VAL_BOOL, 0, 0, 0, // mov dword [rdi-16], VAL_BOOL
+      0x48, 0x89, 0x47, 0xF8,              // mov [rdi-8], rax
+  };
+  emit(as, storeBool, sizeof(storeBool));
+}
+
+// Negates a number by flipping its sign bit in place.
+static void emitNegate(Assembler *as, int offset) {
+  int exits[MAX_EXITS];
+  exits[0] = emitTypeGuard(as, -16, VAL_NUMBER);
+  const uint8_t body[] = {0x48, 0x0F, 0xBA, 0x7F, 0xF8, 0x3F}; // btc [rdi-8], 63
+  emit(as, body, sizeof(body));
+  endTemplate(as, exits, 1, offset);
+}
+
+// Emits the template for the instruction at `offset`.
+// Returns false for instructions native code leaves to the interpreter.
+static bool emitInstruction(Assembler *as, Chunk *chunk, int offset) {
+  switch (chunk->code[offset]) {
+  case OP_CONSTANT:
+    emitConstant(as, chunk->constants.values[chunk->code[offset + 1]]);
+    return true;
+  case OP_NIL:
+    emitPush(as, VAL_NIL, 0);
+    return true;
+  case OP_TRUE:
+    emitPush(as, VAL_BOOL, 1);
+    return true;
+  case OP_FALSE:
+    emitPush(as, VAL_BOOL, 0);
+    return true;
+  case OP_ZERO:
+    emitConstant(as, NUMBER_VAL(0));
+    return true;
+  case OP_ONE:
+    emitConstant(as, NUMBER_VAL(1));
+    return true;
+  case OP_SMALL_INT:
+    emitConstant(as, NUMBER_VAL((int8_t)chunk->code[offset + 1]));
+    return true;
+  case OP_SHORT_INT:
+    emitConstant(as, NUMBER_VAL(readShortInt(&chunk->code[offset + 1])));
+    return true;
+  case OP_GET_INPUT:
+    emitGetInput(as, chunk->code[offset + 1]);
+    return true;
+  case OP_DUP:
+    emitPick(as, 0);
+    return true;
+  case OP_PICK:
+    emitPick(as, chunk->code[offset + 1]);
+    return true;
+  case OP_EQUAL:
+    emitEqual(as, offset);
+    return true;
+  case OP_GREATER:
+  case OP_GREATER_NUM:
+    emitComparison(as, false, offset);
+    return true;
+  case OP_LESS:
+  case OP_LESS_NUM:
+    emitComparison(as, true, offset);
+    return true;
+  // A generic OP_ADD may still see strings, its guard then hands it back.
+  case OP_ADD:
+  case OP_ADD_NUM:
+    emitArithmetic(as, 0x58, offset);
+    return true;
+  case OP_SUBTRACT:
+  case OP_SUBTRACT_NUM:
+    emitArithmetic(as, 0x5C, offset);
+    return true;
+  case OP_MULTIPLY:
+  case OP_MULTIPLY_NUM:
+    emitArithmetic(as, 0x59, offset);
+    return true;
+  case OP_DIVIDE:
+  case OP_DIVIDE_NUM:
+    emitArithmetic(as, 0x5E, offset);
+    return true;
+  case OP_NOT:
+    emitNot(as);
+    return true;
+  case OP_NEGATE:
+    emitNegate(as, offset);
+    return true;
+  default:
+    return false;
+  }
+}
+
+// Compiles the longest prefix of the chunk made of supported instructions
+// into native code attached to the chunk.
+// Returns false if there was nothing worth compiling or mapping failed.
+bool compileJit(Chunk *chunk) {
+  if (chunk->jitCode != NULL) {
+    return true;
+  }
+
+  Assembler as = {0, 0, NULL};
+  // Shared epilogue, every exit jumps back here.
+  const uint8_t epilogue[EPILOGUE_SIZE] = {
+      0x48, 0x89, 0x3E, // mov [rsi], rdi
+      0xC3,             // ret
+  };
+  emit(&as, epilogue, sizeof(epilogue));
+
+  int offset = 0;
+  while (offset < chunk->count && emitInstruction(&as, chunk, offset)) {
+    offset += instructionLength(chunk->code[offset]);
+  }
+  emitExit(&as, offset);
+
+  if (offset == 0) {
+    FREE_ARRAY(uint8_t, as.code, as.capacity);
+    return false;
+  }
+
+  // Write the code while the mapping is writable, then make it executable
+  // and read-only.
+  size_t size = (size_t)as.count;
+  void *memory = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (memory == MAP_FAILED) {
+    FREE_ARRAY(uint8_t, as.code, as.capacity);
+    return false;
+  }
+  memcpy(memory, as.code, size);
+  FREE_ARRAY(uint8_t, as.code, as.capacity);
+  if (mprotect(memory, size, PROT_READ | PROT_EXEC) != 0) {
+    munmap(memory, size);
+    return false;
+  }
+
+  chunk->jitCode = memory;
+  chunk->jitSize = size;
+  return true;
+}
+
+// Runs the chunk's native code on an empty stack.
+// Returns the bytecode offset the interpreter has to continue from, with
+// vm.stackTop set to the values the native code left on the stack.
+int runJit(Chunk *chunk) {
+  // Same layout as the interpreter's: slot 0 holds the sentinel the dispatch
+  // loop caches as top while the stack is empty.
+  vm.stack[0] = NIL_VAL;
+  NativeFn native = (NativeFn)((uint8_t *)chunk->jitCode + EPILOGUE_SIZE);
+  return native(vm.stack + 1, &vm.stackTop);
+}
+
+// Unmaps the chunk's native code, if any.
+void freeJit(Chunk *chunk) {
+  if (chunk->jitCode != NULL) {
+    munmap(chunk->jitCode, chunk->jitSize);
+  }
+  chunk->jitCode = NULL;
+  chunk->jitSize = 0;
+}
+
+#else
+
+bool compileJit(Chunk *chunk) {
+  (void)chunk;
+  return false;
+}
+
+int runJit(Chunk *chunk) {
+  (void)chunk;
+  return 0;
+}
+
+void freeJit(Chunk *chunk) {
+  chunk->jitCode = NULL;
+  chunk->jitSize = 0;
+}
+
+#endif
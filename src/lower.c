@@ -0,0 +1,330 @@
+#include "lower.h"
+#include "memory.h"
+#include "vm.h"
+
+// Lowers the IR to stack bytecode. The hoisted nodes are computed first and
+// stay in the bottom stack slots, every use of one copies it from there with
+// OP_DUP or OP_PICK. Everything else is emitted in post order, so a node
+// shared without being hoisted is simply computed again at each use. The
+// exception are chains of additions involving strings, `a + b + c`, whose
+// operands are all pushed before one OP_CONCAT adds them up.
+
+// A pending node and how far along its operands are.
+typedef struct LowerFrame {
+  IrNode *node;
+  // 0 before the left operand, 1 after it, 2 after the right one. For a
+  // chain, the number of operands pushed so far.
+  int state;
+  // Operands of the chain the node ends, 0 if it isn't lowered as one, and
+  // where its additions start in Lowering.chain.
+  int operands;
+  int first;
+} LowerFrame;
+
+typedef struct Lowering {
+  Ir *ir;
+  // Where code goes, NULL when only checking.
+  Chunk *chunk;
+  LowerFrame *frames;
+  int frameCount;
+  int frameCapacity;
+  // Additions of the chains being lowered, each from the bottom one up.
+  IrNode **chain;
+  int chainCount;
+  int chainCapacity;
+  int depth;
+  int maxDepth;
+  // Hoisted nodes already sitting in their slots.
+  int ready;
+  // Fallible nodes emitted so far, and the id of the last one.
+  int fallibles;
+  int lastFallible;
+  bool ok;
+} Lowering;
+
+static const uint8_t opcodes[] = {
+    [IR_INPUT] = OP_GET_INPUT,   [IR_NOT] = OP_NOT,
+    [IR_NEGATE] = OP_NEGATE,     [IR_EQUAL] = OP_EQUAL,
+    [IR_GREATER] = OP_GREATER,   [IR_LESS] = OP_LESS,
+    [IR_ADD] = OP_ADD,           [IR_SUBTRACT] = OP_SUBTRACT,
+    [IR_MULTIPLY] = OP_MULTIPLY, [IR_DIVIDE] = OP_DIVIDE,
+};
+
+static void emitByte(Lowering *lowering, uint8_t byte, int line) {
+  if (lowering->chunk != NULL) {
+    writeChunk(lowering->chunk, byte, line);
+  }
+}
+
+static void pushed(Lowering *lowering) {
+  lowering->depth++;
+  if (lowering->depth > lowering->maxDepth) {
+    lowering->maxDepth = lowering->depth;
+  }
+}
+
+// Copies a hoisted node's value from its slot to the top of the stack.
+static void emitCopy(Lowering *lowering, IrNode *node) {
+  int distance = lowering->depth - 1 - node->hoisted;
+  if (distance > UINT8_MAX) {
+    lowering->ok = false;
+  } else if (distance == 0) {
+    emitByte(lowering, OP_DUP, node->line);
+  } else {
+    emitByte(lowering, OP_PICK, node->line);
+    emitByte(lowering, (uint8_t)distance, node->line);
+  }
+  pushed(lowering);
+}
+
+// Emits a small integer as an immediate operand, sparing the constants
+// table an entry and the VM a load from it.
+static void emitSmallInteger(Lowering *lowering, int number, int line) {
+  if (number == 0) {
+    emitByte(lowering, OP_ZERO, line);
+  } else if (number == 1) {
+    emitByte(lowering, OP_ONE, line);
+  } else if (number >= INT8_MIN && number <= INT8_MAX) {
+    emitByte(lowering, OP_SMALL_INT, line);
+    emitByte(lowering, (uint8_t)(int8_t)number, line);
+  } else {
+    emitByte(lowering, OP_SHORT_INT, line);
+    emitByte(lowering, (uint8_t)((uint16_t)number >> 8), line);
+    emitByte(lowering, (uint8_t)number, line);
+  }
+}
+
+static void emitConstant(Lowering *lowering, IrNode *node) {
+  Value value = node->value;
+  if (IS_NIL(value)) {
+    emitByte(lowering, OP_NIL, node->line);
+  } else if (IS_BOOL(value)) {
+    emitByte(lowering, AS_BOOL(value) ? OP_TRUE : OP_FALSE, node->line);
+  } else if (IS_NUMBER(value) && isSmallInteger(AS_NUMBER(value))) {
+    emitSmallInteger(lowering, (int)AS_NUMBER(value), node->line);
+  } else if (lowering->chunk != NULL) {
+    // A node used in several places shares its constant table entry.
+    if (node->constant < 0) {
+      node->constant = addConstant(lowering->chunk, value);
+    }
+    if (node->constant > UINT8_MAX) {
+      lowering->ok = false;
+    }
+    emitByte(lowering, OP_CONSTANT, node->line);
+    emitByte(lowering, (uint8_t)node->constant, node->line);
+  }
+}
+
+// Tracks the order errors are raised in. Nodes are numbered in the order the
+// unoptimized code first evaluates them, so that raises errors in increasing
+// id order.
+static void emitted(Lowering *lowering, IrNode *node) {
+  if (node->fallible && node->mark != lowering->ir->lowerings) {
+    node->mark = lowering->ir->lowerings;
+    if (node->id < lowering->lastFallible) {
+      lowering->ok = false;
+    }
+    lowering->lastFallible = node->id;
+    lowering->fallibles++;
+  }
+}
+
+// Emits a node's instruction, its operands being on the stack already.
+static void emitOperation(Lowering *lowering, IrNode *node) {
+  if (node->op == IR_CONSTANT) {
+    emitConstant(lowering, node);
+  } else {
+    emitByte(lowering, opcodes[node->op], node->line);
+    if (node->op == IR_INPUT) {
+      emitByte(lowering, (uint8_t)node->slot, node->line);
+    }
+  }
+  lowering->depth -= (node->left != NULL) + (node->right != NULL);
+  pushed(lowering);
+  emitted(lowering, node);
+}
+
+// Emits the OP_CONCAT ending a chain, its operands being on the stack.
+static void emitConcat(Lowering *lowering, int first, int operands) {
+  IrNode **additions = &lowering->chain[first];
+  int line = additions[operands - 2]->line;
+  emitByte(lowering, OP_CONCAT, line);
+  emitByte(lowering, (uint8_t)operands, line);
+  lowering->depth -= operands - 1;
+  for (int i = 0; i < operands - 1; i++) {
+    emitted(lowering, additions[i]);
+  }
+}
+
+static void pushFrame(Lowering *lowering, IrNode *node) {
+  if (node->hoisted >= 0 && node->hoisted < lowering->ready) {
+    emitCopy(lowering, node);
+    return;
+  }
+  if (lowering->frameCount == lowering->frameCapacity) {
+    int oldCapacity = lowering->frameCapacity;
+    lowering->frameCapacity = GROW_CAPACITY(oldCapacity);
+    lowering->frames = GROW_ARRAY(LowerFrame, lowering->frames, oldCapacity,
+                                  lowering->frameCapacity);
+  }
+  lowering->frames[lowering->frameCount++] = (LowerFrame){node, 0, 0, 0};
+}
+
+// Whether a node is pushed by a single instruction which can't fail.
+static bool isLeaf(Lowering *lowering, IrNode *node) {
+  return node->op == IR_CONSTANT || node->op == IR_INPUT ||
+         (node->hoisted >= 0 && node->hoisted < lowering->ready);
+}
+
+static void appendChain(Lowering *lowering, IrNode *node) {
+  if (lowering->chainCount == lowering->chainCapacity) {
+    int oldCapacity = lowering->chainCapacity;
+    lowering->chainCapacity = GROW_CAPACITY(oldCapacity);
+    lowering->chain = GROW_ARRAY(IrNode *, lowering->chain, oldCapacity,
+                                 lowering->chainCapacity);
+  }
+  lowering->chain[lowering->chainCount++] = node;
+}
+
+// Collects the additions of the chain `a + b + c...` ending in `root` into
+// Lowering.chain, bottom one first, if it's worth an OP_CONCAT.
+//
+// The chain must involve a string, chains of numbers are better off with
+// OP_ADDs that quicken and go through the JIT. It pushes all operands before
+// adding any, so beyond the first two they must be leaves that can't fail,
+// or an error would be raised before the additions' own. All additions are
+// on one line, errors are reported on that of OP_CONCAT.
+// Returns the number of operands, 0 for lowering `root` as usual.
+static int collectChain(Lowering *lowering, IrNode *root) {
+  if (root->op != IR_ADD || root->type == IR_NUMBER ||
+      root->chained == lowering->ir->lowerings) {
+    return 0;
+  }
+  int limit = STACK_MAX - 2 - lowering->depth;
+  if (limit > UINT8_MAX) {
+    limit = UINT8_MAX;
+  }
+
+  int first = lowering->chainCount;
+  int operands = 2;
+  IrNode *node = root;
+  bool strings = root->right->type == IR_STRING;
+  appendChain(lowering, root);
+  for (IrNode *next = node->left;
+       operands < limit && next->op == IR_ADD && next->type != IR_NUMBER &&
+       next->hoisted < 0 && next->line == root->line &&
+       isLeaf(lowering, node->right);
+       next = node->left) {
+    appendChain(lowering, next);
+    node = next;
+    operands++;
+    strings |= node->right->type == IR_STRING;
+  }
+  strings |= node->left->type == IR_STRING;
+
+  if (operands < 3 || !strings) {
+    // The additions below would only find a shorter chain.
+    for (int i = first; i < lowering->chainCount; i++) {
+      lowering->chain[i]->chained = lowering->ir->lowerings;
+    }
+    lowering->chainCount = first;
+    return 0;
+  }
+  for (int i = first, j = lowering->chainCount - 1; i < j; i++, j--) {
+    IrNode *swap = lowering->chain[i];
+    lowering->chain[i] = lowering->chain[j];
+    lowering->chain[j] = swap;
+  }
+  return operands;
+}
+
+// Returns operand `index` of the chain a frame lowers.
+static IrNode *chainOperand(Lowering *lowering, LowerFrame *frame,
+                            int index) {
+  IrNode **additions = &lowering->chain[frame->first];
+  return index == 0 ? additions[0]->left : additions[index - 1]->right;
+}
+
+// Emits the code leaving a node's value on top of the stack. Walks with an
+// explicit stack, as a chain of N binary operators nests N deep.
+static void lowerNode(Lowering *lowering, IrNode *root) {
+  pushFrame(lowering, root);
+  while (lowering->frameCount > 0) {
+    LowerFrame *frame = &lowering->frames[lowering->frameCount - 1];
+    IrNode *node = frame->node;
+    if (frame->state == 0 && frame->operands == 0) {
+      frame->first = lowering->chainCount;
+      frame->operands = collectChain(lowering, node);
+    }
+
+    if (frame->operands > 0) {
+      if (frame->state < frame->operands) {
+        IrNode *operand = chainOperand(lowering, frame, frame->state++);
+        pushFrame(lowering, operand);
+      } else {
+        int first = frame->first;
+        lowering->frameCount--;
+        emitConcat(lowering, first, frame->operands);
+        lowering->chainCount = first;
+      }
+    } else if (frame->state == 0) {
+      frame->state = 1;
+      if (node->left != NULL) {
+        pushFrame(lowering, node->left);
+      }
+    } else if (frame->state == 1) {
+      frame->state = 2;
+      if (node->right != NULL) {
+        pushFrame(lowering, node->right);
+      }
+    } else {
+      lowering->frameCount--;
+      emitOperation(lowering, node);
+    }
+  }
+}
+
+// Appends the code computing the expression to `chunk`, without a return.
+// With `chunk` NULL nothing is emitted, it only checks that the hoisted
+// nodes can be copied from their slots, that the stack stays within
+// STACK_MAX and that the code raises runtime errors in the same order as
+// the unoptimized code would. Common subexpression elimination hoists
+// nodes only as long as that holds.
+// The stack depth is checked either way, the VM doesn't check its pushes.
+LowerResult lowerIr(Ir *ir, Chunk *chunk) {
+  Lowering lowering;
+  lowering.ir = ir;
+  lowering.chunk = chunk;
+  lowering.frames = NULL;
+  lowering.frameCount = 0;
+  lowering.frameCapacity = 0;
+  lowering.chain = NULL;
+  lowering.chainCount = 0;
+  lowering.chainCapacity = 0;
+  lowering.depth = 0;
+  lowering.maxDepth = 0;
+  lowering.ready = 0;
+  lowering.fallibles = 0;
+  lowering.lastFallible = -1;
+  lowering.ok = true;
+  ir->lowerings++;
+
+  for (int i = 0; i < ir->hoistedCount; i++) {
+    lowerNode(&lowering, ir->hoisted[i]);
+    lowering.ready++;
+  }
+  lowerNode(&lowering, ir->root);
+  FREE_ARRAY(LowerFrame, lowering.frames, lowering.frameCapacity);
+  FREE_ARRAY(IrNode *, lowering.chain, lowering.chainCapacity);
+
+  // The VM's stack starts with a sentinel, so the deepest code leaves room
+  // for it.
+  if (lowering.maxDepth > STACK_MAX - 1) {
+    return LOWER_TOO_DEEP;
+  }
+  if (!lowering.ok ||
+      (chunk == NULL && lowering.fallibles != ir->fallibleCount)) {
+    return LOWER_INVALID;
+  }
+  return LOWER_OK;
+}
@@ -1,25 +1,98 @@
 #include "chunk.h"
 #include "common.h"
+#include "compiler.h"
+#include "counters.h"
 #include "debug.h"
+#include "object.h"
+#include "profiler.h"
+#include "sampler.h"
+#include "server.h"
+#include "transpiler.h"
 #include "vm.h"
+#include <errno.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+// Most inputs that can be declared with --input.
+#define INPUTS_MAX 256
+
+// Inputs declared on the command line, every script can refer to them.
+static const char *inputNames[INPUTS_MAX];
+static Value inputValues[INPUTS_MAX];
+static int inputCount = 0;
+
+// Parses `name=value` into a declared input. The value is a number, true,
+// false or nil if it reads as one, otherwise a string.
+static bool parseInput(const char *input) {
+  const char *equals = strchr(input, '=');
+  if (equals == NULL || equals == input || inputCount == INPUTS_MAX) {
+    return false;
+  }
+  char *name = (char *)malloc(equals - input + 1);
+  memcpy(name, input, equals - input);
+  name[equals - input] = '\0';
+
+  const char *text = equals + 1;
+  char *end;
+  double number = strtod(text, &end);
+  Value value;
+  if (*text != '\0' && *end == '\0') {
+    value = NUMBER_VAL(number);
+  } else if (strcmp(text, "true") == 0 || strcmp(text, "false") == 0) {
+    value = BOOL_VAL(text[0] == 't');
+  } else if (strcmp(text, "nil") == 0) {
+    value = NIL_VAL;
+  } else {
+    value = OBJ_VAL(copyString(text, (int)strlen(text)));
+  }
+
+  inputNames[inputCount] = name;
+  inputValues[inputCount] = value;
+  inputCount++;
+  return true;
+}
+
+// Compiles and runs source code with the inputs from the command line.
+static InterpretResult interpretSource(const char *source) {
+  InterpretResult result;
+  if (inputCount == 0) {
+    result = interpret(source);
+  } else {
+    Chunk chunk;
+    initChunk(&chunk);
+    if (!compileInputs(source, &chunk, inputNames, inputCount)) {
+      freeChunk(&chunk);
+      return INTERPRET_COMPILE_ERROR;
+    }
+    result = interpretInputs(&chunk, inputValues);
+    freeChunk(&chunk);
+  }
+
+  // Unlike errors, the VM leaves telling the user about this to its host.
+  if (result == INTERPRET_OUT_OF_FUEL) {
+    fprintf(stderr, "Out of fuel, the expression needs more than %lld.\n",
+            (long long)vm.fuel);
+  }
+  return result;
+}
+
 // Starts a REPL instance
 // REPL ideally handles input that spans multiple lines
 //  and doesn’t have a hardcoded line length limit.
 static void repl() {
   char line[1024];
   while (1) {
-    printf("> ");
+    // Through vm.output, so the prompt stays in order with the results.
+    writeOutput(&vm.output, "> ", 2);
+    flushOutput(&vm.output);
 
     if (!fgets(line, sizeof(line), stdin)) {
       break;
     }
 
-    interpret(line);
+    interpretSource(line);
   }
 }
 
@@ -63,25 +136,225 @@ static char *readFile(const char *path) {
 // Exits program on compile or runtime error
 static void runFile(const char *path) {
   char *source = readFile(path);
-  InterpretResult result = interpret(source);
+  InterpretResult result = interpretSource(source);
   free(source);
+  // exit() doesn't know about the VM's output buffer.
+  flushOutput(&vm.output);
 
   if (result == INTERPRET_COMPILE_ERROR)
     exit(65);
   if (result == INTERPRET_RUNTIME_ERROR)
     exit(70);
+  if (result == INTERPRET_OUT_OF_FUEL)
+    exit(75);
+}
+
+// Compiles a file and writes it translated to C to `output` instead of
+// running it. Exits like runFile() on compile errors.
+static void transpileFile(const char *path, const char *output,
+                          const char *name) {
+  char *source = readFile(path);
+  Chunk chunk;
+  initChunk(&chunk);
+  bool compiled = compileInputs(source, &chunk, inputNames, inputCount);
+  free(source);
+  if (!compiled) {
+    freeChunk(&chunk);
+    exit(65);
+  }
+
+  FILE *out = fopen(output, "w");
+  if (out == NULL) {
+    fprintf(stderr, "Could not open file \"%s\".\n", output);
+    exit(74);
+  }
+  bool translated = transpile(&chunk, out, name);
+  fclose(out);
+  freeChunk(&chunk);
+  if (!translated) {
+    fprintf(stderr, "Could not translate \"%s\" to C.\n", path);
+    exit(70);
+  }
+}
+
+// Prints the usage string and exits
+static void usage() {
+  fprintf(stderr, "Usage: clox [--profile[=json]] [--sample=out.folded] "
+                  "[--sample-rate=hz] [--jit[=threshold]] "
+                  "[--emit-c=out.c [--emit-c-name=name]] "
+                  "[--input=name=value...] [--cache=bytes] [--cache-stats] "
+                  "[--no-opt] [--perf-counters] [--fuel=n] "
+                  "[--serve=path [--workers=n] [--preload=programs]] "
+                  "[path]\n");
+  exit(64);
+}
+
+// Whether the opcode profile is reported as JSON rather than as a table.
+static bool profileJson = false;
+
+// Reports the opcode profile to stderr. Registered with atexit() so the
+// report is printed even when a script ends with a compile or runtime error.
+static void reportProfile() {
+  if (profileJson) {
+    printProfileJson(stderr);
+  } else {
+    printProfile(stderr);
+  }
+}
+
+// Reports how well the compiled chunk cache did to stderr.
+static void reportCache() {
+  fprintf(stderr, "chunk cache: %llu hits, %llu misses, %llu evictions\n",
+          (unsigned long long)vm.cache.hits,
+          (unsigned long long)vm.cache.misses,
+          (unsigned long long)vm.cache.evictions);
+}
+
+// Reports what the perf counters counted to stderr. Registered with atexit()
+// before reportProfile(), so the counters are still open while that runs.
+static void reportCounters() {
+  printCounters(stderr);
+  closeCounters();
+}
+
+// Where collapsed stacks from the sampling profiler are written, if enabled.
+static const char *sampleOutput = NULL;
+// Name of the script being run, the root frame of every sampled stack.
+static const char *scriptName = "repl";
+
+// Stops the sampler and writes its collapsed stacks. Registered with atexit()
+// like reportProfile().
+static void reportSamples() {
+  stopSampler();
+  FILE *out = fopen(sampleOutput, "w");
+  if (out == NULL) {
+    fprintf(stderr, "Could not open file \"%s\".\n", sampleOutput);
+    return;
+  }
+  writeCollapsedStacks(out, scriptName);
+  fclose(out);
 }
 
 int main(int argc, const char *argv[]) {
   initVM();
 
-  if (argc == 1) {
+  const char *path = NULL;
+  int sampleRate = SAMPLER_DEFAULT_HZ;
+  const char *emitOutput = NULL;
+  const char *emitName = TRANSPILER_DEFAULT_NAME;
+  const char *socketPath = NULL;
+  int workers = SERVER_DEFAULT_WORKERS;
+  const char *preloadPath = NULL;
+  bool perfCounters = false;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--profile") == 0 ||
+        strcmp(argv[i], "--profile=json") == 0) {
+      profileJson = argv[i][9] == '=';
+      vm.profiling = true;
+    } else if (strncmp(argv[i], "--sample=", 9) == 0) {
+      sampleOutput = argv[i] + 9;
+    } else if (strncmp(argv[i], "--sample-rate=", 14) == 0) {
+      sampleRate = atoi(argv[i] + 14);
+    } else if (strcmp(argv[i], "--jit") == 0) {
+      vm.jitEnabled = true;
+    } else if (strncmp(argv[i], "--jit=", 6) == 0) {
+      vm.jitEnabled = true;
+      vm.jitThreshold = atoi(argv[i] + 6);
+    } else if (strncmp(argv[i], "--emit-c=", 9) == 0) {
+      emitOutput = argv[i] + 9;
+    } else if (strncmp(argv[i], "--emit-c-name=", 14) == 0) {
+      emitName = argv[i] + 14;
+    } else if (strncmp(argv[i], "--cache=", 8) == 0) {
+      vm.cache.budget = (size_t)strtoull(argv[i] + 8, NULL, 10);
+    } else if (strcmp(argv[i], "--cache-stats") == 0) {
+      atexit(reportCache);
+    } else if (strcmp(argv[i], "--no-opt") == 0) {
+      vm.passes = 0;
+    } else if (strncmp(argv[i], "--fuel=", 7) == 0) {
+      vm.fuel = strtoll(argv[i] + 7, NULL, 10);
+      if (vm.fuel < 0) {
+        usage();
+      }
+    } else if (strcmp(argv[i], "--perf-counters") == 0) {
+      perfCounters = true;
+    } else if (strncmp(argv[i], "--serve=", 8) == 0) {
+      socketPath = argv[i] + 8;
+    } else if (strncmp(argv[i], "--workers=", 10) == 0) {
+      workers = atoi(argv[i] + 10);
+    } else if (strncmp(argv[i], "--preload=", 10) == 0) {
+      preloadPath = argv[i] + 10;
+    } else if (strncmp(argv[i], "--input=", 8) == 0) {
+      if (!parseInput(argv[i] + 8)) {
+        usage();
+      }
+    } else if (argv[i][0] == '-' || path != NULL) {
+      usage();
+    } else {
+      path = argv[i];
+    }
+  }
+
+  if (preloadPath != NULL && socketPath == NULL) {
+    usage();
+  }
+
+  if (emitOutput != NULL) {
+    if (path == NULL) {
+      usage();
+    }
+    transpileFile(path, emitOutput, emitName);
+    freeVM();
+    return 0;
+  }
+
+  if (socketPath != NULL) {
+    if (path != NULL) {
+      usage();
+    }
+    if (preloadPath != NULL) {
+      char *programs = readFile(preloadPath);
+      bool preloaded = preloadPrograms(programs);
+      free(programs);
+      if (!preloaded) {
+        exit(65);
+      }
+    }
+    bool served = serve(socketPath, workers);
+    freeVM();
+    return served ? 0 : 74;
+  }
+
+  if (perfCounters) {
+    if (openCounters()) {
+      vm.counting = true;
+      atexit(reportCounters);
+    } else {
+      // Counting is only ever an aid, the script runs either way.
+      fprintf(stderr, "Could not open perf counters (%s), running without.\n",
+              strerror(errno));
+    }
+  }
+
+  if (vm.profiling) {
+    resetProfile();
+    atexit(reportProfile);
+  }
+
+  if (sampleOutput != NULL) {
+    if (path != NULL) {
+      scriptName = path;
+    }
+    if (!startSampler(sampleRate)) {
+      fprintf(stderr, "Could not start the sampling profiler.\n");
+      exit(64);
+    }
+    atexit(reportSamples);
+  }
+
+  if (path == NULL) {
     repl();
-  } else if (argc == 2) {
-    runFile(argv[1]);
   } else {
-    fprintf(stderr, "Usage: clox [path]\n");
-    exit(64);
+    runFile(path);
   }
 
   freeVM();
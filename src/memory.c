@@ -1,5 +1,6 @@
 #include <stdlib.h>
 
+#include "heap.h"
 #include "memory.h"
 #include "object.h"
 #include "vm.h"
@@ -19,6 +20,11 @@ newSize > oldSize:
     and returns ptr to new block
 */
 void *reallocate(void *pointer, size_t oldSize, size_t newSize) {
+  vm.bytesAllocated += newSize - oldSize;
+  if (newSize > oldSize) {
+    vm.allocations++;
+  }
+
   if (newSize == 0) {
     free(pointer);
     return NULL;
@@ -33,28 +39,18 @@ void *reallocate(void *pointer, size_t oldSize, size_t newSize) {
   return result;
 }
 
-// Frees an Object Value based on its type
-static void freeObject(Obj *object) {
+// Frees what an Object Value owns based on its type. The object itself is
+// a slot of the heap it was allocated in, freed along with its page.
+void freeObject(Obj *object) {
   switch (object->type) {
   case OBJ_STRING: {
     ObjString *string = (ObjString *)object;
     // Free the character array stored in a string Object.
     FREE_ARRAY(char, string->chars, string->length + 1);
-    // Free the actual Object struct.
-    FREE(ObjString, object);
     break;
   }
   }
 }
 
 // Frees all objects
-void freeObjects() {
-  Obj *object = vm.objects;
-  // while the head ptr points to an object
-  while (object != NULL) {
-    // Free the object, update the ptr.
-    Obj *next = object->next;
-    freeObject(object);
-    object = next;
-  }
-}
\ No newline at end of file
+void freeObjects() { freeHeap(&vm.heap); }
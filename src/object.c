@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <string.h>
 
+#include "heap.h"
 #include "memory.h"
 #include "object.h"
 #include "value.h"
@@ -11,18 +12,15 @@
 #define ALLOCATE_OBJ(type, objectType)                                         \
   (type *)allocateObject(sizeof(type), objectType)
 
+_Static_assert(sizeof(ObjString) <= HEAP_MAX_OBJECT,
+               "ObjString must fit in a heap slot");
+
 // Allocates an Object of given size to the heap.
 // Initializes the object's state.
 // NOTE: size also includes extra bytes for payload fields necessary.
 static Obj *allocateObject(size_t size, ObjType type) {
-  Obj *object = (Obj *)reallocate(NULL, 0, size);
+  Obj *object = (Obj *)allocateFromHeap(&vm.heap, size);
   object->type = type;
-
-  // Insert object as the head of singly-linked list.
-  // Avoids maintaining and updating ptr to tail.
-  object->next = vm.objects;
-  vm.objects = object;
-
   return object;
 }
 
@@ -61,7 +59,7 @@ ObjString *copyString(const char *chars, int length) {
 void printObject(Value value) {
   switch (OBJ_TYPE(value)) {
   case OBJ_STRING: {
-    printf("%s", AS_CSTRING(value));
+    writeOutput(&vm.output, AS_CSTRING(value), AS_STRING(value)->length);
     break;
   }
   }
@@ -0,0 +1,395 @@
+#include <math.h>
+#include <string.h>
+
+#include "lower.h"
+#include "memory.h"
+#include "object.h"
+#include "optimizer.h"
+
+// Passes never change what an expression evaluates to, nor which runtime
+// error it raises first. Operators only fail on operands of the wrong type,
+// so folding and simplifying stick to nodes typeNode() proves can't fail.
+
+typedef void (*PassFn)(Ir *ir);
+
+typedef struct Pass {
+  PassFlag flag;
+  PassFn run;
+} Pass;
+
+// Canonical nodes of common subexpression elimination.
+typedef struct Cse {
+  // Hash table of nodes for finding duplicates, NULL for empty buckets.
+  IrNode **table;
+  int tableSize;
+  // Distinct nodes in the order they are first evaluated, indexed by id.
+  IrNode **nodes;
+  int count;
+  int capacity;
+} Cse;
+
+static bool isFalsey(Value value) {
+  return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+static bool isConstant(IrNode *node) {
+  return node != NULL && node->op == IR_CONSTANT;
+}
+
+// Whether a node is the number constant `number`, telling -0 from 0.
+static bool isNumber(IrNode *node, double number) {
+  return isConstant(node) && IS_NUMBER(node->value) &&
+         AS_NUMBER(node->value) == number &&
+         !signbit(AS_NUMBER(node->value)) == !signbit(number);
+}
+
+static IrNode *foldNode(Ir *ir, IrNode *node, void *context) {
+  (void)context;
+  typeNode(node);
+  // Concatenations aren't folded, each would allocate a string that stays
+  // around until the VM is freed.
+  if (node->op == IR_CONSTANT || node->op == IR_INPUT || node->fallible ||
+      node->type == IR_STRING || !isConstant(node->left) ||
+      (node->right != NULL && !isConstant(node->right))) {
+    return node;
+  }
+
+  // Not failing means a number operator has number operands.
+  Value a = node->left->value;
+  Value b = node->right != NULL ? node->right->value : NIL_VAL;
+  Value value;
+  switch (node->op) {
+  case IR_NOT:
+    value = BOOL_VAL(isFalsey(a));
+    break;
+  case IR_NEGATE:
+    value = NUMBER_VAL(-AS_NUMBER(a));
+    break;
+  case IR_EQUAL:
+    value = BOOL_VAL(valuesEqual(a, b));
+    break;
+  case IR_GREATER:
+    value = BOOL_VAL(AS_NUMBER(a) > AS_NUMBER(b));
+    break;
+  case IR_LESS:
+    value = BOOL_VAL(AS_NUMBER(a) < AS_NUMBER(b));
+    break;
+  case IR_ADD:
+    value = NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b));
+    break;
+  case IR_SUBTRACT:
+    value = NUMBER_VAL(AS_NUMBER(a) - AS_NUMBER(b));
+    break;
+  case IR_MULTIPLY:
+    value = NUMBER_VAL(AS_NUMBER(a) * AS_NUMBER(b));
+    break;
+  case IR_DIVIDE:
+    value = NUMBER_VAL(AS_NUMBER(a) / AS_NUMBER(b));
+    break;
+  default:
+    return node; // Unreachable
+  }
+  return newConstant(ir, value, node->line);
+}
+
+// Evaluates operators whose operands are all constants at compile time.
+static void foldConstants(Ir *ir) {
+  ir->root = rewriteIr(ir, ir->root, foldNode, NULL);
+}
+
+static IrNode *simplifyNode(Ir *ir, IrNode *node, void *context) {
+  (void)ir;
+  (void)context;
+  typeNode(node);
+  IrNode *left = node->left;
+  IrNode *right = node->right;
+  bool numbers = left != NULL && right != NULL && left->type == IR_NUMBER &&
+                 right->type == IR_NUMBER;
+
+  // Only identities which hold for every double, NaN and -0 included. So no
+  // x + 0, which turns -0 into 0, and no x * 0, which is NaN for infinities.
+  switch (node->op) {
+  case IR_NOT:
+    if (left->op == IR_NOT && left->left->type == IR_BOOL) {
+      return left->left;
+    }
+    break;
+  case IR_NEGATE:
+    if (left->op == IR_NEGATE && left->left->type == IR_NUMBER) {
+      return left->left;
+    }
+    break;
+  case IR_ADD:
+    if (numbers && isNumber(right, -0.0)) {
+      return left;
+    }
+    if (numbers && isNumber(left, -0.0)) {
+      return right;
+    }
+    break;
+  case IR_SUBTRACT:
+    if (numbers && isNumber(right, 0.0)) {
+      return left;
+    }
+    break;
+  case IR_MULTIPLY:
+    if (numbers && isNumber(right, 1.0)) {
+      return left;
+    }
+    if (numbers && isNumber(left, 1.0)) {
+      return right;
+    }
+    break;
+  case IR_DIVIDE:
+    if (numbers && isNumber(right, 1.0)) {
+      return left;
+    }
+    break;
+  default:
+    break;
+  }
+  return node;
+}
+
+// Drops operations which leave their operand as it is.
+static void simplify(Ir *ir) {
+  ir->root = rewriteIr(ir, ir->root, simplifyNode, NULL);
+}
+
+// FNV-1a style mixing, a word at a time.
+static uint32_t mix(uint32_t hash, uint32_t word) {
+  return (hash ^ word) * 16777619;
+}
+
+static uint32_t mixPointer(uint32_t hash, IrNode *node) {
+  uintptr_t bits = (uintptr_t)node;
+  return mix(mix(hash, (uint32_t)bits), (uint32_t)((uint64_t)bits >> 32));
+}
+
+// Hashes a node by what it computes. Its operands are canonical already, so
+// those hash by address.
+static uint32_t hashNode(IrNode *node) {
+  uint32_t hash = mix(2166136261u, node->op);
+  if (node->op == IR_CONSTANT) {
+    Value value = node->value;
+    hash = mix(hash, value.type);
+    if (IS_NUMBER(value)) {
+      uint64_t bits;
+      memcpy(&bits, &value.as.number, sizeof(bits));
+      hash = mix(mix(hash, (uint32_t)bits), (uint32_t)(bits >> 32));
+    } else if (IS_BOOL(value)) {
+      hash = mix(hash, AS_BOOL(value));
+    } else if (IS_STRING(value)) {
+      ObjString *string = AS_STRING(value);
+      for (int i = 0; i < string->length; i++) {
+        hash = mix(hash, (uint8_t)string->chars[i]);
+      }
+    }
+  } else if (node->op == IR_INPUT) {
+    hash = mix(hash, (uint32_t)node->slot);
+  }
+  hash = mixPointer(mixPointer(hash, node->left), node->right);
+  // Whole numbers have all their bits at the top, and multiplying never
+  // carries those down into the bucket index. Fold them in.
+  hash ^= hash >> 16;
+  hash *= 0x85EBCA6B;
+  return hash ^ (hash >> 13);
+}
+
+// Numbers are the same constant only if they are bitwise equal, 0 == -0
+// but they print differently, and NaN equals nothing.
+static bool sameNode(IrNode *a, IrNode *b) {
+  if (a->op != b->op || a->left != b->left || a->right != b->right) {
+    return false;
+  }
+  if (a->op == IR_INPUT) {
+    return a->slot == b->slot;
+  }
+  if (a->op != IR_CONSTANT) {
+    return true;
+  }
+  if (IS_NUMBER(a->value) && IS_NUMBER(b->value)) {
+    return memcmp(&a->value.as.number, &b->value.as.number,
+                  sizeof(double)) == 0;
+  }
+  return valuesEqual(a->value, b->value);
+}
+
+// Rehashes every canonical node into a table of `size` buckets, a power of
+// two.
+static void growTable(Cse *cse, int size) {
+  FREE_ARRAY(IrNode *, cse->table, cse->tableSize);
+  cse->tableSize = size;
+  cse->table = ALLOCATE(IrNode *, cse->tableSize);
+  for (int i = 0; i < cse->tableSize; i++) {
+    cse->table[i] = NULL;
+  }
+  uint32_t mask = cse->tableSize - 1;
+  for (int i = 0; i < cse->count; i++) {
+    uint32_t bucket = hashNode(cse->nodes[i]) & mask;
+    while (cse->table[bucket] != NULL) {
+      bucket = (bucket + 1) & mask;
+    }
+    cse->table[bucket] = cse->nodes[i];
+  }
+}
+
+// Returns the canonical node computing the same as `node`, which becomes
+// canonical itself if it's the first of its kind. The walk reaches nodes in
+// evaluation order, so that is the order they are numbered in.
+static IrNode *internNode(Ir *ir, IrNode *node, void *context) {
+  Cse *cse = (Cse *)context;
+  uint32_t mask = cse->tableSize - 1;
+  uint32_t bucket = hashNode(node) & mask;
+  while (cse->table[bucket] != NULL) {
+    if (sameNode(cse->table[bucket], node)) {
+      return cse->table[bucket];
+    }
+    bucket = (bucket + 1) & mask;
+  }
+
+  if (cse->capacity < cse->count + 1) {
+    int oldCapacity = cse->capacity;
+    cse->capacity = GROW_CAPACITY(oldCapacity);
+    cse->nodes = GROW_ARRAY(IrNode *, cse->nodes, oldCapacity, cse->capacity);
+  }
+  node->id = cse->count;
+  cse->nodes[cse->count++] = node;
+  cse->table[bucket] = node;
+  node->uses = 0;
+  node->size = 1;
+  if (node->left != NULL) {
+    node->size += node->left->size;
+    node->left->uses++;
+  }
+  if (node->right != NULL) {
+    node->size += node->right->size;
+    node->right->uses++;
+  }
+  if (node->fallible) {
+    ir->fallibleCount++;
+  }
+  if (cse->count > cse->tableSize * 3 / 4) {
+    growTable(cse, cse->tableSize * 2);
+  }
+  return node;
+}
+
+static void hoist(Ir *ir, IrNode *node) {
+  node->hoisted = ir->hoistedCount;
+  ir->hoisted[ir->hoistedCount++] = node;
+}
+
+// Whether a node was computed by a hoisted candidate before `candidate`.
+static bool reachedBefore(Cse *cse, IrNode *node, int candidate) {
+  return node->reached >= 0 && node->reached != candidate &&
+         cse->nodes[node->reached]->hoisted >= 0;
+}
+
+// Hoists the candidates, the first `count` of cse->nodes, which keep the
+// fallible nodes evaluated in id order. The ones hoisted so far evaluated
+// the first `next` of `fallibles`, so a candidate fits if the fallible
+// nodes it adds are the ones right after those. One walk per candidate,
+// stopping at what an earlier one computed already.
+static void hoistInOrder(Ir *ir, Cse *cse, int count, IrNode **fallibles,
+                         IrNode **stack) {
+  int next = 0;
+  for (int i = 0; i < count; i++) {
+    IrNode *candidate = cse->nodes[i];
+    int added = 0;
+    int last = -1;
+    int stackCount = 0;
+    candidate->reached = i;
+    stack[stackCount++] = candidate;
+    while (stackCount > 0) {
+      IrNode *node = stack[--stackCount];
+      if (node->fallible) {
+        added++;
+        if (node->id > last) {
+          last = node->id;
+        }
+      }
+      IrNode *operands[] = {node->left, node->right};
+      for (int j = 0; j < 2; j++) {
+        IrNode *operand = operands[j];
+        if (operand != NULL && operand->reached != i &&
+            !reachedBefore(cse, operand, i)) {
+          operand->reached = i;
+          stack[stackCount++] = operand;
+        }
+      }
+    }
+    if (added == 0 || fallibles[next + added - 1]->id == last) {
+      hoist(ir, candidate);
+      next += added;
+    }
+  }
+}
+
+// Shares the nodes of identical subexpressions, so the tree becomes a DAG,
+// and has lowering compute every repeated one of at least CSE_MIN_SIZE
+// instructions once up front. Hoisting moves computations earlier, so a
+// node is only hoisted if the code still raises the same error first.
+static void eliminateCommonSubexpressions(Ir *ir) {
+  Cse cse;
+  cse.table = NULL;
+  cse.tableSize = 0;
+  cse.nodes = NULL;
+  cse.count = 0;
+  cse.capacity = 0;
+  growTable(&cse, 64);
+
+  ir->fallibleCount = 0;
+  ir->root = rewriteIr(ir, ir->root, internNode, &cse);
+  ir->root->uses++;
+
+  // Ids put operands before what uses them, and so hoisted nodes before
+  // hoisted nodes using them.
+  IrNode **fallibles = ALLOCATE(IrNode *, ir->fallibleCount);
+  int fallibleCount = 0;
+  int candidates = 0;
+  for (int i = 0; i < cse.count; i++) {
+    IrNode *node = cse.nodes[i];
+    if (node->fallible) {
+      fallibles[fallibleCount++] = node;
+    }
+    if (node->uses >= 2 && node->size >= CSE_MIN_SIZE) {
+      cse.nodes[candidates++] = node;
+    }
+  }
+  ir->hoisted = (IrNode **)allocateIr(ir, sizeof(IrNode *) * candidates);
+  ir->hoistedCount = 0;
+  IrNode **stack = ALLOCATE(IrNode *, cse.count);
+  hoistInOrder(ir, &cse, candidates, fallibles, stack);
+
+  // Hoisting can still need more stack or a longer OP_PICK than there is.
+  // Rather than search for the subset which fits, hoist nothing then.
+  if (ir->hoistedCount > 0 && lowerIr(ir, NULL) != LOWER_OK) {
+    for (int i = 0; i < ir->hoistedCount; i++) {
+      ir->hoisted[i]->hoisted = -1;
+    }
+    ir->hoistedCount = 0;
+  }
+
+  FREE_ARRAY(IrNode *, stack, cse.count);
+  FREE_ARRAY(IrNode *, fallibles, ir->fallibleCount);
+  FREE_ARRAY(IrNode *, cse.nodes, cse.capacity);
+  FREE_ARRAY(IrNode *, cse.table, cse.tableSize);
+}
+
+// In the order they run. Folding first leaves simplification and CSE fewer
+// nodes, and CSE goes last as it turns the tree into a DAG.
+static const Pass passes[] = {
+    {PASS_FOLD, foldConstants},
+    {PASS_SIMPLIFY, simplify},
+    {PASS_CSE, eliminateCommonSubexpressions},
+};
+
+// Runs the passes in `flags`, a set of PassFlag, over the expression.
+void optimizeIr(Ir *ir, int flags) {
+  for (size_t i = 0; i < sizeof(passes) / sizeof(passes[0]); i++) {
+    if (flags & passes[i].flag) {
+      passes[i].run(ir);
+    }
+  }
+}
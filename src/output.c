@@ -0,0 +1,184 @@
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "memory.h"
+#include "output.h"
+
+// Writes every byte of `parts` to `fd`, in as few system calls as the
+// kernel allows. Output that can't be written is dropped, like stdio does.
+static void writeParts(int fd, struct iovec *parts, int count) {
+  while (count > 0) {
+    ssize_t written = writev(fd, parts, count);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return;
+    }
+    // Skip what went out, partial writes leave the rest of a part behind.
+    while (count > 0 && (size_t)written >= parts->iov_len) {
+      written -= parts->iov_len;
+      parts++;
+      count--;
+    }
+    if (count > 0) {
+      parts->iov_base = (char *)parts->iov_base + written;
+      parts->iov_len -= written;
+    }
+  }
+}
+
+static void appendMemory(Output *output, const char *data, size_t length) {
+  if (length == 0) {
+    return;
+  }
+  if (output->memoryCapacity < output->memoryCount + length) {
+    size_t oldCapacity = output->memoryCapacity;
+    while (output->memoryCapacity < output->memoryCount + length) {
+      output->memoryCapacity = GROW_CAPACITY(output->memoryCapacity);
+    }
+    output->memory = GROW_ARRAY(char, output->memory, oldCapacity,
+                                output->memoryCapacity);
+  }
+  memcpy(output->memory + output->memoryCount, data, length);
+  output->memoryCount += length;
+}
+
+// Sends the buffer followed by `data` to the sink, the fd sink gets both in
+// a single writev().
+static void sink(Output *output, const char *data, size_t length) {
+  switch (output->kind) {
+  case OUTPUT_FD: {
+    struct iovec parts[2] = {{output->buffer, output->count},
+                             {(void *)data, length}};
+    int first = output->count > 0 ? 0 : 1;
+    writeParts(output->fd, parts + first, (length > 0 ? 2 : 1) - first);
+    break;
+  }
+  case OUTPUT_CALLBACK:
+    if (output->count > 0) {
+      output->callback(output->buffer, output->count, output->context);
+    }
+    if (length > 0) {
+      output->callback(data, length, output->context);
+    }
+    break;
+  case OUTPUT_MEMORY:
+    appendMemory(output, output->buffer, output->count);
+    appendMemory(output, data, length);
+    break;
+  }
+  output->count = 0;
+}
+
+// Initializes output to standard output.
+void initOutput(Output *output) {
+  output->kind = OUTPUT_FD;
+  output->fd = STDOUT_FILENO;
+  output->callback = NULL;
+  output->context = NULL;
+  output->memory = NULL;
+  output->memoryCount = 0;
+  output->memoryCapacity = 0;
+  output->count = 0;
+}
+
+// Flushes what is buffered and frees the memory sink.
+void freeOutput(Output *output) {
+  flushOutput(output);
+  FREE_ARRAY(char, output->memory, output->memoryCapacity);
+  initOutput(output);
+}
+
+// Sends output to a file descriptor, which stays owned by the caller.
+void outputToFd(Output *output, int fd) {
+  flushOutput(output);
+  output->kind = OUTPUT_FD;
+  output->fd = fd;
+}
+
+// Hands output to `callback` in chunks of up to OUTPUT_BUFFER_SIZE bytes,
+// and larger ones for single large writes.
+void outputToCallback(Output *output, OutputFn callback, void *context) {
+  flushOutput(output);
+  output->kind = OUTPUT_CALLBACK;
+  output->callback = callback;
+  output->context = context;
+}
+
+// Collects output in memory, see outputMemory().
+void outputToMemory(Output *output) {
+  flushOutput(output);
+  output->kind = OUTPUT_MEMORY;
+}
+
+// Returns everything written to the memory sink since it was last cleared
+// and stores its length in `length`. The bytes aren't null terminated and
+// stay valid until the next write.
+const char *outputMemory(Output *output, size_t *length) {
+  flushOutput(output);
+  *length = output->memoryCount;
+  return output->memory;
+}
+
+// Empties the memory sink, keeping its allocation for reuse.
+void clearOutputMemory(Output *output) {
+  flushOutput(output);
+  output->memoryCount = 0;
+}
+
+// Appends bytes to the output.
+void writeOutput(Output *output, const char *data, size_t length) {
+  if (output->count + length <= OUTPUT_BUFFER_SIZE) {
+    memcpy(output->buffer + output->count, data, length);
+    output->count += length;
+  } else if (length >= OUTPUT_BUFFER_SIZE / 2) {
+    // Copying this much only to flush it right away isn't worth it.
+    sink(output, data, length);
+  } else {
+    sink(output, NULL, 0);
+    memcpy(output->buffer, data, length);
+    output->count = length;
+  }
+}
+
+// Appends formatted text to the output, as printf() would.
+void printOutput(Output *output, const char *format, ...) {
+  va_list args;
+  va_start(args, format);
+  printOutputList(output, format, args);
+  va_end(args);
+}
+
+// Appends formatted text to the output, as vprintf() would.
+void printOutputList(Output *output, const char *format, va_list args) {
+  va_list again;
+  va_copy(again, args);
+  size_t room = OUTPUT_BUFFER_SIZE - output->count;
+  int length = vsnprintf(output->buffer + output->count, room, format, args);
+  if (length < 0 || (size_t)length < room) {
+    if (length > 0) {
+      output->count += length;
+    }
+    va_end(again);
+    return;
+  }
+
+  // Didn't fit, format it again into a buffer of its own.
+  char *text = ALLOCATE(char, length + 1);
+  vsnprintf(text, length + 1, format, again);
+  va_end(again);
+  writeOutput(output, text, length);
+  FREE_ARRAY(char, text, length + 1);
+}
+
+// Sends everything buffered to the sink.
+void flushOutput(Output *output) {
+  if (output->count > 0) {
+    sink(output, NULL, 0);
+  }
+}
@@ -0,0 +1,183 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "debug.h"
+#include "profiler.h"
+
+// Number of opcode pairs listed in the report.
+#define REPORT_PAIRS 20
+
+Profile profile;
+
+// A single pair of opcodes and how often it was seen, used for sorting.
+typedef struct PairCount {
+  uint8_t first;
+  uint8_t second;
+  uint64_t count;
+} PairCount;
+
+// Clears all gathered statistics.
+void resetProfile() { memset(&profile, 0, sizeof(profile)); }
+
+// Sorts opcodes by descending execution count.
+static int compareOpcodes(const void *a, const void *b) {
+  uint64_t x = profile.counts[*(const uint8_t *)a];
+  uint64_t y = profile.counts[*(const uint8_t *)b];
+  return (x < y) - (x > y);
+}
+
+static int comparePairs(const void *a, const void *b) {
+  uint64_t x = ((const PairCount *)a)->count;
+  uint64_t y = ((const PairCount *)b)->count;
+  return (x < y) - (x > y);
+}
+
+// Fills `opcodes` with every executed opcode, most frequent first.
+// Returns how many there are.
+static int sortedOpcodes(uint8_t *opcodes, uint64_t *total) {
+  int count = 0;
+  *total = 0;
+  for (int i = 0; i < PROFILE_OPCODES; i++) {
+    if (profile.counts[i] > 0) {
+      opcodes[count++] = (uint8_t)i;
+      *total += profile.counts[i];
+    }
+  }
+  qsort(opcodes, count, sizeof(uint8_t), compareOpcodes);
+  return count;
+}
+
+// Collects every opcode pair seen, most frequent first.
+// The caller owns the returned array.
+static PairCount *sortedPairs(int *count) {
+  int capacity = 0;
+  *count = 0;
+  for (int i = 0; i < PROFILE_OPCODES; i++) {
+    for (int j = 0; j < PROFILE_OPCODES; j++) {
+      if (profile.pairs[i][j] > 0) {
+        capacity++;
+      }
+    }
+  }
+
+  PairCount *pairs = (PairCount *)malloc(sizeof(PairCount) * (capacity + 1));
+  for (int i = 0; i < PROFILE_OPCODES; i++) {
+    for (int j = 0; j < PROFILE_OPCODES; j++) {
+      if (profile.pairs[i][j] > 0) {
+        PairCount pair = {(uint8_t)i, (uint8_t)j, profile.pairs[i][j]};
+        pairs[(*count)++] = pair;
+      }
+    }
+  }
+  qsort(pairs, *count, sizeof(PairCount), comparePairs);
+  return pairs;
+}
+
+// Returns a name for an opcode even if the disassembler doesn't know it.
+static const char *nameOf(uint8_t opcode) {
+  const char *name = opcodeName(opcode);
+  return name != NULL ? name : "OP_UNKNOWN";
+}
+
+// Prints an event per execution of an opcode, or n/a if it isn't counted.
+static void printPerOpcode(FILE *out, uint8_t op, CounterEvent event) {
+  if (isCounting(event)) {
+    fprintf(out, " %12.2f",
+            (double)profile.events[op][event] / profile.counts[op]);
+  } else {
+    fprintf(out, " %12s", "n/a");
+  }
+}
+
+// Prints what the perf counters attribute to each opcode.
+static void printOpcodeCounters(FILE *out, const uint8_t *opcodes,
+                                int count) {
+  fprintf(out, "== opcode perf counters ==\n");
+  fprintf(out, "%-16s %12s %12s %6s %12s %12s %12s\n", "opcode", "cycles/op",
+          "instr/op", "IPC", "br-miss/op", "L1d-miss/op", "LLC-miss/op");
+  for (int i = 0; i < count; i++) {
+    uint8_t op = opcodes[i];
+    const uint64_t *events = profile.events[op];
+    fprintf(out, "%-16s", nameOf(op));
+    printPerOpcode(out, op, COUNTER_CYCLES);
+    printPerOpcode(out, op, COUNTER_INSTRUCTIONS);
+    if (isCounting(COUNTER_INSTRUCTIONS) && events[COUNTER_CYCLES] > 0) {
+      fprintf(out, " %6.2f",
+              (double)events[COUNTER_INSTRUCTIONS] / events[COUNTER_CYCLES]);
+    } else {
+      fprintf(out, " %6s", "n/a");
+    }
+    printPerOpcode(out, op, COUNTER_BRANCH_MISSES);
+    printPerOpcode(out, op, COUNTER_L1D_MISSES);
+    printPerOpcode(out, op, COUNTER_LLC_MISSES);
+    fprintf(out, "\n");
+  }
+}
+
+// Prints a human readable report, opcodes and pairs sorted by frequency.
+void printProfile(FILE *out) {
+  uint8_t opcodes[PROFILE_OPCODES];
+  uint64_t total;
+  int count = sortedOpcodes(opcodes, &total);
+
+  fprintf(out, "== opcode profile ==\n");
+  fprintf(out, "%-16s %12s %7s %14s %10s\n", "opcode", "count", "%",
+          "cycles", "cyc/op");
+  for (int i = 0; i < count; i++) {
+    uint8_t op = opcodes[i];
+    fprintf(out, "%-16s %12llu %6.2f%% %14llu %10.1f\n", nameOf(op),
+            (unsigned long long)profile.counts[op],
+            100.0 * profile.counts[op] / total,
+            (unsigned long long)profile.cycles[op],
+            (double)profile.cycles[op] / profile.counts[op]);
+  }
+  fprintf(out, "%-16s %12llu\n", "total", (unsigned long long)total);
+
+  if (isCounting(COUNTER_CYCLES)) {
+    printOpcodeCounters(out, opcodes, count);
+  }
+
+  int pairCount;
+  PairCount *pairs = sortedPairs(&pairCount);
+  fprintf(out, "== top opcode pairs ==\n");
+  for (int i = 0; i < pairCount && i < REPORT_PAIRS; i++) {
+    fprintf(out, "%-16s -> %-16s %12llu\n", nameOf(pairs[i].first),
+            nameOf(pairs[i].second), (unsigned long long)pairs[i].count);
+  }
+  free(pairs);
+}
+
+// Prints the same statistics as a JSON object, listing every pair seen.
+void printProfileJson(FILE *out) {
+  uint8_t opcodes[PROFILE_OPCODES];
+  uint64_t total;
+  int count = sortedOpcodes(opcodes, &total);
+
+  fprintf(out, "{\"total\": %llu, \"opcodes\": [", (unsigned long long)total);
+  for (int i = 0; i < count; i++) {
+    uint8_t op = opcodes[i];
+    fprintf(out, "%s{\"name\": \"%s\", \"count\": %llu, \"cycles\": %llu",
+            i == 0 ? "" : ", ", nameOf(op),
+            (unsigned long long)profile.counts[op],
+            (unsigned long long)profile.cycles[op]);
+    // Perf counters only appear when they were open.
+    for (int event = 0; event < COUNTER_EVENTS; event++) {
+      if (isCounting((CounterEvent)event)) {
+        fprintf(out, ", \"perf_%s\": %llu", counterName((CounterEvent)event),
+                (unsigned long long)profile.events[op][event]);
+      }
+    }
+    fprintf(out, "}");
+  }
+
+  int pairCount;
+  PairCount *pairs = sortedPairs(&pairCount);
+  fprintf(out, "], \"pairs\": [");
+  for (int i = 0; i < pairCount; i++) {
+    fprintf(out, "%s{\"first\": \"%s\", \"second\": \"%s\", \"count\": %llu}",
+            i == 0 ? "" : ", ", nameOf(pairs[i].first),
+            nameOf(pairs[i].second), (unsigned long long)pairs[i].count);
+  }
+  fprintf(out, "]}\n");
+  free(pairs);
+}
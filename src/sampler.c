@@ -0,0 +1,170 @@
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "debug.h"
+#include "memory.h"
+#include "sampler.h"
+#include "vm.h"
+
+// Raw samples the signal handler can buffer between two collections.
+#define PENDING_MAX 4096
+// Recorded for ticks that land outside of run(), e.g. while compiling.
+#define OUTSIDE_VM -1
+
+// Samples attributed to one opcode on one source line.
+typedef struct SampleSite {
+  int line;
+  uint8_t opcode;
+  uint64_t count;
+} SampleSite;
+
+typedef struct Sampler {
+  // Bytecode offsets recorded by the signal handler, not yet attributed.
+  // Only touched by the handler or with SIGPROF blocked.
+  int pending[PENDING_MAX];
+  volatile sig_atomic_t pendingCount;
+  // Ticks lost because the pending buffer was full.
+  volatile sig_atomic_t dropped;
+  // Ticks that landed outside of run().
+  uint64_t outside;
+  // Dynamic array of sites with at least one sample.
+  int count;
+  int capacity;
+  SampleSite *sites;
+} Sampler;
+
+static Sampler sampler;
+
+// SIGPROF handler. Records where the VM currently is and nothing else, so it
+// stays async-signal-safe: no allocation, no locks, no stdio.
+static void onTick(int signal) {
+  (void)signal;
+  if (sampler.pendingCount >= PENDING_MAX) {
+    sampler.dropped++;
+    return;
+  }
+
+  Chunk *chunk = vm.chunk;
+  uint8_t *ip = vm.ip;
+  int offset = OUTSIDE_VM;
+  if (chunk != NULL && ip > chunk->code && ip <= chunk->code + chunk->count) {
+    // ip has already moved past the byte being executed.
+    offset = (int)(ip - chunk->code) - 1;
+  }
+  sampler.pending[sampler.pendingCount++] = offset;
+}
+
+// Blocks or unblocks SIGPROF for the calling thread.
+static void maskTicks(int how) {
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGPROF);
+  sigprocmask(how, &set, NULL);
+}
+
+// Starts delivering SIGPROF `hz` times per second of CPU time.
+// Returns false if the timer could not be installed.
+bool startSampler(int hz) {
+  if (hz <= 0 || hz > 1000000) {
+    return false;
+  }
+
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = onTick;
+  action.sa_flags = SA_RESTART;
+  sigemptyset(&action.sa_mask);
+  if (sigaction(SIGPROF, &action, NULL) != 0) {
+    return false;
+  }
+
+  struct itimerval timer;
+  // tv_usec must stay below a second, which 1 Hz would reach.
+  timer.it_interval.tv_sec = 1 / hz;
+  timer.it_interval.tv_usec = (1000000 / hz) % 1000000;
+  timer.it_value = timer.it_interval;
+  if (setitimer(ITIMER_PROF, &timer, NULL) != 0) {
+    return false;
+  }
+
+  vm.sampling = true;
+  return true;
+}
+
+// Stops the timer. Samples gathered so far are kept.
+void stopSampler() {
+  struct itimerval timer;
+  memset(&timer, 0, sizeof(timer));
+  setitimer(ITIMER_PROF, &timer, NULL);
+  signal(SIGPROF, SIG_IGN);
+  vm.sampling = false;
+}
+
+// Returns the offset of the instruction which contains the byte at `offset`.
+static int instructionStart(Chunk *chunk, int offset) {
+  int start = 0;
+  while (start + instructionLength(chunk->code[start]) <= offset) {
+    start += instructionLength(chunk->code[start]);
+  }
+  return start;
+}
+
+// Adds one sample to the site of the given line and opcode.
+static void addSample(int line, uint8_t opcode) {
+  for (int i = 0; i < sampler.count; i++) {
+    if (sampler.sites[i].line == line && sampler.sites[i].opcode == opcode) {
+      sampler.sites[i].count++;
+      return;
+    }
+  }
+
+  if (sampler.capacity <= sampler.count) {
+    int oldCapacity = sampler.capacity;
+    sampler.capacity = GROW_CAPACITY(oldCapacity);
+    sampler.sites = GROW_ARRAY(SampleSite, sampler.sites, oldCapacity,
+                               sampler.capacity);
+  }
+  SampleSite site = {line, opcode, 1};
+  sampler.sites[sampler.count++] = site;
+}
+
+// Attributes pending samples to source lines and opcodes of `chunk`.
+// Must be called after running a chunk and before it is freed, as raw
+// samples are only offsets into its bytecode.
+void collectSamples(Chunk *chunk) {
+  maskTicks(SIG_BLOCK);
+  for (int i = 0; i < sampler.pendingCount; i++) {
+    int offset = sampler.pending[i];
+    if (offset == OUTSIDE_VM || chunk == NULL || offset >= chunk->count) {
+      sampler.outside++;
+      continue;
+    }
+    int start = instructionStart(chunk, offset);
+    addSample(chunk->lines[start], chunk->code[start]);
+  }
+  sampler.pendingCount = 0;
+  maskTicks(SIG_UNBLOCK);
+}
+
+// Writes all samples in the collapsed stack format read by flamegraph tools,
+// one `script;script:line;opcode count` entry per site.
+void writeCollapsedStacks(FILE *out, const char *script) {
+  collectSamples(NULL);
+
+  for (int i = 0; i < sampler.count; i++) {
+    SampleSite *site = &sampler.sites[i];
+    const char *name = opcodeName(site->opcode);
+    fprintf(out, "%s;%s:%d;%s %llu\n", script, script, site->line,
+            name != NULL ? name : "OP_UNKNOWN",
+            (unsigned long long)site->count);
+  }
+  if (sampler.outside > 0) {
+    fprintf(out, "%s;[outside vm] %llu\n", script,
+            (unsigned long long)sampler.outside);
+  }
+  if (sampler.dropped > 0) {
+    fprintf(stderr, "sampler: dropped %d samples\n", (int)sampler.dropped);
+  }
+}
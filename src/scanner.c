@@ -1,5 +1,7 @@
 #include <ctype.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "common.h"
@@ -29,7 +31,7 @@ static bool isAlpha(char c) {
 }
 
 // Checks if input char is within ASCII range 0-9
-static bool isDigit(char c) { return c > '0' && c < '9'; }
+static bool isDigit(char c) { return c >= '0' && c <= '9'; }
 
 // Checks if scanner's current ptr is at '\0'
 static bool isAtEnd() { return *scanner.current == '\0'; }
@@ -41,6 +43,7 @@ static Token makeToken(TokenType type) {
   token.start = scanner.start;
   token.length = (int)(scanner.current - scanner.start);
   token.line = scanner.line;
+  token.number = 0;
   return token;
 }
 
@@ -84,6 +87,7 @@ static Token errorToken(const char *message) {
   token.start = message;
   token.length = (int)strlen(message);
   token.line = scanner.line;
+  token.number = 0;
   return token;
 }
 
@@ -199,25 +203,108 @@ static Token identifier() {
   return makeToken(identifierType());
 }
 
-// Consumes an ASCII number and returns a number token
-static Token number() {
-  // Consume number
-  while (isDigit(peek())) {
-    advance();
+// Largest integer below which every integer is exactly a double, 2^53.
+#define EXACT_INTEGER_MAX 9007199254740992ULL
+
+// Powers of ten a double holds exactly.
+static const double exactPowers[] = {
+    1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+static const uint64_t integerPowers[] = {
+    1ULL,
+    10ULL,
+    100ULL,
+    1000ULL,
+    10000ULL,
+    100000ULL,
+    1000000ULL,
+    10000000ULL,
+    100000000ULL,
+    1000000000ULL,
+    10000000000ULL,
+    100000000000ULL,
+    1000000000000ULL,
+    10000000000000ULL,
+    100000000000000ULL,
+    1000000000000000ULL,
+    10000000000000000ULL,
+};
+
+// Returns mantissa * 10^exponent correctly rounded, or false if that takes
+// more than one rounding step. This is Clinger's fast path: both the
+// mantissa and the power of ten are exact doubles, so the IEEE multiply or
+// divide rounds the exact result once.
+static bool exactDecimal(uint64_t mantissa, int exponent, double *result) {
+  if (mantissa == 0) {
+    *result = 0;
+    return true;
   }
+  if (exponent > 22 && exponent <= 22 + 15) {
+    // Move what doesn't fit into the power over to the mantissa, if it
+    // stays exact there. 1e30 is 1e8 * 1e22, and both are exact.
+    uint64_t power = integerPowers[exponent - 22];
+    if (mantissa > EXACT_INTEGER_MAX / power) {
+      return false;
+    }
+    mantissa *= power;
+    exponent = 22;
+  }
+  if (exponent < -22 || exponent > 22) {
+    return false;
+  }
+  double value = (double)mantissa;
+  *result = exponent < 0 ? value / exactPowers[-exponent]
+                         : value * exactPowers[exponent];
+  return true;
+}
 
-  // Check for fractional part
-  if (peek() == '.' && isDigit(peekNext())) {
-    // Consume '.'
-    advance();
-
-    // Consume fractional numbers
-    while (isDigit(peek())) {
-      advance();
+// Consumes an ASCII number and returns a number token.
+// The digits are accumulated while scanning, as mantissa * 10^exponent with
+// trailing zeros kept out of the mantissa. Nearly every literal has few
+// enough digits for exactDecimal(), the rest fall back to strtod().
+static Token number() {
+  // The first digit was already consumed.
+  scanner.current--;
+  uint64_t mantissa = 0;
+  // Zeros seen since the last other digit, only part of the mantissa once
+  // another digit follows.
+  int zeros = 0;
+  int fractionDigits = 0;
+  bool exact = true;
+
+  for (bool fraction = false;; advance()) {
+    char c = peek();
+    if (c == '.' && !fraction && isDigit(peekNext())) {
+      // Consume '.'
+      fraction = true;
+      continue;
+    }
+    if (!isDigit(c)) {
+      break;
     }
+    fractionDigits += fraction;
+    if (c == '0') {
+      zeros++;
+      continue;
+    }
+    uint64_t digit = (uint64_t)(c - '0');
+    if (zeros + 1 >= (int)(sizeof(integerPowers) / sizeof(integerPowers[0])) ||
+        mantissa > (EXACT_INTEGER_MAX - digit) / integerPowers[zeros + 1]) {
+      exact = false;
+    } else {
+      mantissa = mantissa * integerPowers[zeros + 1] + digit;
+    }
+    zeros = 0;
   }
 
-  return makeToken(TOKEN_NUMBER);
+  Token token = makeToken(TOKEN_NUMBER);
+  if (!exact || !exactDecimal(mantissa, zeros - fractionDigits,
+                              &token.number)) {
+    token.number = strtod(token.start, NULL);
+  }
+  return token;
 }
 
 // Consumes a string till '"' or EOF.
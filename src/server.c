@@ -0,0 +1,580 @@
+#include <ctype.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "compiler.h"
+#include "freeze.h"
+#include "heap.h"
+#include "memory.h"
+#include "object.h"
+#include "server.h"
+#include "vm.h"
+
+// Serves expressions over a Unix domain socket from pre-forked worker
+// processes. Each worker keeps its warm VM, with its chunk cache, for as
+// long as it lives and takes one connection at a time off the shared
+// listening socket. The parent only replaces workers that die.
+//
+// Programs preloaded by the parent are frozen before the workers fork, so
+// every worker runs the same physical copy of them and only its stack and
+// what requests allocate are its own.
+
+// A program compiled by REQUEST_COMPILE.
+typedef struct Program {
+  Chunk chunk;
+} Program;
+
+// The connection a worker is serving.
+typedef struct Connection {
+  int fd;
+  // The request being handled, null terminated for the compiler.
+  uint8_t *frame;
+  size_t frameCapacity;
+  Program *programs;
+  int programCount;
+  int programCapacity;
+} Connection;
+
+// Reads a request's fields front to back. Reading past the end clears `ok`
+// and yields zeros.
+typedef struct Reader {
+  const uint8_t *at;
+  const uint8_t *end;
+  bool ok;
+} Reader;
+
+// Set by SIGINT and SIGTERM in the parent.
+static volatile sig_atomic_t stopping = 0;
+
+// Programs from preloadPrograms(), the first ids on every connection.
+static FrozenChunks preloaded = {NULL, 0, NULL, 0};
+
+static void stop(int signal) {
+  (void)signal;
+  stopping = 1;
+}
+
+// Reads exactly `length` bytes. Returns false at end of file or on error.
+static bool readFully(int fd, void *buffer, size_t length) {
+  uint8_t *at = (uint8_t *)buffer;
+  while (length > 0) {
+    ssize_t count = read(fd, at, length);
+    if (count < 0 && errno == EINTR) {
+      continue;
+    }
+    if (count <= 0) {
+      return false;
+    }
+    at += count;
+    length -= count;
+  }
+  return true;
+}
+
+static const uint8_t *take(Reader *reader, size_t length) {
+  if ((size_t)(reader->end - reader->at) < length) {
+    reader->ok = false;
+    reader->at = reader->end;
+    return NULL;
+  }
+  const uint8_t *at = reader->at;
+  reader->at += length;
+  return at;
+}
+
+static uint8_t readU8(Reader *reader) {
+  const uint8_t *at = take(reader, 1);
+  return at != NULL ? *at : 0;
+}
+
+static uint32_t readU32(Reader *reader) {
+  uint32_t value = 0;
+  const uint8_t *at = take(reader, sizeof(value));
+  if (at != NULL) {
+    memcpy(&value, at, sizeof(value));
+  }
+  return value;
+}
+
+// Reads an input value, allocating strings on the VM's heap.
+static Value readValue(Reader *reader) {
+  switch (readU8(reader)) {
+  case VAL_BOOL:
+    return BOOL_VAL(readU8(reader) != 0);
+  case VAL_NIL:
+    return NIL_VAL;
+  case VAL_NUMBER: {
+    double number = 0;
+    const uint8_t *at = take(reader, sizeof(number));
+    if (at != NULL) {
+      memcpy(&number, at, sizeof(number));
+    }
+    return NUMBER_VAL(number);
+  }
+  case VAL_OBJ: {
+    uint32_t length = readU32(reader);
+    const uint8_t *chars = take(reader, length);
+    if (chars == NULL) {
+      return NIL_VAL;
+    }
+    return OBJ_VAL(copyString((const char *)chars, (int)length));
+  }
+  default:
+    reader->ok = false;
+    return NIL_VAL;
+  }
+}
+
+// Writes a response frame, the status followed by `payload`.
+// Returns false if the client went away.
+static bool respond(Connection *connection, ResponseStatus status,
+                    const void *payload, size_t length) {
+  uint8_t header[5];
+  uint32_t frameLength = (uint32_t)(1 + length);
+  memcpy(header, &frameLength, sizeof(frameLength));
+  header[4] = (uint8_t)status;
+  struct iovec parts[2] = {{header, sizeof(header)},
+                           {(void *)payload, length}};
+  struct iovec *part = parts;
+  int count = length > 0 ? 2 : 1;
+  while (count > 0) {
+    ssize_t written = writev(connection->fd, part, count);
+    if (written < 0 && errno == EINTR) {
+      continue;
+    }
+    if (written < 0) {
+      return false;
+    }
+    while (count > 0 && (size_t)written >= part->iov_len) {
+      written -= part->iov_len;
+      part++;
+      count--;
+    }
+    if (count > 0) {
+      part->iov_base = (uint8_t *)part->iov_base + written;
+      part->iov_len -= written;
+    }
+  }
+  return true;
+}
+
+// Responds with what the expression printed, followed by the error message
+// if it failed.
+static bool respondWithOutput(Connection *connection, InterpretResult result) {
+  size_t length;
+  const char *errors = outputMemory(&vm.errors, &length);
+  if (length > 0) {
+    writeOutput(&vm.output, errors, length);
+  }
+  const char *output = outputMemory(&vm.output, &length);
+  ResponseStatus status = result == INTERPRET_OUT_OF_FUEL
+                              ? RESPONSE_OUT_OF_FUEL
+                              : (ResponseStatus)result;
+  return respond(connection, status, output, length);
+}
+
+// Sets vm.heap aside in `kept`, so what is allocated from here on goes into
+// a heap of its own.
+static void beginTemporaries(Heap *kept) {
+  *kept = vm.heap;
+  initHeap(&vm.heap);
+}
+
+// Frees the objects allocated since beginTemporaries() and puts the kept
+// heap back.
+static void endTemporaries(Heap *kept) {
+  freeHeap(&vm.heap);
+  vm.heap = *kept;
+}
+
+// Runs source code, through the chunk cache like interpret().
+static bool handleEval(Connection *connection, Reader *reader) {
+  const char *source = (const char *)reader->at;
+  int length = (int)(reader->end - reader->at);
+  Heap kept;
+  beginTemporaries(&kept);
+  uint32_t hash = hashSource(source, length);
+  Chunk *chunk = findChunk(&vm.cache, source, length, vm.passes, hash);
+  Chunk compiled;
+  initChunk(&compiled);
+  InterpretResult result = INTERPRET_COMPILE_ERROR;
+
+  if (chunk == NULL && compile(source, &compiled)) {
+    // The chunk owns its constants, nothing the request allocated outlives
+    // it even if the chunk is cached.
+    chunk = addChunk(&vm.cache, source, length, vm.passes, hash,
+                     &compiled);
+    if (chunk == NULL) {
+      chunk = &compiled;
+    }
+  }
+  if (chunk != NULL) {
+    result = interpretChunk(chunk);
+  }
+
+  bool sent = respondWithOutput(connection, result);
+  if (chunk == &compiled || result == INTERPRET_COMPILE_ERROR) {
+    freeChunk(&compiled);
+  }
+  endTemporaries(&kept);
+  return sent;
+}
+
+// Compiles a program for REQUEST_RUN to refer to by its index.
+static bool handleCompile(Connection *connection, Reader *reader) {
+  int count = readU8(reader);
+  const char *names[UINT8_MAX + 1];
+  // Room for every name and its terminator.
+  char *storage = (char *)malloc(reader->end - reader->at + count + 1);
+  if (storage == NULL) {
+    return respond(connection, RESPONSE_BAD_REQUEST, NULL, 0);
+  }
+  char *next = storage;
+  for (int i = 0; i < count; i++) {
+    uint8_t length = readU8(reader);
+    const uint8_t *name = take(reader, length);
+    if (name == NULL) {
+      // The frame ends early, and storage only has room for what's in it.
+      break;
+    }
+    memcpy(next, name, length);
+    next[length] = '\0';
+    names[i] = next;
+    next += length + 1;
+  }
+  if (!reader->ok) {
+    free(storage);
+    return respond(connection, RESPONSE_BAD_REQUEST, NULL, 0);
+  }
+
+  Program program;
+  initChunk(&program.chunk);
+  bool compiled = compileInputs((const char *)reader->at, &program.chunk,
+                                names, count);
+  free(storage);
+  if (!compiled) {
+    freeChunk(&program.chunk);
+    size_t length;
+    const char *errors = outputMemory(&vm.errors, &length);
+    return respond(connection, RESPONSE_COMPILE_ERROR, errors, length);
+  }
+
+  if (connection->programCapacity < connection->programCount + 1) {
+    int oldCapacity = connection->programCapacity;
+    connection->programCapacity = GROW_CAPACITY(oldCapacity);
+    connection->programs =
+        GROW_ARRAY(Program, connection->programs, oldCapacity,
+                   connection->programCapacity);
+  }
+  uint32_t id = (uint32_t)(preloaded.count + connection->programCount);
+  connection->programs[connection->programCount++] = program;
+  return respond(connection, RESPONSE_OK, &id, sizeof(id));
+}
+
+// Returns the chunk of a preloaded or compiled program, NULL if there is no
+// program `id`.
+static Chunk *findProgram(Connection *connection, uint32_t id) {
+  if (id < (uint32_t)preloaded.count) {
+    return &preloaded.chunks[id];
+  }
+  id -= (uint32_t)preloaded.count;
+  if (id < (uint32_t)connection->programCount) {
+    return &connection->programs[id].chunk;
+  }
+  return NULL;
+}
+
+// Runs a preloaded or compiled program with the inputs in the request.
+static bool handleRun(Connection *connection, Reader *reader) {
+  uint32_t id = readU32(reader);
+  Chunk *chunk = findProgram(connection, id);
+  if (!reader->ok || chunk == NULL) {
+    return respond(connection, RESPONSE_BAD_REQUEST, NULL, 0);
+  }
+  Heap kept;
+  beginTemporaries(&kept);
+  Value inputs[UINT8_MAX + 1];
+  for (int i = 0; i < chunk->inputCount; i++) {
+    inputs[i] = readValue(reader);
+  }
+
+  bool sent;
+  if (!reader->ok || reader->at != reader->end) {
+    sent = respond(connection, RESPONSE_BAD_REQUEST, NULL, 0);
+  } else {
+    sent = respondWithOutput(connection, interpretInputs(chunk, inputs));
+  }
+  endTemporaries(&kept);
+  return sent;
+}
+
+// Handles one request frame. Returns false once the connection is done.
+static bool handleRequest(Connection *connection, size_t length) {
+  Reader reader = {connection->frame, connection->frame + length, true};
+  clearOutputMemory(&vm.output);
+  clearOutputMemory(&vm.errors);
+  switch (readU8(&reader)) {
+  case REQUEST_EVAL:
+    return handleEval(connection, &reader);
+  case REQUEST_COMPILE:
+    return handleCompile(connection, &reader);
+  case REQUEST_RUN:
+    return handleRun(connection, &reader);
+  default:
+    return respond(connection, RESPONSE_BAD_REQUEST, NULL, 0);
+  }
+}
+
+// Serves requests until the client hangs up or sends an oversized frame,
+// then frees everything the connection compiled.
+static void serveConnection(int fd) {
+  Connection connection;
+  connection.fd = fd;
+  connection.frame = NULL;
+  connection.frameCapacity = 0;
+  connection.programs = NULL;
+  connection.programCount = 0;
+  connection.programCapacity = 0;
+
+  for (;;) {
+    uint32_t length;
+    if (!readFully(fd, &length, sizeof(length)) || length == 0 ||
+        length > SERVER_FRAME_MAX) {
+      break;
+    }
+    if (connection.frameCapacity < (size_t)length + 1) {
+      connection.frameCapacity = (size_t)length + 1;
+      connection.frame =
+          (uint8_t *)realloc(connection.frame, connection.frameCapacity);
+    }
+    if (!readFully(fd, connection.frame, length)) {
+      break;
+    }
+    connection.frame[length] = '\0';
+    if (!handleRequest(&connection, length)) {
+      break;
+    }
+  }
+
+  for (int i = 0; i < connection.programCount; i++) {
+    freeChunk(&connection.programs[i].chunk);
+  }
+  FREE_ARRAY(Program, connection.programs, connection.programCapacity);
+  free(connection.frame);
+  close(fd);
+}
+
+// Body of a worker process, accepts connections until it is killed.
+static void runWorker(int listener) {
+  signal(SIGINT, SIG_DFL);
+  signal(SIGTERM, SIG_DFL);
+  // A client hanging up mid-response shouldn't take the worker with it.
+  signal(SIGPIPE, SIG_IGN);
+  outputToMemory(&vm.output);
+  outputToMemory(&vm.errors);
+
+  for (;;) {
+    int fd = accept(listener, NULL, NULL);
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      _exit(1);
+    }
+    serveConnection(fd);
+  }
+}
+
+static pid_t spawnWorker(int listener) {
+  pid_t pid = fork();
+  if (pid == 0) {
+    runWorker(listener);
+  }
+  if (pid < 0) {
+    perror("fork");
+  }
+  return pid;
+}
+
+// Returns where the colon is if a line starts with input names and a colon,
+// as in `x y: x * y`, otherwise -1.
+static int findNames(const char *line) {
+  for (int i = 0; line[i] != '\0'; i++) {
+    if (line[i] == ':') {
+      return i;
+    }
+    if (!isalnum((unsigned char)line[i]) && line[i] != '_' &&
+        !isspace((unsigned char)line[i])) {
+      return -1;
+    }
+  }
+  return -1;
+}
+
+// Compiles every line of `programs` for the workers to share, the program
+// on the Nth non-blank line gets id N - 1 on every connection. A line is an
+// expression, preceded by its input names and a colon if it has inputs:
+//
+//   price quantity: price * quantity
+//
+// Must be called before serve(). Returns false if a program doesn't compile.
+bool preloadPrograms(const char *programs) {
+  Chunk *chunks = NULL;
+  int count = 0;
+  int capacity = 0;
+  Heap kept;
+  beginTemporaries(&kept);
+  bool ok = true;
+  int lineNumber = 0;
+
+  for (const char *line = programs; ok && *line != '\0';) {
+    const char *end = strchr(line, '\n');
+    if (end == NULL) {
+      end = line + strlen(line);
+    }
+    lineNumber++;
+    size_t length = (size_t)(end - line);
+    char *copy = (char *)malloc(length + 1);
+    memcpy(copy, line, length);
+    copy[length] = '\0';
+    line = *end == '\n' ? end + 1 : end;
+
+    const char *names[UINT8_MAX + 1];
+    int nameCount = 0;
+    char *source = copy;
+    int colon = findNames(copy);
+    if (colon >= 0) {
+      copy[colon] = '\0';
+      source = copy + colon + 1;
+      for (char *name = strtok(copy, " \t\r"); name != NULL;
+           name = strtok(NULL, " \t\r")) {
+        if (nameCount == UINT8_MAX + 1) {
+          ok = false;
+          break;
+        }
+        names[nameCount++] = name;
+      }
+    } else if (strspn(copy, " \t\r") == length) {
+      free(copy);
+      continue;
+    }
+
+    if (capacity < count + 1) {
+      int oldCapacity = capacity;
+      capacity = GROW_CAPACITY(oldCapacity);
+      chunks = GROW_ARRAY(Chunk, chunks, oldCapacity, capacity);
+    }
+    initChunk(&chunks[count]);
+    if (ok && compileInputs(source, &chunks[count], names, nameCount)) {
+      count++;
+    } else {
+      freeChunk(&chunks[count]);
+      fprintf(stderr, "Could not compile the program on line %d.\n",
+              lineNumber);
+      ok = false;
+    }
+    free(copy);
+  }
+
+  if (ok && !freezeChunks(&preloaded, chunks, count)) {
+    fprintf(stderr, "Could not map memory for preloaded programs.\n");
+    ok = false;
+  }
+  // The frozen copies have their own strings.
+  for (int i = 0; i < count; i++) {
+    freeChunk(&chunks[i]);
+  }
+  FREE_ARRAY(Chunk, chunks, capacity);
+  endTemporaries(&kept);
+  return ok;
+}
+
+// Listens on a Unix domain socket at `path` with `workers` processes until
+// SIGINT or SIGTERM, then removes the socket again.
+// Returns false if the socket can't be set up.
+bool serve(const char *path, int workers) {
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(address.sun_path)) {
+    fprintf(stderr, "Socket path \"%s\" is too long.\n", path);
+    return false;
+  }
+  strcpy(address.sun_path, path);
+
+  int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listener < 0) {
+    perror("socket");
+    return false;
+  }
+  // A socket left behind by an earlier server would make bind() fail.
+  unlink(path);
+  if (bind(listener, (struct sockaddr *)&address, sizeof(address)) < 0 ||
+      listen(listener, SOMAXCONN) < 0) {
+    perror(path);
+    close(listener);
+    return false;
+  }
+
+  // No SA_RESTART, so the signals interrupt wait() below.
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = stop;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+
+  // Anything buffered would otherwise be written by every worker too.
+  flushOutput(&vm.output);
+  fflush(stdout);
+  fflush(stderr);
+
+  if (workers < 1) {
+    workers = 1;
+  }
+  pid_t *pids = (pid_t *)malloc(sizeof(pid_t) * workers);
+  for (int i = 0; i < workers; i++) {
+    pids[i] = spawnWorker(listener);
+  }
+
+  while (!stopping) {
+    int status;
+    pid_t pid = wait(&status);
+    if (pid < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+    // A crashed worker is replaced, the others keep serving meanwhile.
+    for (int i = 0; i < workers; i++) {
+      if (pids[i] == pid && !stopping) {
+        pids[i] = spawnWorker(listener);
+      }
+    }
+  }
+
+  for (int i = 0; i < workers; i++) {
+    if (pids[i] > 0) {
+      kill(pids[i], SIGTERM);
+    }
+  }
+  for (int i = 0; i < workers; i++) {
+    if (pids[i] > 0) {
+      waitpid(pids[i], NULL, 0);
+    }
+  }
+  free(pids);
+  close(listener);
+  unlink(path);
+  freeFrozenChunks(&preloaded);
+  return true;
+}
@@ -0,0 +1,305 @@
+#include "transpiler.h"
+#include "debug.h"
+#include "object.h"
+#include "value.h"
+#include <math.h>
+
+// Translates a compiled chunk into a C translation unit, one block of
+// straight-line C per instruction. The generated function links against the
+// runtime in libloxcore and behaves exactly like interpretChunk() would:
+//
+//   InterpretResult name(const Value *inputs);
+//
+// `inputs` holds the values of the inputs the chunk was compiled with, as
+// for interpretInputs().
+//
+// Lox has no control flow yet, so the depth of the stack at every
+// instruction is known while translating. Each stack slot becomes a local
+// `Value sN`, which lets the C compiler keep values in registers and fold
+// away the type checks on constants.
+//
+// The host must have called initVM(), strings are allocated on its heap.
+// Compiling the output with -DCLOX_TRANSPILED_MAIN also emits a main() which
+// does that, handy for running a translated script on its own. It takes the
+// inputs as numbers from its arguments.
+
+// Writes a string as a C string literal, escaping anything that isn't
+// printable or could end the literal or form a trigraph.
+static void writeStringLiteral(FILE *out, const char *chars, int length) {
+  fputc('"', out);
+  for (int i = 0; i < length; i++) {
+    unsigned char c = (unsigned char)chars[i];
+    if (c == '"' || c == '\\' || c == '?') {
+      fprintf(out, "\\%c", c);
+    } else if (c < ' ' || c > '~') {
+      // Octal escapes take at most three digits, so they can't swallow the
+      // character that follows like hex escapes would.
+      fprintf(out, "\\%03o", c);
+    } else {
+      fputc(c, out);
+    }
+  }
+  fputc('"', out);
+}
+
+// Writes a number as a C expression. Finite numbers are hex float literals
+// so they round trip exactly, the rest the <math.h> macros printf has no
+// literal for.
+static void writeNumber(FILE *out, double number) {
+  if (isnan(number)) {
+    fprintf(out, "NAN");
+  } else if (isinf(number)) {
+    fprintf(out, number > 0 ? "INFINITY" : "-INFINITY");
+  } else {
+    fprintf(out, "%a", number);
+  }
+}
+
+// Writes the C expression creating a constant.
+static void writeConstant(FILE *out, Value value) {
+  switch (value.type) {
+  case VAL_BOOL:
+    fprintf(out, "BOOL_VAL(%s)", AS_BOOL(value) ? "true" : "false");
+    break;
+  case VAL_NIL:
+    fprintf(out, "NIL_VAL");
+    break;
+  case VAL_NUMBER:
+    fprintf(out, "NUMBER_VAL(");
+    writeNumber(out, AS_NUMBER(value));
+    fprintf(out, ")");
+    break;
+  case VAL_OBJ: {
+    ObjString *string = AS_STRING(value);
+    fprintf(out, "OBJ_VAL(copyString(");
+    writeStringLiteral(out, string->chars, string->length);
+    fprintf(out, ", %d))", string->length);
+    break;
+  }
+  }
+}
+
+// Writes the check every numeric binary op starts with.
+static void writeNumberGuard(FILE *out, int a, int b, int line) {
+  fprintf(out,
+          "  if (!IS_NUMBER(s%d) || !IS_NUMBER(s%d)) {\n"
+          "    return runtimeError(\"Operands must be numbers.\", %d);\n"
+          "  }\n",
+          a, b, line);
+}
+
+// Writes a numeric binary op, `wrap` being the macro wrapping its result.
+static void writeBinaryOp(FILE *out, int a, int b, int line, const char *wrap,
+                          const char *op) {
+  writeNumberGuard(out, a, b, line);
+  fprintf(out, "  s%d = %s(AS_NUMBER(s%d) %s AS_NUMBER(s%d));\n", a, wrap, a,
+          op, b);
+}
+
+// Writes the prologue shared by every translation unit.
+static void writePrologue(FILE *out) {
+  fprintf(out, "#include <math.h>\n"
+               "#include <stdio.h>\n"
+               "\n"
+               "#include \"common.h\"\n"
+               "#include \"object.h\"\n"
+               "#include \"value.h\"\n"
+               "#include \"vm.h\"\n"
+               "\n"
+               "// Reports a runtime error the way the interpreter does.\n"
+               "static InterpretResult runtimeError(const char *message, "
+               "int line) {\n"
+               "  flushOutput(&vm.output);\n"
+               "  fprintf(stderr, \"%%s\\n[line %%d] in script\\n\", message, "
+               "line);\n"
+               "  return INTERPRET_RUNTIME_ERROR;\n"
+               "}\n\n");
+}
+
+// Writes the chunk as a C function called `name` to `out`.
+// Returns false if the chunk contains something that can't be translated.
+bool transpile(Chunk *chunk, FILE *out, const char *name) {
+  int slots = maxStackDepth(chunk);
+  if (slots < 0) {
+    return false;
+  }
+  for (int offset = 0; offset < chunk->count;
+       offset += instructionLength(chunk->code[offset])) {
+    if (opcodeName(chunk->code[offset]) == NULL) {
+      return false;
+    }
+  }
+
+  writePrologue(out);
+  fprintf(out, "InterpretResult %s(const Value *inputs) {\n", name);
+  if (chunk->inputCount == 0) {
+    fprintf(out, "  (void)inputs;\n");
+  }
+  for (int slot = 0; slot < slots; slot++) {
+    fprintf(out, "  Value s%d;\n", slot);
+  }
+
+  // Slot of the value on top of the stack, -1 while the stack is empty.
+  int top = -1;
+  for (int offset = 0; offset < chunk->count;
+       offset += instructionLength(chunk->code[offset])) {
+    uint8_t instruction = chunk->code[offset];
+    int line = chunk->lines[offset];
+    fprintf(out, "  // %s\n", opcodeName(instruction));
+
+    switch (instruction) {
+    case OP_CONSTANT:
+      fprintf(out, "  s%d = ", ++top);
+      writeConstant(out,
+                    chunk->constants.values[chunk->code[offset + 1]]);
+      fprintf(out, ";\n");
+      break;
+    case OP_NIL:
+      fprintf(out, "  s%d = NIL_VAL;\n", ++top);
+      break;
+    case OP_TRUE:
+      fprintf(out, "  s%d = BOOL_VAL(true);\n", ++top);
+      break;
+    case OP_FALSE:
+      fprintf(out, "  s%d = BOOL_VAL(false);\n", ++top);
+      break;
+    case OP_ZERO:
+    case OP_ONE:
+      fprintf(out, "  s%d = NUMBER_VAL(%d);\n", ++top,
+              instruction == OP_ONE);
+      break;
+    case OP_SMALL_INT:
+      fprintf(out, "  s%d = NUMBER_VAL(%d);\n", ++top,
+              (int8_t)chunk->code[offset + 1]);
+      break;
+    case OP_SHORT_INT:
+      fprintf(out, "  s%d = NUMBER_VAL(%d);\n", ++top,
+              readShortInt(&chunk->code[offset + 1]));
+      break;
+    case OP_GET_INPUT:
+      fprintf(out, "  s%d = inputs[%d];\n", ++top, chunk->code[offset + 1]);
+      break;
+    case OP_DUP:
+      fprintf(out, "  s%d = s%d;\n", top + 1, top);
+      top++;
+      break;
+    case OP_PICK:
+      fprintf(out, "  s%d = s%d;\n", top + 1, top - chunk->code[offset + 1]);
+      top++;
+      break;
+    case OP_CONCAT: {
+      int count = chunk->code[offset + 1];
+      int first = top - count + 1;
+      for (int slot = first; slot <= top; slot++) {
+        fprintf(out, "  push(s%d);\n", slot);
+      }
+      fprintf(out,
+              "  if (!concatenateMany(%d)) {\n"
+              "    return runtimeError(\"Operands must be two numbers or two "
+              "strings.\", %d);\n"
+              "  }\n"
+              "  s%d = pop();\n",
+              count, line, first);
+      top = first;
+      break;
+    }
+    case OP_EQUAL:
+      fprintf(out, "  s%d = BOOL_VAL(valuesEqual(s%d, s%d));\n", top - 1,
+              top - 1, top);
+      top--;
+      break;
+    // Quickened instructions only exist in chunks that were run already,
+    // they translate like their generic forms.
+    case OP_GREATER:
+    case OP_GREATER_NUM:
+      writeBinaryOp(out, top - 1, top, line, "BOOL_VAL", ">");
+      top--;
+      break;
+    case OP_LESS:
+    case OP_LESS_NUM:
+      writeBinaryOp(out, top - 1, top, line, "BOOL_VAL", "<");
+      top--;
+      break;
+    case OP_ADD:
+    case OP_ADD_NUM:
+    case OP_ADD_STR:
+      fprintf(out,
+              "  if (IS_STRING(s%d) && IS_STRING(s%d)) {\n"
+              "    push(s%d);\n"
+              "    push(s%d);\n"
+              "    concatenate();\n"
+              "    s%d = pop();\n"
+              "  } else if (IS_NUMBER(s%d) && IS_NUMBER(s%d)) {\n"
+              "    s%d = NUMBER_VAL(AS_NUMBER(s%d) + AS_NUMBER(s%d));\n"
+              "  } else {\n"
+              "    return runtimeError(\"Operands must be two numbers or two "
+              "strings.\", %d);\n"
+              "  }\n",
+              top - 1, top, top - 1, top, top - 1, top - 1, top, top - 1,
+              top - 1, top, line);
+      top--;
+      break;
+    case OP_SUBTRACT:
+    case OP_SUBTRACT_NUM:
+      writeBinaryOp(out, top - 1, top, line, "NUMBER_VAL", "-");
+      top--;
+      break;
+    case OP_MULTIPLY:
+    case OP_MULTIPLY_NUM:
+      writeBinaryOp(out, top - 1, top, line, "NUMBER_VAL", "*");
+      top--;
+      break;
+    case OP_DIVIDE:
+    case OP_DIVIDE_NUM:
+      writeBinaryOp(out, top - 1, top, line, "NUMBER_VAL", "/");
+      top--;
+      break;
+    case OP_NOT:
+      fprintf(out,
+              "  s%d = BOOL_VAL(IS_NIL(s%d) || (IS_BOOL(s%d) && "
+              "!AS_BOOL(s%d)));\n",
+              top, top, top, top);
+      break;
+    case OP_NEGATE:
+      fprintf(out,
+              "  if (!IS_NUMBER(s%d)) {\n"
+              "    return runtimeError(\"Operand must be a number.\", %d);\n"
+              "  }\n"
+              "  s%d = NUMBER_VAL(-AS_NUMBER(s%d));\n",
+              top, line, top, top);
+      break;
+    case OP_RETURN:
+      fprintf(out,
+              "  printValue(s%d);\n"
+              "  writeOutput(&vm.output, \"\\n\", 1);\n"
+              "  return INTERPRET_OK;\n",
+              top);
+      top--;
+      break;
+    }
+  }
+
+  fprintf(out, "}\n\n");
+  fprintf(out,
+          "#ifdef CLOX_TRANSPILED_MAIN\n"
+          "#include <stdlib.h>\n"
+          "\n"
+          "int main(int argc, const char *argv[]) {\n"
+          "  Value inputs[%d];\n"
+          "  if (argc != %d) {\n"
+          "    fprintf(stderr, \"Expected %d inputs.\\n\");\n"
+          "    return 64;\n"
+          "  }\n"
+          "  for (int i = 1; i < argc; i++) {\n"
+          "    inputs[i - 1] = NUMBER_VAL(strtod(argv[i], NULL));\n"
+          "  }\n"
+          "  initVM();\n"
+          "  InterpretResult result = %s(inputs);\n"
+          "  freeVM();\n"
+          "  return result == INTERPRET_OK ? 0 : 70;\n"
+          "}\n"
+          "#endif\n",
+          chunk->inputCount > 0 ? chunk->inputCount : 1,
+          chunk->inputCount + 1, chunk->inputCount, name);
+  return true;
+}
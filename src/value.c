@@ -1,9 +1,11 @@
 #include <stdio.h>
 #include <string.h>
 
+#include "dtoa.h"
 #include "memory.h"
 #include "object.h"
 #include "value.h"
+#include "vm.h"
 
 // Initializes a new dynamic value array
 void initValueArray(ValueArray *array) {
@@ -35,15 +37,22 @@ void freeValueArray(ValueArray *array) {
 void printValue(Value value) {
   switch (value.type) {
   case VAL_BOOL: {
-    printf(AS_BOOL(value) ? "true" : "false");
+    if (AS_BOOL(value)) {
+      writeOutput(&vm.output, "true", 4);
+    } else {
+      writeOutput(&vm.output, "false", 5);
+    }
     break;
   }
   case VAL_NIL: {
-    printf("nil");
+    writeOutput(&vm.output, "nil", 3);
     break;
   }
   case VAL_NUMBER: {
-    printf("%g", AS_NUMBER(value));
+    // The shortest digits that read back as the same number, see dtoa.c.
+    char buffer[DTOA_BUFFER_SIZE];
+    int length = formatNumber(AS_NUMBER(value), buffer);
+    writeOutput(&vm.output, buffer, length);
     break;
   }
   case VAL_OBJ: {
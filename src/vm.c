@@ -2,20 +2,29 @@
 #include "chunk.h"
 #include "common.h"
 #include "compiler.h"
+#include "counters.h"
 #include "debug.h"
+#include "jit.h"
 #include "memory.h"
 #include "object.h"
+#include "optimizer.h"
+#include "profiler.h"
+#include "sampler.h"
 #include "value.h"
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
-#include <sys/_types/_va_list.h>
+#include <unistd.h>
 
-VM vm;
+// Forces a function to be inlined so constant arguments specialise it.
+#if defined(__GNUC__)
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+#define ALWAYS_INLINE inline
+#endif
 
-// Returns a value some distance from the top of the stack without popping it.
-static Value peek(int distance) { return vm.stackTop[-1 - distance]; }
+VM vm;
 
 // Returns a bool of true if False or nil, else true.
 // Lox borrows from Ruby. Only False and nil are falsey. 0 is true.
@@ -26,7 +35,7 @@ static bool isFalsey(Value value) {
 // Concatenates two string Object Values from the stack.
 // Pops them off, Allocates a new char array with combined length and copies
 // both halves into it. Finally pushes new string as Obj Value to the stack
-static void concatenate() {
+void concatenate() {
   ObjString *b = AS_STRING(pop());
   ObjString *a = AS_STRING(pop());
 
@@ -42,6 +51,48 @@ static void concatenate() {
   push(OBJ_VAL(result));
 }
 
+// Adds the top `count` values of the stack from the bottom one up, as
+// `count - 1` additions would, and replaces them with the sum. Strings are
+// only concatenated once all of them are known to be strings, so the result
+// is allocated and each piece copied just once.
+// Returns false, with the values popped, if one of the additions would fail.
+bool concatenateMany(int count) {
+  Value *operands = vm.stackTop - count;
+  vm.stackTop = operands;
+  int length = 0;
+  bool strings = true;
+  for (int i = 0; i < count && strings; i++) {
+    strings = IS_STRING(operands[i]);
+    length += strings ? AS_STRING(operands[i])->length : 0;
+  }
+
+  if (strings) {
+    char *chars = ALLOCATE(char, length + 1);
+    char *end = chars;
+    for (int i = 0; i < count; i++) {
+      ObjString *string = AS_STRING(operands[i]);
+      memcpy(end, string->chars, string->length);
+      end += string->length;
+    }
+    *end = '\0';
+    push(OBJ_VAL(takeString(chars, length)));
+    return true;
+  }
+
+  // A sum that isn't all strings only succeeds if it is all numbers. Had it
+  // started with strings, the failing addition wouldn't have left anything
+  // behind either.
+  double sum = 0;
+  for (int i = 0; i < count; i++) {
+    if (!IS_NUMBER(operands[i])) {
+      return false;
+    }
+    sum = i == 0 ? AS_NUMBER(operands[i]) : sum + AS_NUMBER(operands[i]);
+  }
+  push(NUMBER_VAL(sum));
+  return true;
+}
+
 // Set stackTop ptr to point to beginning of stack to indicate its empty
 static void resetStack() {
   // Since stack won't be used till values are stored inside
@@ -49,15 +100,17 @@ static void resetStack() {
   vm.stackTop = vm.stack;
 }
 
-// Prints an runtime error to stderr
+// Prints an runtime error to vm.errors
 static void runtimeError(const char *format, ...) {
+  // What the script printed so far comes first.
+  flushOutput(&vm.output);
   // allows fn to be variadic, passing arbitrary number of arguments.
   va_list args;
   va_start(args, format);
-  // fprintf variant that accepts an explicit va_list.
-  vfprintf(stderr, format, args);
+  // printOutput variant that accepts an explicit va_list.
+  printOutputList(&vm.errors, format, args);
   va_end(args);
-  fputs("\n", stderr);
+  writeOutput(&vm.errors, "\n", 1);
 
   // Get index of instruction in chunk - 1
   // because ip advances past instruction before executing it
@@ -65,93 +118,233 @@ static void runtimeError(const char *format, ...) {
   // Look into chunk's debug line array.
   int line = vm.chunk->lines[instruction];
   // BONUS: Stack trace... when there's a call stack to trace.
-  fprintf(stderr, "[line %d] in script\n", line);
+  printOutput(&vm.errors, "[line %d] in script\n", line);
+  flushOutput(&vm.errors);
   resetStack();
 }
 
+// Adds what the perf counters counted since `counted` to `opcode`, unless
+// it is -1, and updates `counted` for the next one.
+static void countOpcode(int opcode, uint64_t *counted) {
+  uint64_t now[COUNTER_EVENTS];
+  readCounters(now);
+  if (opcode >= 0) {
+    for (int i = 0; i < COUNTER_EVENTS; i++) {
+      profile.events[opcode][i] += now[i] - counted[i];
+    }
+  }
+  memcpy(counted, now, sizeof(now));
+}
+
 // Handles decoding or dispatching the instruction.
-static InterpretResult run() {
+// Only ever called with a constant `profiling`, once per value from run(),
+// so the non-profiling copy of the loop carries no profiling code at all.
+//
+// The top of the stack is cached in the local `top`, which the compiler can
+// keep in registers, and the stack pointer in the local `sp`. Everything
+// below the top lives in vm.stack[0..sp). So unary ops work on `top` without
+// touching memory and binary ops load only their left operand. The stack
+// starts with a nil sentinel as its cached top, the first push spills it
+// into vm.stack[0] and the final pop of OP_RETURN restores it. A stack that
+// isn't empty on entry, left by native code, is picked up from there.
+static ALWAYS_INLINE InterpretResult execute(bool profiling) {
 // Reads byte currently pointed at by IP then advances IP
 #define READ_BYTE() (*vm.ip++)
 // Reads next byte from bytecode using it as index into chunk constants
 #define READ_CONSTANT() (vm.chunk->constants.values[READ_BYTE()])
+// Pushes a value, spilling the previously cached top into memory.
+#define PUSH(value)                                                            \
+  do {                                                                         \
+    *sp++ = top;                                                               \
+    top = (value);                                                             \
+  } while (false)
+// Second value from the top, the left operand of a binary op.
+#define SECOND() (sp[-1])
+// Writes the cached top back so vm.stackTop describes the whole stack, for
+// code outside this loop which uses push() and pop().
+#define SPILL()                                                                \
+  do {                                                                         \
+    *sp = top;                                                                 \
+    vm.stackTop = sp + 1;                                                      \
+  } while (false)
+// Picks the stack back up after a SPILL() and a call which used it.
+#define RELOAD()                                                               \
+  do {                                                                         \
+    sp = vm.stackTop - 1;                                                      \
+    top = *sp;                                                                 \
+  } while (false)
 // Binary ops only differ in the actual operator they use.
 // This abstracts the boilerplate of shared for binary operations.
 // do-while used to expand multi-statement macro with semicolon at the end.
 // Check that both operands are numbers else throws a runtime error.
-// If numbers, pops and unwraps Value types to doubles and executes operator
-// and re-wraps \using valueType\ passed in before pushing back to the stack.
+// If numbers, pops the left operand, computes the result into the cached
+// top, re-wrapping it \using valueType\ passed in.
 // NOTE: Pretty big macro... not neccecarily good C practice
 #define BINARY_OP(valueType, op)                                               \
   do {                                                                         \
-    if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) {                          \
+    if (!IS_NUMBER(top) || !IS_NUMBER(SECOND())) {                             \
       runtimeError("Operands must be numbers.");                               \
       return INTERPRET_RUNTIME_ERROR;                                          \
     }                                                                          \
-    double b = AS_NUMBER(pop());                                               \
-    double a = AS_NUMBER(pop());                                               \
-    push(valueType(a op b));                                                   \
+    NUMBER_OP(valueType, op);                                                  \
+  } while (false)
+// Unchecked form of BINARY_OP for quickened instructions whose guard has
+// already established both operands are numbers.
+#define NUMBER_OP(valueType, op)                                               \
+  do {                                                                         \
+    double a = AS_NUMBER(*--sp);                                               \
+    top = valueType(a op AS_NUMBER(top));                                      \
+  } while (false)
+// Guard of the quickened numeric instructions.
+#define BOTH_NUMBERS() (IS_NUMBER(top) && IS_NUMBER(SECOND()))
+// Rewrites the instruction being executed into `opcode` so its next
+// execution skips the generic type checks. Frozen chunks stay as they are.
+#define QUICKEN(opcode)                                                        \
+  do {                                                                         \
+    if (quickening) {                                                          \
+      vm.ip[-1] = (opcode);                                                    \
+    }                                                                          \
   } while (false)
+// Reverts a quickened instruction whose guard failed back to its generic
+// form and backs up ip so the generic form executes right away.
+#define DEOPTIMIZE(opcode)                                                     \
+  do {                                                                         \
+    vm.ip[-1] = (opcode);                                                      \
+    vm.ip--;                                                                   \
+  } while (false)
+
+  Value *sp = vm.stackTop;
+  Value top = NIL_VAL;
+  if (vm.stackTop > vm.stack) {
+    RELOAD();
+  }
+  bool quickening = !vm.chunk->frozen;
+
+  // Opcode dispatched before the current one, and when it was dispatched.
+  int previous = -1;
+  uint64_t started = 0;
+  // Perf counters are attributed to opcodes like cycles, when open.
+  bool counting = profiling && vm.counting;
+  uint64_t counted[COUNTER_EVENTS] = {0};
 
   while (true) {
 #ifdef DEBUG_TRACE_EXECUTION
-    printf("          ");
-    // Print every value in the stack from bottom to top
-    // start at initial addr of stack, stop at last addr as marked by stackTop
-    for (Value *slot = vm.stack; slot < vm.stackTop; slot++) {
-      printf("[ ");
+    writeOutput(&vm.output, "          ", 10);
+    // Print every value in the stack from bottom to top, skipping the
+    // sentinel in the first slot.
+    SPILL();
+    for (Value *slot = vm.stack + 1; slot < vm.stackTop; slot++) {
+      writeOutput(&vm.output, "[ ", 2);
       printValue(*slot);
-      printf(" ]");
+      writeOutput(&vm.output, " ]", 2);
     }
-    printf("\n");
+    writeOutput(&vm.output, "\n", 1);
     // Since current instruction reference is stored as direct pointer
     // We must convert IP back to relative offset from begining of bytecode
     // Then disassemble instruction beginning at that byte
     disassembleInstruction(vm.chunk, (int)(vm.ip - vm.chunk->code));
 #endif
     uint8_t instruction = READ_BYTE();
+    if (profiling) {
+      uint64_t now = readCycleCounter();
+      profile.counts[instruction]++;
+      if (previous >= 0) {
+        profile.cycles[previous] += now - started;
+        profile.pairs[previous][instruction]++;
+      }
+      if (counting) {
+        countOpcode(previous, counted);
+      }
+      previous = instruction;
+      started = now;
+    }
     // NOTE: This isn't the fastest way to handle bytecode dispatch
     // (see: Computed goto, jump table, direct threaded code)
     // switch-case is used here because it is simple and within standard library
     switch (instruction) {
     case OP_CONSTANT: {
       Value constant = READ_CONSTANT();
-      push(constant);
+      PUSH(constant);
       break;
     }
     case OP_NIL: {
-      push(NIL_VAL);
+      PUSH(NIL_VAL);
       break;
     }
     case OP_TRUE: {
-      push(BOOL_VAL(true));
+      PUSH(BOOL_VAL(true));
       break;
     }
     case OP_FALSE: {
-      push(BOOL_VAL(false));
+      PUSH(BOOL_VAL(false));
+      break;
+    }
+    case OP_ZERO: {
+      PUSH(NUMBER_VAL(0));
+      break;
+    }
+    case OP_ONE: {
+      PUSH(NUMBER_VAL(1));
+      break;
+    }
+    case OP_SMALL_INT: {
+      PUSH(NUMBER_VAL((int8_t)READ_BYTE()));
+      break;
+    }
+    case OP_SHORT_INT: {
+      vm.ip += 2;
+      PUSH(NUMBER_VAL(readShortInt(vm.ip - 2)));
+      break;
+    }
+    case OP_GET_INPUT: {
+      Value input = vm.inputs[READ_BYTE()];
+      PUSH(input);
+      break;
+    }
+    case OP_DUP: {
+      PUSH(top);
+      break;
+    }
+    case OP_PICK: {
+      // Read before PUSH() moves sp.
+      Value value = sp[-READ_BYTE()];
+      PUSH(value);
+      break;
+    }
+    case OP_CONCAT: {
+      int count = READ_BYTE();
+      SPILL();
+      if (!concatenateMany(count)) {
+        runtimeError("Operands must be two numbers or two strings.");
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      RELOAD();
       break;
     }
     case OP_EQUAL: {
-      Value b = pop();
-      Value a = pop();
-      push(BOOL_VAL(valuesEqual(a, b)));
+      Value a = *--sp;
+      top = BOOL_VAL(valuesEqual(a, top));
       break;
     }
     case OP_GREATER: {
       BINARY_OP(BOOL_VAL, >);
+      QUICKEN(OP_GREATER_NUM);
       break;
     }
     case OP_LESS: {
       BINARY_OP(BOOL_VAL, <);
+      QUICKEN(OP_LESS_NUM);
       break;
     }
     case OP_ADD: {
-      if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
+      if (IS_STRING(top) && IS_STRING(SECOND())) {
+        QUICKEN(OP_ADD_STR);
+        SPILL();
         concatenate();
-      } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
-        double b = AS_NUMBER(pop());
-        double a = AS_NUMBER(pop());
-        push(NUMBER_VAL(a + b));
+        RELOAD();
+      } else if (BOTH_NUMBERS()) {
+        QUICKEN(OP_ADD_NUM);
+        NUMBER_OP(NUMBER_VAL, +);
       } else {
         runtimeError("Operands must be two numbers or two strings.");
         return INTERPRET_RUNTIME_ERROR;
@@ -160,36 +353,104 @@ static InterpretResult run() {
     }
     case OP_SUBTRACT: {
       BINARY_OP(NUMBER_VAL, -);
+      QUICKEN(OP_SUBTRACT_NUM);
       break;
     }
     case OP_MULTIPLY: {
       BINARY_OP(NUMBER_VAL, *);
+      QUICKEN(OP_MULTIPLY_NUM);
       break;
     }
     case OP_DIVIDE: {
       BINARY_OP(NUMBER_VAL, /);
+      QUICKEN(OP_DIVIDE_NUM);
+      break;
+    }
+    case OP_GREATER_NUM: {
+      if (!BOTH_NUMBERS()) {
+        DEOPTIMIZE(OP_GREATER);
+        break;
+      }
+      NUMBER_OP(BOOL_VAL, >);
+      break;
+    }
+    case OP_LESS_NUM: {
+      if (!BOTH_NUMBERS()) {
+        DEOPTIMIZE(OP_LESS);
+        break;
+      }
+      NUMBER_OP(BOOL_VAL, <);
+      break;
+    }
+    case OP_ADD_NUM: {
+      if (!BOTH_NUMBERS()) {
+        DEOPTIMIZE(OP_ADD);
+        break;
+      }
+      NUMBER_OP(NUMBER_VAL, +);
+      break;
+    }
+    case OP_ADD_STR: {
+      if (!IS_STRING(top) || !IS_STRING(SECOND())) {
+        DEOPTIMIZE(OP_ADD);
+        break;
+      }
+      SPILL();
+      concatenate();
+      RELOAD();
+      break;
+    }
+    case OP_SUBTRACT_NUM: {
+      if (!BOTH_NUMBERS()) {
+        DEOPTIMIZE(OP_SUBTRACT);
+        break;
+      }
+      NUMBER_OP(NUMBER_VAL, -);
+      break;
+    }
+    case OP_MULTIPLY_NUM: {
+      if (!BOTH_NUMBERS()) {
+        DEOPTIMIZE(OP_MULTIPLY);
+        break;
+      }
+      NUMBER_OP(NUMBER_VAL, *);
+      break;
+    }
+    case OP_DIVIDE_NUM: {
+      if (!BOTH_NUMBERS()) {
+        DEOPTIMIZE(OP_DIVIDE);
+        break;
+      }
+      NUMBER_OP(NUMBER_VAL, /);
       break;
     }
     case OP_NOT: {
       // isFalsey would return true for false -> inverting it
-      push(BOOL_VAL(isFalsey(pop())));
+      top = BOOL_VAL(isFalsey(top));
       break;
     }
     case OP_NEGATE: {
-      // Pops the top value in the stack, negates it and replaces it back
-      // BONUS: might be faster to simply negate the value in place without
-      // messing with stackTop
-      // Peek top of stack and check if its a number.
-      if (!IS_NUMBER(peek(0))) {
+      // Negates the cached top in place, the stack itself is untouched.
+      if (!IS_NUMBER(top)) {
         runtimeError("Operand must be a number.");
         return INTERPRET_RUNTIME_ERROR;
       }
-      push(NUMBER_VAL(-AS_NUMBER(pop())));
+      top = NUMBER_VAL(-AS_NUMBER(top));
       break;
     }
     case OP_RETURN: {
-      printValue(pop());
-      printf("\n");
+      // Popping the result, and any values CSE kept below it, leaves just the
+      // sentinel, which was never really on the stack, so the stack ends
+      // where it started.
+      vm.stackTop = vm.stack;
+      printValue(top);
+      writeOutput(&vm.output, "\n", 1);
+      if (profiling) {
+        profile.cycles[OP_RETURN] += readCycleCounter() - started;
+      }
+      if (counting) {
+        countOpcode(OP_RETURN, counted);
+      }
       return INTERPRET_OK;
     }
     }
@@ -197,16 +458,51 @@ static InterpretResult run() {
 
 #undef READ_BYTE
 #undef READ_CONSTANT
+#undef PUSH
+#undef SECOND
+#undef SPILL
+#undef RELOAD
 #undef BINARY_OP
+#undef NUMBER_OP
+#undef BOTH_NUMBERS
+#undef QUICKEN
+#undef DEOPTIMIZE
+}
+
+static InterpretResult run() {
+  if (vm.profiling) {
+    return execute(true);
+  }
+  return execute(false);
 }
 
 // Initializes the VM
 void initVM() {
   resetStack();
-  vm.objects = NULL;
+  initHeap(&vm.heap);
+  vm.inputs = NULL;
+  initCache(&vm.cache, CACHE_DEFAULT_BUDGET);
+  vm.bytesAllocated = 0;
+  vm.allocations = 0;
+  vm.profiling = false;
+  vm.sampling = false;
+  vm.counting = false;
+  vm.jitEnabled = false;
+  vm.jitThreshold = JIT_DEFAULT_THRESHOLD;
+  vm.passes = PASS_ALL;
+  vm.fuel = FUEL_UNLIMITED;
+  initOutput(&vm.output);
+  initOutput(&vm.errors);
+  outputToFd(&vm.errors, STDERR_FILENO);
+  vm.chunk = NULL;
 }
 
-void freeVM() { freeObjects(); }
+void freeVM() {
+  freeOutput(&vm.output);
+  freeOutput(&vm.errors);
+  freeCache(&vm.cache);
+  freeObjects();
+}
 
 // Appends a value to the end of the stack and increments the stackTop pointer
 void push(Value value) {
@@ -226,11 +522,76 @@ Value pop() {
   return *vm.stackTop;
 }
 
+// Whether a run of the chunk stays within vm.fuel.
+bool hasFuelFor(Chunk *chunk) {
+  if (vm.fuel == FUEL_UNLIMITED) {
+    return true;
+  }
+  int cost = chunk->fuelCost >= 0 ? chunk->fuelCost : countFuel(chunk);
+  return cost <= vm.fuel;
+}
+
+// Executes an already compiled chunk from its first instruction.
+// The chunk is still owned by the caller, so it can be run again.
+InterpretResult interpretChunk(Chunk *chunk) {
+  // The entry is the only block boundary, see VM.fuel.
+  if (!hasFuelFor(chunk)) {
+    return INTERPRET_OUT_OF_FUEL;
+  }
+  resetStack();
+  vm.chunk = chunk;
+  vm.ip = vm.chunk->code;
+  if (vm.counting) {
+    startCounters(PHASE_RUN);
+  }
+
+  // Profiling counts every opcode, so it always runs the interpreter. Frozen
+  // chunks can't record their hotness nor the code compiled for them.
+  if (vm.jitEnabled && !vm.profiling && !chunk->frozen) {
+    if (chunk->jitCode == NULL && ++chunk->hotness >= vm.jitThreshold) {
+      compileJit(chunk);
+    }
+    if (chunk->jitCode != NULL) {
+      // Native code runs as far as it can, the interpreter does the rest.
+      vm.ip = chunk->code + runJit(chunk);
+    }
+  }
+
+  InterpretResult result = run();
+  if (vm.counting) {
+    stopCounters(PHASE_RUN);
+  }
+
+  // Samples are bytecode offsets, resolve them while the chunk still exists.
+  if (vm.sampling) {
+    collectSamples(chunk);
+  }
+  vm.chunk = NULL;
+  return result;
+}
+
+// Executes a chunk compiled with compileInputs(), reading its inputs from
+// `inputs`, which must hold a value for each of them.
+InterpretResult interpretInputs(Chunk *chunk, const Value *inputs) {
+  vm.inputs = inputs;
+  InterpretResult result = interpretChunk(chunk);
+  vm.inputs = NULL;
+  return result;
+}
+
 // Compiler the input source string into bytecode.
 // Creates an empty chunk and passes it to the compiler.
 // If compile success, sets vm bytecode chunk to compile result.
+// Source that was compiled before runs straight from vm.cache.
 // Returns an InterpretResult
 InterpretResult interpret(const char *source) {
+  int length = (int)strlen(source);
+  uint32_t hash = hashSource(source, length);
+  Chunk *cached = findChunk(&vm.cache, source, length, vm.passes, hash);
+  if (cached != NULL) {
+    return interpretChunk(cached);
+  }
+
   Chunk chunk;
   initChunk(&chunk);
 
@@ -239,10 +600,13 @@ InterpretResult interpret(const char *source) {
     return INTERPRET_COMPILE_ERROR;
   }
 
-  vm.chunk = &chunk;
-  vm.ip = vm.chunk->code;
+  // Errors aren't cached, the chunk is only kept once it compiled.
+  cached = addChunk(&vm.cache, source, length, vm.passes, hash, &chunk);
+  if (cached != NULL) {
+    return interpretChunk(cached);
+  }
 
-  InterpretResult result = run();
+  InterpretResult result = interpretChunk(&chunk);
 
   freeChunk(&chunk);
   return result;